@@ -1,15 +1,21 @@
 #include "Main.h"
+#include "Downsampler.hpp"
+#include "RangeStats.hpp"
+#include "PageZones.hpp"
+#include "Deflate.hpp"
 #include "DataLogger.hpp"
-#include <CircularBuffer.h>
+#include "RecordRing.hpp"
+#include "RecordPipeline.hpp"
+#include "FlushScheduler.hpp"
+#include "LiveCache.hpp"
+#include "DbColumns.hpp"
 
-#include <byteswap.h>
+#include <cerrno>
 
 namespace
 {
     const constexpr char *kLoggingTag = "Logger";
 
-    AsyncEventSource events("/dataevents");
-
     const constexpr char *dbFilename = "/spiffs/Esp32DataLogger.db";
     const constexpr int dbPageSizeExp = 12; // 4096
     const constexpr char *dbFilenameWithoutFs = &dbFilename[7];
@@ -18,27 +24,190 @@ namespace
     FILE *dbFile;
     byte dbBuffer[1 << dbPageSizeExp];
 
-    bool dbAccessible = false;
+    // the database is recovered by the queue task before its first flush, records are queued until then
+    std::atomic<bool> dbAccessible{false};
+    std::atomic<bool> dbRecovering{false};
     int flushEveryMillis;
-    QueueHandle_t recordQueueHandle;
+    const constexpr int flushCheckMillis = 1000;
+    const constexpr uint32_t notifyManualFlush = 1 << 0;
+    const constexpr uint32_t notifyQueuePressure = 1 << 1;
+    const constexpr uint32_t notifySpill = 1 << 2;
+    const constexpr uint32_t notifyReset = 1 << 3;
+    const constexpr char *flushTriggerNames[] = {"none", "pageFull", "highWater", "maxAge", "manual"};
+    // ~30 bytes per row incl. cell pointer, refined from the pages actually written
+    FlushScheduler flushScheduler(1 << dbPageSizeExp, (1 << dbPageSizeExp) / 30);
+    portMUX_TYPE flushSchedulerMux = portMUX_INITIALIZER_UNLOCKED;
+    uint32_t flushBytesWritten;
+    uint32_t flushLastPageWritten;
+    RecordRing<Record> recordRing;
+    FlushWakeup flushWakeup;
+    const constexpr size_t recordBatchSize = 32;
+
+    std::atomic<OverflowPolicy> overflowPolicy{OverflowPolicy::DropNewest};
+    // changes are applied by the queue task between flushes, a flush decides once how to drain the ring
+    std::atomic<OverflowPolicy> requestedOverflowPolicy{OverflowPolicy::DropNewest};
+    uint32_t decimateCounter;
+    std::atomic<uint32_t> droppedRecords{0}, decimatedRecords{0}, spilledRecords{0}, mergedRecords{0}, unsyncedRecords{0};
+
+    // records spilled to flash while the ring is full, only ever appended to and merged on the next flush
+    const constexpr char *spillFilename = "/spiffs/overflow.bin";
+    const constexpr char *spillFilenameWithoutFs = &spillFilename[7];
+    const constexpr long spillMaxBytes = 256 * 1024;
+    // the sampling task only pushes spilled records to this ring, the queue task writes them to the spill file
+    RecordRing<Record> spillRing;
+    const constexpr size_t spillRingLength = 256;
+    SemaphoreHandle_t spillMutex = xSemaphoreCreateMutex();
+    std::atomic<bool> spilling{false};
+    FILE *spillFile;
+    long spillFileBytes;
+    // bytes at the start of the spill file merged by a flush that failed later on, the next flush continues after them
+    long spillMergedBytes;
+    // bytes in the spill file from before the last reset, boot relative timestamps in there can't be fixed up
+    long spillPreviousBootBytes;
+
+    // records taken before the time was synced, moved there from the ring by the queue task instead of holding up
+    // the flushes until NTP syncs, they are older than everything in the ring and the spill file
+    const constexpr char *unsyncedFilename = "/spiffs/unsynced.bin";
+    const constexpr char *unsyncedFilenameWithoutFs = &unsyncedFilename[7];
+    long unsyncedFileBytes;
+    // bytes at the start of the unsynced file merged by a flush that failed later on
+    long unsyncedMergedBytes;
     TaskHandle_t queueTaskHandle;
 
-    struct dblog_read_context dataReadDbContext;
-    time_t dataReadLastTimestamp;
-    bool dataReadFinalize;
+    // the timestamp of the newest committed record, ranges up to it never change until the database is reset
+    std::atomic<time_t> committedUntil{0};
+    time_t flushLastTimestamp;
+    uint32_t dbGeneration;
+    // always revalidated, the ETag includes the database generation so a reset is noticed, unchanged ranges are a 304
+    const constexpr char *historicalCacheControl = "private, no-cache";
+
+    class DataRequestHandler : public AsyncWebHandler
+    {
+    public:
+        bool canHandle(AsyncWebServerRequest *request) override
+        {
+            if (request->method() != HTTP_GET || request->url() != "/data")
+                return false;
+            request->addInterestingHeader("If-None-Match");
+            request->addInterestingHeader("Accept-Encoding");
+            return true;
+        }
+        void handleRequest(AsyncWebServerRequest *request) override
+        {
+            dataResponseHandler(request);
+        }
+    };
 
-    SemaphoreHandle_t latestRecordsMutex = xSemaphoreCreateMutex();
-    CircularBuffer<Record, latestRecordsBufferSize> latestRecordsBuffer;
+    class DbDownloadHandler : public AsyncWebHandler
+    {
+    public:
+        bool canHandle(AsyncWebServerRequest *request) override
+        {
+            if (request->method() != HTTP_GET || request->url() != "/db")
+                return false;
+            request->addInterestingHeader("Accept-Encoding");
+            return true;
+        }
+        void handleRequest(AsyncWebServerRequest *request) override
+        {
+            dbDownloadHandler(request);
+        }
+    };
+
+    int64_t dbMutexAcquiredMicros;
+    // writers (and everything else blocking on the mutex) go first, readers only take it if nobody is waiting
+    std::atomic<int> dbMutexWaiters{0};
+
+    // responses read the database in slices, each with its own cursor and file handle
+    std::atomic<int> openDbCursors{0};
+    const constexpr int maxDbCursors = 3;
+    const constexpr int64_t dbSliceMicros = 50 * 1000;
+
+    // recent records at full resolution and as rollups, so most /data requests don't need the database
+    LiveCache liveCache;
+    SemaphoreHandle_t liveCacheMutex = xSemaphoreCreateMutex();
+    // without PSRAM the cache takes at most this part of the heap free at setup, WiFi, AsyncTCP, the compressed
+    // responses and the display are set up later and need the rest
+    const constexpr size_t liveCacheHeapDivisor = 6;
+    const constexpr int cacheRowMaxChars = 40;
+
+    // per page summaries of the database for /find, only open for writing while the database is written
+    const constexpr char *zonesFilename = "/spiffs/Esp32DataLogger.zones";
+    FILE *zoneFile;
+    const constexpr uint32_t maxFindIntervals = 500;
+
+    // /data and /db responses are compressed if the client accepts it and they are expected to be at least this large
+    size_t compressMinBytes = 4 * 1024;
+    // each compressed response holds ~14 KB of deflate state, cache backed /data responses don't count against
+    // maxDbCursors, so beyond this responses are sent uncompressed
+    std::atomic<int> activeCompressions{0};
+    const constexpr int maxCompressions = 2;
+
+    const constexpr char *statsChannelNames[RangeStats::ChannelCount] = {"current", "voltage", "power"};
+    const constexpr char *statsIntegralUnits[RangeStats::ChannelCount] = {"mAh", "mVh", "mWh"};
 }
 
-void setupDataLogger(int flushEverySeconds, int queueLength)
+void setupDataLogger(int flushEverySeconds, int queueLength, OverflowPolicy policy)
 {
     ESP_LOGD(kLoggingTag, "Entering setupDataLogger()");
 
-    recoverDb();
+    // recovering the database can take minutes after a reset while writing, so it is left to the queue task
+    dbRecovering = true;
+    dbGeneration = esp_random();
+
+    setOverflowPolicy(policy);
+    // records spilled before a reset have not been merged yet, so keep spilling to preserve the order
+    if (SPIFFS.exists(spillFilenameWithoutFs))
+    {
+        File file = SPIFFS.open(spillFilenameWithoutFs);
+        spillFileBytes = spillPreviousBootBytes = file ? file.size() : 0;
+        file.close();
+        ESP_LOGW(kLoggingTag, "Found %ld bytes of spilled records, merging them with the next flush", spillFileBytes);
+        spilling = true;
+    }
+    // the time was never synced before the reset, so these can't be placed
+    if (SPIFFS.exists(unsyncedFilenameWithoutFs))
+    {
+        File file = SPIFFS.open(unsyncedFilenameWithoutFs);
+        uint32_t lost = file ? file.size() / sizeof(Record) : 0;
+        file.close();
+        SPIFFS.remove(unsyncedFilenameWithoutFs);
+        droppedRecords += lost;
+        ESP_LOGW(kLoggingTag, "Dropped %u records taken before the time was synced in the last boot", lost);
+    }
 
     flushEveryMillis = flushEverySeconds * 1000;
-    recordQueueHandle = xQueueCreate(queueLength, sizeof(Record));
+    FlushPolicy flushPolicy;
+    flushPolicy.maxAgeMillis = flushEveryMillis;
+    flushScheduler.setPolicy(flushPolicy);
+    // the ring lives in PSRAM if available as it might be sized for several minutes of high rate records
+    if (!recordRing.begin(queueLength, allocateLarge))
+    {
+        ESP_LOGE(kLoggingTag, "Error allocating record ring for %d records", queueLength);
+        while (true)
+            ;
+    }
+    ESP_LOGI(kLoggingTag, "Record ring capacity: %u", recordRing.capacity());
+    if (!spillRing.begin(spillRingLength))
+        ESP_LOGE(kLoggingTag, "Error allocating spill ring, records overflowing the ring will be dropped");
+
+    // full resolution a bit beyond the default one hour chart, rollups for the last 6 or 24 hours, less of both if the
+    // heap is short
+    bool havePsram = psramFound();
+    size_t fullResCapacity = havePsram ? 4 * 3600 : 65 * 60;
+    size_t rollupCapacity = havePsram ? 24 * 120 : 6 * 120;
+    size_t cacheBytes = fullResCapacity * sizeof(LiveSample) + rollupCapacity * sizeof(LiveRollup);
+    size_t cacheBudget = havePsram ? cacheBytes : ESP.getFreeHeap() / liveCacheHeapDivisor;
+    if (cacheBudget < cacheBytes)
+    {
+        fullResCapacity = fullResCapacity * cacheBudget / cacheBytes;
+        rollupCapacity = rollupCapacity * cacheBudget / cacheBytes;
+        cacheBytes = fullResCapacity * sizeof(LiveSample) + rollupCapacity * sizeof(LiveRollup);
+    }
+    if (!liveCache.begin(fullResCapacity, rollupCapacity, 30, allocateLarge))
+        ESP_LOGE(kLoggingTag, "Error allocating live cache, all requests will be served from the database");
+    else
+        ESP_LOGI(kLoggingTag, "Live cache: %u records, %u rollups, %u bytes of %s", fullResCapacity, rollupCapacity, cacheBytes, havePsram ? "PSRAM" : "heap");
 
     auto createTaskResult = xTaskCreate(queueTask, "recordQueue", 8192 * 2, nullptr, uxTaskPriorityGet(nullptr), &queueTaskHandle);
     if (createTaskResult != pdPASS)
@@ -48,25 +217,11 @@ void setupDataLogger(int flushEverySeconds, int queueLength)
             ;
     }
 
-    asyncWebServer.serveStatic("/", SPIFFS, "/").setDefaultFile("index.htm");
-    asyncWebServer.on("/data", HTTP_GET, dataResponseHandler);
-
-    events.onConnect([](AsyncEventSourceClient *client) {
-        ESP_LOGI(kLoggingTag, "SSE client connected");
-        if (xSemaphoreTake(latestRecordsMutex, 100) == pdTRUE)
-        {
-            // TODO: combine multiple records into one event message as JSON array or do this in a separate (one-off) task
-            using index_t = decltype(latestRecordsBuffer)::index_t;
-            for (index_t i = 0; i < latestRecordsBuffer.size(); i++)
-            {
-                ESP_LOGI(kLoggingTag, "Sending latestRecordsBuffer[%d]", i);
-                // only send a few samples here to avoid AsyncTCP locking up
-                events.send(latestRecordsBuffer[i].toJsonString().c_str());
-            }
-            xSemaphoreGive(latestRecordsMutex);
-        }
-    });
-    asyncWebServer.addHandler(&events);
+    asyncWebServer.addHandler(new DataRequestHandler());
+    asyncWebServer.addHandler(new DbDownloadHandler());
+    asyncWebServer.on("/status", HTTP_GET, statusResponseHandler);
+    asyncWebServer.on("/stats", HTTP_GET, statsResponseHandler);
+    asyncWebServer.on("/find", HTTP_GET, findResponseHandler);
 }
 
 bool isDatabaseAccessible()
@@ -74,58 +229,398 @@ bool isDatabaseAccessible()
     return dbAccessible;
 }
 
-bool addRecord(const Record &record, bool addToRingbuffer)
+bool isDatabaseRecovering()
+{
+    return dbRecovering;
+}
+
+bool addRecord(const Record &record)
 {
     ESP_LOGD(kLoggingTag, "Entering addRecord()");
 
-    events.send(record.toJsonString().c_str());
+    // live clients are served from the cache by the stream publisher, not from the sampling task, records from before
+    // the time was synced are only in the database (after being fixed up) as the cache has to stay sorted
+    LiveSample sample = {(int32_t)record.timestamp, {record.currentMilliAmps, record.voltageMilliVolts}};
+    if (!isBootRelativeTimestamp(record.timestamp) && xSemaphoreTake(liveCacheMutex, 100) == pdTRUE)
+    {
+        liveCache.add(sample);
+        xSemaphoreGive(liveCacheMutex);
+    }
+
+    bool result = enqueueRecord(record);
+
+    // wake up the queue task right away when reaching a threshold instead of waiting for its next check
+    size_t pending = recordRing.size();
+    metrics.queueHighWater.update(pending);
+    if (flushWakeup.update(pending, flushScheduler.pageFullThreshold(), flushScheduler.highWaterThreshold(recordRing.capacity())))
+        xTaskNotify(queueTaskHandle, notifyQueuePressure, eSetBits);
+
+    return result;
+}
+
+uint32_t findLiveSample(time_t timestamp)
+{
+    xSemaphoreTake(liveCacheMutex, portMAX_DELAY);
+    uint32_t seq = liveCache.fullRes.lowerBound(timestamp);
+    xSemaphoreGive(liveCacheMutex);
+    return seq;
+}
+
+size_t readLiveSamples(uint32_t &seq, LiveSample *samples, size_t maxCount)
+{
+    xSemaphoreTake(liveCacheMutex, portMAX_DELAY);
+    size_t count = liveCache.fullRes.read(seq, samples, maxCount, 0);
+    xSemaphoreGive(liveCacheMutex);
+    return count;
+}
+
+// sequence number of the sample following the one a client has received last, missingUntil is set if the cache
+// does not reach back that far
+uint32_t resumeLiveSamples(uint32_t lastSeq, time_t lastTimestamp, time_t &missingUntil)
+{
+    missingUntil = 0;
+    xSemaphoreTake(liveCacheMutex, portMAX_DELAY);
+    auto &fullRes = liveCache.fullRes;
+    uint32_t seq;
+    // sequence numbers only stay valid until the next restart, so check the timestamp as well
+    if ((int32_t)(lastSeq - fullRes.beginSeq()) >= 0 && (int32_t)(fullRes.endSeq() - lastSeq) > 0 && fullRes.at(lastSeq).timestamp == lastTimestamp)
+        seq = lastSeq + 1;
+    else
+    {
+        seq = fullRes.lowerBound(lastTimestamp + 1);
+        if (seq == fullRes.beginSeq() && (!fullRes.size() || fullRes.at(seq).timestamp > lastTimestamp + 1))
+            missingUntil = fullRes.size() ? fullRes.at(seq).timestamp - 1 : time(nullptr);
+    }
+    xSemaphoreGive(liveCacheMutex);
+    return seq;
+}
+
+void *allocateLarge(size_t size)
+{
+    // large buffers go to PSRAM if available
+    return psramFound() ? heap_caps_malloc(size, MALLOC_CAP_SPIRAM) : malloc(size);
+}
+
+bool enqueueRecord(const Record &record)
+{
+    switch (enqueueRecord(recordRing, overflowPolicy, spilling, decimateCounter, record))
+    {
+    case EnqueueResult::Queued:
+        return true;
+    case EnqueueResult::QueuedDroppingOldest:
+        droppedRecords++;
+        return true;
+    case EnqueueResult::Dropped:
+        droppedRecords++;
+        return false;
+    case EnqueueResult::Decimated:
+        decimatedRecords++;
+        return false;
+    case EnqueueResult::Spill:
+        return spillRecord(record);
+    }
+    return false;
+}
+
+bool spillRecord(const Record &record)
+{
+    // the sampling task never touches the file system, writing the spill file is left to the queue task
+    if (!spillRing.tryPush(record))
+    {
+        droppedRecords++;
+        return false;
+    }
+    // set after pushing, so a merge finishing in between finds the record and keeps spilling
+    spilling = true;
+    if (spillRing.size() == spillRing.capacity() / 2)
+        xTaskNotify(queueTaskHandle, notifySpill, eSetBits);
+    return true;
+}
+
+// runs in the queue task, appends the records pushed by spillRecord() to the spill file
+void writeSpilledRecords()
+{
+    if (!spillRing.size())
+        return;
+
+    xSemaphoreTake(spillMutex, portMAX_DELAY);
+    if (!spillFileBytes)
+        ESP_LOGW(kLoggingTag, "Record ring full, spilling records to '%s'", spillFilename);
+    if (!spillFile)
+        spillFile = fopen(spillFilename, "ab");
+
+    const Record *records;
+    uint32_t written = 0, lost = 0;
+    while (size_t count = spillRing.peek(records))
+    {
+        size_t fitting = std::min(count, (size_t)(spillMaxBytes - spillFileBytes) / sizeof(Record));
+        size_t countWritten = spillFile ? fwrite(records, sizeof(Record), fitting, spillFile) : 0;
+        spillFileBytes += countWritten * sizeof(Record);
+        written += countWritten;
+        lost += count - countWritten;
+        spillRing.consume(count);
+    }
+    if (spillFile && fflush(spillFile))
+        ESP_LOGE(kLoggingTag, "Error writing spill file '%s'", spillFilename);
+    spilledRecords += written;
+    droppedRecords += lost;
+    xSemaphoreGive(spillMutex);
+
+    if (lost)
+        ESP_LOGW(kLoggingTag, "Dropped %u records, spill file '%s' is full or can't be written", lost, spillFilename);
+}
+
+bool mergeSpilledRecords(struct dblog_write_context *ctx)
+{
+    xSemaphoreTake(spillMutex, portMAX_DELAY);
+    if (spillFile)
+        fclose(spillFile);
+    spillFile = nullptr;
+
+    uint32_t merged = 0, lost = 0;
+    const Record *records;
+    size_t count;
+    long offset = spillMergedBytes;
+    bool result = mergeRecordFile(ctx, spillFilename, offset, spillPreviousBootBytes, merged, lost);
+
+    // records not written to the spill file yet are newer than the ones in there
+    while (result && (count = spillRing.peek(records)) > 0)
+    {
+        size_t i = 0;
+        while (i < count && result)
+            result = mergeSpilledRecord(ctx, records[i++], false, merged, lost);
+        spillRing.consume(i);
+    }
+
+    if (result)
+    {
+        remove(spillFilename);
+        spillFileBytes = 0;
+        spillMergedBytes = 0;
+        spillPreviousBootBytes = 0;
+        // from now on new records are newer than everything spilled, so they can go to the ring again, unless one was
+        // spilled while merging
+        spilling = false;
+        if (spillRing.size())
+            spilling = true;
+    }
+    else
+    {
+        // keep what has not been merged for the next flush
+        spillMergedBytes = offset;
+        ESP_LOGW(kLoggingTag, "Keeping %ld bytes of spilled records for the next flush", std::max(spillFileBytes - offset, 0L));
+    }
+    mergedRecords += merged;
+    droppedRecords += lost;
+    xSemaphoreGive(spillMutex);
+
+    if (lost)
+        ESP_LOGW(kLoggingTag, "Dropped %u spilled records that could not be merged", lost);
+    ESP_LOGI(kLoggingTag, "Merged %u spilled records", merged);
+    return result;
+}
+
+// appends the records of a spill or unsynced file from offset on, offset is left after the last record read
+bool mergeRecordFile(struct dblog_write_context *ctx, const char *filename, long &offset, long previousBootBytes, uint32_t &merged, uint32_t &lost)
+{
+    bool result = true;
+    Record batch[recordBatchSize];
+    size_t count;
+    FILE *file = fopen(filename, "rb");
+    if (file && offset && fseek(file, offset, SEEK_SET))
+        ESP_LOGE(kLoggingTag, "Error seeking to %ld in '%s'", offset, filename);
+    while (result && file && (count = fread(batch, sizeof(Record), recordBatchSize, file)) > 0)
+    {
+        for (size_t i = 0; i < count && result; i++)
+        {
+            result = mergeSpilledRecord(ctx, batch[i], offset < previousBootBytes, merged, lost);
+            // a failing record is skipped as well, retrying it would most probably just fail again
+            offset += sizeof(Record);
+        }
+    }
+    if (file)
+        fclose(file);
+    return result;
+}
+
+// runs in the queue task until the time has been synced, the database is sorted by timestamp so the queued records
+// can't be written yet, they are moved to the unsynced file instead so that the ring does not overflow meanwhile
+void holdUnsyncedRecords()
+{
+    if (!recordRing.size() || unsyncedFileBytes + (long)sizeof(Record) > spillMaxBytes)
+        return;
+
+    FILE *file = fopen(unsyncedFilename, "ab");
+    DrainResult drained = {0, 0, 0, false};
+    if (file)
+    {
+        drained = drainRecords(recordRing, overflowPolicy == OverflowPolicy::DropOldest, [file](const Record &record) -> int {
+            if (unsyncedFileBytes + (long)sizeof(Record) > spillMaxBytes)
+                return ENOSPC;
+            if (fwrite(&record, sizeof(Record), 1, file) != 1)
+                return EIO;
+            unsyncedFileBytes += sizeof(Record);
+            return 0;
+        });
+        if (fclose(file))
+            drained.error = EIO;
+    }
+
+    if (!file)
+        ESP_LOGE(kLoggingTag, "Error opening '%s', records stay queued until the time is synced", unsyncedFilename);
+    if (drained.error)
+    {
+        droppedRecords += drained.dropped;
+        ESP_LOGE(kLoggingTag, "Error %d writing '%s', dropped %u records", drained.error, unsyncedFilename, drained.dropped);
+    }
+    unsyncedRecords += drained.appended;
+    ESP_LOGD(kLoggingTag, "Time not synced yet, moved %u records to '%s' (%ld bytes)", drained.appended, unsyncedFilename, unsyncedFileBytes);
+}
+
+// merges the records taken before the time was synced, called by queueTaskFlush() with the database mutex taken
+bool mergeUnsyncedRecords(struct dblog_write_context *ctx, uint32_t &merged)
+{
+    uint32_t lost = 0;
+    long offset = unsyncedMergedBytes;
+    bool result = mergeRecordFile(ctx, unsyncedFilename, offset, 0, merged, lost);
+    if (result)
+    {
+        remove(unsyncedFilename);
+        unsyncedFileBytes = 0;
+        unsyncedMergedBytes = 0;
+    }
+    else
+    {
+        unsyncedMergedBytes = offset;
+        ESP_LOGW(kLoggingTag, "Keeping %ld bytes of unsynced records for the next flush", std::max(unsyncedFileBytes - offset, 0L));
+    }
+    droppedRecords += lost;
+
+    if (lost)
+        ESP_LOGW(kLoggingTag, "Dropped %u unsynced records that could not be merged", lost);
+    ESP_LOGI(kLoggingTag, "Merged %u records taken before the time was synced", merged);
+    return result;
+}
 
-    if (addToRingbuffer && xSemaphoreTake(latestRecordsMutex, 100) == pdTRUE)
+// records from before the time was synced in an earlier boot can't be placed and are dropped
+bool mergeSpilledRecord(struct dblog_write_context *ctx, Record record, bool previousBoot, uint32_t &merged, uint32_t &lost)
+{
+    if (isBootRelativeTimestamp(record.timestamp) && (previousBoot || !fixupTimestamp(record.timestamp)))
+    {
+        lost++;
+        return true;
+    }
+    int res = record.AppendToDb(ctx);
+    if (res)
     {
-        latestRecordsBuffer.push(record);
-        xSemaphoreGive(latestRecordsMutex);
+        ESP_LOGE(kLoggingTag, "AppendToDb returned error %d", res);
+        lost++;
+        return false;
     }
+    merged++;
+    flushLastTimestamp = std::max(flushLastTimestamp, record.timestamp);
+    return true;
+}
+
+void setOverflowPolicy(OverflowPolicy policy)
+{
+    ESP_LOGI(kLoggingTag, "Overflow policy: %d", (int)policy);
+    requestedOverflowPolicy = policy;
+    // nothing is flushed before the queue task runs
+    if (!queueTaskHandle)
+        overflowPolicy = policy;
+}
+
+// runs in the queue task between flushes, so a flush never sees the policy change while draining the ring
+void applyOverflowPolicy()
+{
+    OverflowPolicy policy = requestedOverflowPolicy;
+    if (policy == overflowPolicy)
+        return;
+    overflowPolicy = policy;
+    ESP_LOGI(kLoggingTag, "Overflow policy %d applied", (int)policy);
+}
+
+OverflowPolicy getOverflowPolicy()
+{
+    return overflowPolicy;
+}
 
-    return xQueueSendToBack(recordQueueHandle, &record, 0) == pdPASS;
+OverflowStats getOverflowStats()
+{
+    OverflowStats stats;
+    stats.dropped = droppedRecords;
+    stats.decimated = decimatedRecords;
+    stats.spilled = spilledRecords;
+    stats.merged = mergedRecords;
+    stats.unsynced = unsyncedRecords;
+    stats.spilling = spilling;
+    return stats;
 }
 
 void flushQueue()
 {
     ESP_LOGD(kLoggingTag, "Entering flushQueue()");
 
-    xTaskNotify(queueTaskHandle, 0, eNoAction);
+    xTaskNotify(queueTaskHandle, notifyManualFlush, eSetBits);
 }
 
 uint getQueueSize()
 {
-    return uxQueueMessagesWaiting(recordQueueHandle);
+    return recordRing.size();
 }
 
 void queueTask(void *taskParameter)
 {
     ESP_LOGD(kLoggingTag, "Entering queueTask()");
 
+    recoverDb();
+    updateZoneMap();
+    committedUntil = readLastTimestamp();
+    dbRecovering = false;
+    uint32_t readyMillis = esp_timer_get_time() / 1000;
+    metrics.bootDbReadyMillis.update(readyMillis);
+    ESP_LOGI(kLoggingTag, "Database ready %u ms after boot, committed until: %ld", readyMillis, committedUntil.load());
+
     while (true)
     {
-        xTaskNotifyWait(0, 0, nullptr, pdMS_TO_TICKS(flushEveryMillis));
-        queueTaskFlush();
+        uint32_t notifications = 0;
+        xTaskNotifyWait(0, ULONG_MAX, &notifications, pdMS_TO_TICKS(flushCheckMillis));
+        if (notifications & notifyReset)
+            resetDbInQueueTask();
+        applyOverflowPolicy();
+        writeSpilledRecords();
+
+        portENTER_CRITICAL(&flushSchedulerMux);
+        auto trigger = flushScheduler.evaluate(millis(), recordRing.size(), recordRing.capacity(), spilling, notifications & notifyManualFlush);
+        portEXIT_CRITICAL(&flushSchedulerMux);
+
+        // records are only moved to the unsynced file in page sized batches (or when asked to), waiting for the time to
+        // be synced is no reason to write a few bytes to flash with every check
+        if (trigger != FlushTrigger::None && !isTimeSynced())
+        {
+            if (trigger != FlushTrigger::MaxAge)
+                holdUnsyncedRecords();
+            continue;
+        }
+        if (trigger != FlushTrigger::None)
+            queueTaskFlush(trigger);
     }
 
     vTaskDelete(nullptr);
 }
 
-void queueTaskFlush()
+void queueTaskFlush(FlushTrigger trigger)
 {
     ESP_LOGD(kLoggingTag, "Entering queueTaskFlush()");
 
-    auto messagesWaiting = uxQueueMessagesWaiting(recordQueueHandle);
-    if (!messagesWaiting)
+    if (!recordRing.size() && !spilling && !unsyncedFileBytes)
     {
         ESP_LOGI(kLoggingTag, "Queue is empty, nothing to flush");
         return;
     }
 
-    ESP_LOGI(kLoggingTag, "Flushing queue");
+    ESP_LOGI(kLoggingTag, "Flushing queue, trigger: %s", flushTriggerNames[(int)trigger]);
 
     if (!aquireDbMutex(flushEveryMillis * 10, __func__))
         return;
@@ -140,7 +635,17 @@ void queueTaskFlush()
     ctx.read_fn = read_fn_wctx;
     ctx.write_fn = write_fn;
     ctx.flush_fn = flush_fn;
-    Record record;
+    DrainResult drained;
+    size_t recordsAdded = 0;
+    uint32_t unsyncedMerged = 0;
+    // with drop-oldest the producer might overwrite records while they are encoded, so copy them out first
+    bool copyOut = overflowPolicy == OverflowPolicy::DropOldest;
+    uint32_t mergedBefore = mergedRecords;
+    int64_t startMicros = esp_timer_get_time();
+    uint32_t lastDataPage = 0;
+    flushBytesWritten = 0;
+    flushLastPageWritten = 0;
+    flushLastTimestamp = 0;
 
     fileExists = dbFileExists();
 
@@ -151,6 +656,13 @@ void queueTaskFlush()
         goto exit;
     }
 
+    // a new database starts with an empty zone map, write_fn() keeps it up to date from here on
+    zoneFile = fopen(zonesFilename, !fileExists ? "w+b" : "r+b");
+    if (!zoneFile)
+        zoneFile = fopen(zonesFilename, "w+b");
+    if (!zoneFile)
+        ESP_LOGW(kLoggingTag, "Error opening zone map '%s', /find will read all pages written now", zonesFilename);
+
     res = !fileExists ? dblog_write_init(&ctx) : dblog_init_for_append(&ctx);
     if (res)
     {
@@ -158,17 +670,38 @@ void queueTaskFlush()
         goto exit;
     }
 
-    while (xQueueReceive(recordQueueHandle, &record, 0) == pdTRUE)
+    // records moved out of the ring before the time was synced are older than everything else
+    if (unsyncedFileBytes && !mergeUnsyncedRecords(&ctx, unsyncedMerged))
+        goto exit;
+    recordsAdded = unsyncedMerged;
+
+    drained = drainRecords(recordRing, copyOut, [&ctx](const Record &queued) {
+        // records taken before the time was synced carry the seconds since boot
+        Record record = queued;
+        fixupTimestamp(record.timestamp);
+        int res = record.AppendToDb(&ctx);
+        if (!res)
+            flushLastTimestamp = std::max(flushLastTimestamp, record.timestamp);
+        return res;
+    });
+    recordsAdded += drained.appended;
+    if (drained.overwritten)
+        ESP_LOGW(kLoggingTag, "Records were dropped while being flushed");
+    if (drained.error)
     {
-        ESP_LOGI(kLoggingTag, "Adding record with timestamp %ld", record.timestamp);
-        res = record.AppendToDb(&ctx);
-        if (res)
-        {
-            ESP_LOGE(kLoggingTag, "AppendToDb returned error %d", res);
-            goto exit;
-        }
+        ESP_LOGE(kLoggingTag, "AppendToDb returned error %d, dropped %u records", drained.error, drained.dropped);
+        droppedRecords += drained.dropped;
+        goto exit;
     }
+    ESP_LOGI(kLoggingTag, "Added %u records", drained.appended);
+
+    // spilled records are newer than everything that was in the ring
+    if (spilling && !mergeSpilledRecords(&ctx))
+        goto exit;
+    recordsAdded += mergedRecords - mergedBefore;
 
+    // finalizing writes the interior pages after the data pages, they are overwritten by the next flush
+    lastDataPage = flushLastPageWritten;
     ESP_LOGI(kLoggingTag, "Finalizing database");
     res = dblog_finalize(&ctx);
     if (res)
@@ -177,13 +710,81 @@ void queueTaskFlush()
         goto exit;
     }
 
+    if (flushLastTimestamp > committedUntil)
+        committedUntil = flushLastTimestamp;
     ESP_LOGI(kLoggingTag, "    Done flushing queue and adding records");
 
 exit:
     if (dbFile)
         fclose(dbFile);
+    if (zoneFile)
+        fclose(zoneFile);
+    zoneFile = nullptr;
     ESP_LOGV(kLoggingTag, "Mutex: xSemaphoreGive");
     releaseDbMutex(__func__);
+    metrics.flushDuration.observe(esp_timer_get_time() - startMicros);
+
+    if (recordsAdded)
+    {
+        portENTER_CRITICAL(&flushSchedulerMux);
+        flushScheduler.recordFlush(trigger, recordsAdded, flushBytesWritten, lastDataPage, (esp_timer_get_time() - startMicros) / 1000);
+        auto flushStats = flushScheduler.getStats();
+        portEXIT_CRITICAL(&flushSchedulerMux);
+        ESP_LOGI(kLoggingTag, "Flushed %u records, %u bytes written in %u ms, records per page: %u, write amplification: %.2f",
+                 recordsAdded, flushBytesWritten, flushStats.lastDurationMillis, flushStats.recordsPerPage, flushStats.writeAmplification);
+    }
+}
+
+FlushStats getFlushStats()
+{
+    portENTER_CRITICAL(&flushSchedulerMux);
+    auto flushStats = flushScheduler.getStats();
+    portEXIT_CRITICAL(&flushSchedulerMux);
+    return flushStats;
+}
+
+void setFlushPolicy(const FlushPolicy &policy)
+{
+    portENTER_CRITICAL(&flushSchedulerMux);
+    flushScheduler.setPolicy(policy);
+    portEXIT_CRITICAL(&flushSchedulerMux);
+}
+
+void setCompressionMinBytes(size_t minBytes)
+{
+    compressMinBytes = minBytes;
+}
+
+void statusResponseHandler(AsyncWebServerRequest *request)
+{
+    auto overflowStats = getOverflowStats();
+    auto flushStats = getFlushStats();
+    auto streamStats = getLiveStreamStats();
+    uint32_t requests = metrics.dataRequests.get();
+    uint32_t notModified = metrics.dataNotModified.get();
+
+    StreamString json;
+    json.printf("{\"queue\":{\"pending\":%u,\"capacity\":%u},", recordRing.size(), recordRing.capacity());
+    json.printf("\"boot\":{\"firstSampleMicros\":%u,\"dbReadyMillis\":%u,\"wifiConnectedMillis\":%u,\"timeSyncedMillis\":%u,\"dbRecovering\":%s},",
+                metrics.bootFirstSampleMicros.get(), metrics.bootDbReadyMillis.get(), metrics.bootWifiConnectedMillis.get(), metrics.bootTimeSyncedMillis.get(),
+                dbRecovering ? "true" : "false");
+    json.printf("\"overflow\":{\"policy\":%d,\"dropped\":%u,\"decimated\":%u,\"spilled\":%u,\"merged\":%u,\"unsynced\":%u,\"spilling\":%s},", (int)overflowPolicy.load(),
+                overflowStats.dropped, overflowStats.decimated, overflowStats.spilled, overflowStats.merged, overflowStats.unsynced, overflowStats.spilling ? "true" : "false");
+    json.printf("\"flush\":{\"flushes\":%u,\"lastTrigger\":\"%s\",", flushStats.flushes, flushTriggerNames[(int)flushStats.lastTrigger]);
+    for (int i = (int)FlushTrigger::PageFull; i < (int)FlushTrigger::Count; i++)
+        json.printf("\"%s\":%u,", flushTriggerNames[i], flushStats.flushesByTrigger[i]);
+    json.printf("\"records\":%u,\"bytesWritten\":%llu,\"pagesCompleted\":%u,\"recordsPerPage\":%u,\"lastDurationMillis\":%u,\"maxDurationMillis\":%u,\"writeAmplification\":%.2f}",
+                flushStats.recordsFlushed, flushStats.bytesWritten, flushStats.pagesCompleted, flushStats.recordsPerPage, flushStats.lastDurationMillis,
+                flushStats.maxDurationMillis, flushStats.writeAmplification);
+    json.printf(",\"stream\":{\"clients\":%u,\"events\":%u,\"deferred\":%u,\"decimated\":%u,\"gaps\":%u,\"resumed\":%u,\"rejected\":%u,\"maxQueuedBytes\":%u,\"maxDecimation\":%u,",
+                streamStats.clients, streamStats.eventsSent, streamStats.eventsDeferred, streamStats.samplesDecimated, streamStats.gapsSent,
+                streamStats.clientsResumed, streamStats.clientsRejected, streamStats.maxQueuedBytes, streamStats.maxDecimation);
+    json.printf("\"socketClients\":%u,\"framesSent\":%u,\"framesDropped\":%u},", streamStats.socketClients, streamStats.framesSent, streamStats.framesDropped);
+    json.printf("\"data\":{\"requests\":%u,\"notModified\":%u,\"fromCache\":%u,\"fromDb\":%u,\"cacheable\":%u,\"notModifiedRate\":%.2f,\"committedUntil\":%ld}}",
+                requests, notModified, (uint32_t)metrics.dataFromCache.get(), (uint32_t)metrics.dataFromDb.get(), (uint32_t)metrics.dataCacheable.get(),
+                requests ? (float)notModified / requests : 0.0f,
+                committedUntil.load());
+    request->send(200, "application/json", json);
 }
 
 bool recoverDb()
@@ -244,160 +845,1338 @@ exit:
     return result;
 }
 
-void resetDb()
+// adds the zones of the pages that the zone map does not cover yet, e.g. of a database from before zone maps
+bool updateZoneMap()
 {
-    ESP_LOGI(kLoggingTag, "Resetting / removing database");
-    if (dbFileExists())
+    if (!dbFileExists(true) || !aquireDbMutex(1000 * 10, __func__))
+        return false;
+
+    bool result = false;
+    uint32_t page, pageCount, added = 0;
+    dbFile = fopen(dbFilename, "rb");
+    zoneFile = fopen(zonesFilename, "r+b");
+    if (!zoneFile)
+        zoneFile = fopen(zonesFilename, "w+b");
+    if (!dbFile || !zoneFile)
     {
-        auto removeResult = SPIFFS.remove(dbFilenameWithoutFs);
-        ESP_LOGI(kLoggingTag, "Remove result: %d", removeResult);
+        ESP_LOGE(kLoggingTag, "Error opening database file '%s' or zone map '%s'", dbFilename, zonesFilename);
+        goto exit;
     }
 
-    ESP_LOGI(kLoggingTag, "Clearing queue");
-    xQueueReset(recordQueueHandle);
+    fseek(dbFile, 0, SEEK_END);
+    pageCount = ftell(dbFile) >> dbPageSizeExp;
+    fseek(zoneFile, 0, SEEK_END);
+    // a zone that was cut off is written again
+    for (page = ftell(zoneFile) / sizeof(PageZone) + 1; page < pageCount; page++)
+    {
+        if (fseek(dbFile, page << dbPageSizeExp, SEEK_SET) || fread(dbBuffer, 1, 1 << dbPageSizeExp, dbFile) != 1 << dbPageSizeExp)
+        {
+            ESP_LOGE(kLoggingTag, "Error reading page %u", page);
+            goto exit;
+        }
+        writePageZone(zoneFile, page, dbBuffer);
+        added++;
+    }
 
-    dbAccessible = true;
+    result = true;
+    ESP_LOGI(kLoggingTag, "Zone map: %u pages, %u added", pageCount ? pageCount - 1 : 0, added);
+
+exit:
+    if (dbFile)
+        fclose(dbFile);
+    if (zoneFile)
+        fclose(zoneFile);
+    zoneFile = nullptr;
+    releaseDbMutex(__func__);
+
+    return result;
 }
 
-bool dbFileExists(bool noLog)
+// writes the zone of a page at its place in the zone map, pages that are no data pages (yet) get an unknown zone
+bool writePageZone(FILE *file, uint32_t page, const byte *pageData)
 {
-    ESP_LOGD(kLoggingTag, "Entering dbFileExists()");
+    PageZone zone;
+    computePageZone(pageData, 1 << dbPageSizeExp, zone);
 
-    bool fileExists = SPIFFS.exists(dbFilenameWithoutFs);
-    if (!noLog)
-        ESP_LOGI(kLoggingTag, "Database file exists: %d", fileExists);
-    else
-        ESP_LOGD(kLoggingTag, "Database file exists: %d", fileExists);
+    // fill up missing zones in between as unknown, seeking beyond the end of a file does not work on SPIFFS
+    long offset = (page - 1) * sizeof(PageZone);
+    fseek(file, 0, SEEK_END);
+    PageZone unknownZone = {};
+    for (long end = ftell(file) / sizeof(PageZone) * sizeof(PageZone); end < offset; end += sizeof(PageZone))
+        fwrite(&unknownZone, sizeof(PageZone), 1, file);
 
-    return fileExists;
+    if (fseek(file, offset, SEEK_SET) || fwrite(&zone, sizeof(PageZone), 1, file) != 1 || fflush(file))
+    {
+        ESP_LOGW(kLoggingTag, "Error writing zone of page %u", page);
+        return false;
+    }
+    return true;
 }
 
-void dataResponseHandler(AsyncWebServerRequest *request)
+// false if the zone of the page is unknown
+bool readPageZone(FILE *file, uint32_t page, PageZone &zone)
 {
-    ESP_LOGD(kLoggingTag, "Entering respondWithData()");
+    if (!file || fseek(file, (page - 1) * sizeof(PageZone), SEEK_SET) || fread(&zone, sizeof(PageZone), 1, file) != 1)
+        return false;
+    return zone.rowCount;
+}
 
-    bool sentResponse = false;
-    time_t recordsFrom = 0, recordsUntil = 0;
-    int res;
-    AsyncWebServerResponse *response;
+time_t readLastTimestamp()
+{
+    if (!dbFileExists(true) || !aquireDbMutex(1000 * 10, __func__))
+        return 0;
 
-    if (auto param = request->getParam("from"))
-        recordsFrom = param->value().toInt();
-    if (auto param = request->getParam("until"))
-        recordsUntil = param->value().toInt();
-    if (!recordsFrom)
-    {
-        time(&recordsFrom);
-        recordsFrom -= 60 * 60;
-    }
-    ESP_LOGI(kLoggingTag, "Responding with data: recordsFrom = %ld, recordsUntil = %ld", recordsFrom, recordsUntil);
+    time_t timestamp = 0;
+    struct dblog_read_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.buf = dbBuffer;
+    ctx.read_fn = read_fn_rctx;
 
-    if (!aquireDbMutex(1000 * 10, __func__))
-    {
-        request->send(500);
-        return;
-    }
+    dbFile = fopen(dbFilename, "rb");
+    if (dbFile && !dblog_read_init(&ctx) && !dblog_read_last_row(&ctx))
+        rowToBuffer(&ctx, &timestamp);
+    if (dbFile)
+        fclose(dbFile);
+    releaseDbMutex(__func__);
 
-    if (!dbFileExists())
-    {
-        request->send(200, "application/json", "[]");
-        releaseDbMutex("respondWithData empty");
-        sentResponse = true;
-        goto exitHandler;
-    }
+    return timestamp;
+}
 
-    memset(&dataReadDbContext, 0, sizeof(dataReadDbContext));
-    dataReadDbContext.buf = dbBuffer;
-    dataReadDbContext.read_fn = read_fn_rctx;
+bool saveCapture(const char *filename, int64_t epochOffsetMicros, std::function<bool(CaptureSample &)> nextSample)
+{
+    ESP_LOGI(kLoggingTag, "Saving capture to '%s'", filename);
+
+    if (!aquireDbMutex(1000 * 10, __func__))
+        return false;
 
+    bool result = false;
     dbFile = nullptr;
-    dbFile = fopen(dbFilename, "rb");
+    int res;
+    struct dblog_write_context ctx;
+    ctx.buf = dbBuffer;
+    ctx.col_count = CaptureSample::ColumnCount;
+    ctx.page_size_exp = dbPageSizeExp;
+    ctx.read_fn = read_fn_wctx;
+    ctx.write_fn = write_fn;
+    ctx.flush_fn = flush_fn;
+    CaptureSample sample;
+
+    dbFile = fopen(filename, "w+b");
     if (!dbFile)
     {
-        ESP_LOGE(kLoggingTag, "Error opening database file '%s'", dbFilename);
-        goto exitHandler;
+        ESP_LOGE(kLoggingTag, "Error creating capture file '%s'", filename);
+        goto exit;
     }
-    res = dblog_read_init(&dataReadDbContext);
+
+    res = dblog_write_init(&ctx);
     if (res)
     {
-        ESP_LOGE(kLoggingTag, "dblog_read_init returned error %d", res);
-        goto exitHandler;
+        ESP_LOGE(kLoggingTag, "dblog_write_init returned error %d", res);
+        goto exit;
     }
-    ESP_LOGI(kLoggingTag, "Page size: %d, last data page: %d", (int32_t)1 << dataReadDbContext.page_size_exp, dataReadDbContext.last_leaf_page);
 
-    res = dblog_bin_srch_row_by_val(&dataReadDbContext, 0, DBLOG_TYPE_INT, &recordsFrom, sizeof(recordsFrom), 0);
-    if (res)
+    while (nextSample(sample))
     {
-        ESP_LOGE(kLoggingTag, "dblog_bin_srch_row_by_val returned error %d", res);
-        goto exitHandler;
+        res = sample.AppendToDb(&ctx, epochOffsetMicros);
+        if (res)
+        {
+            ESP_LOGE(kLoggingTag, "AppendToDb returned error %d", res);
+            goto exit;
+        }
     }
 
-    dataReadLastTimestamp = 0;
-    dataReadFinalize = false;
-    response = request->beginChunkedResponse("application/json", [recordsUntil](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
-        ESP_LOGV(kLoggingTag, "ChunkedResponse: recordsUntil = %ld, dataReadFinalize = %d, dataReadLastTimestamp = %ld, buffer = %p, maxLen = %d, index = %d",
-                 recordsUntil, dataReadFinalize, dataReadLastTimestamp, buffer, maxLen, index);
-        uint8_t *workBuffer = buffer;
-        size_t lengthRemaining = maxLen;
+    res = dblog_finalize(&ctx);
+    if (res)
+    {
+        ESP_LOGE(kLoggingTag, "dblog_finalize returned error %d", res);
+        goto exit;
+    }
+
+    result = true;
+    ESP_LOGI(kLoggingTag, "    Done saving capture");
+
+exit:
+    if (dbFile)
+        fclose(dbFile);
+    releaseDbMutex(__func__);
+
+    return result;
+}
+
+// the reset is done by the queue task, waiting for the database mutex must not block the caller (loop() or AsyncTCP)
+void resetDb()
+{
+    ESP_LOGI(kLoggingTag, "Database reset requested");
+    if (queueTaskHandle)
+        xTaskNotify(queueTaskHandle, notifyReset, eSetBits);
+}
+
+// runs in the queue task, clearing the queue is a consumer side operation
+void resetDbInQueueTask()
+{
+    ESP_LOGI(kLoggingTag, "Resetting / removing database");
+
+    // a response reading the database in between would see it half reset
+    if (!aquireDbMutex(1000 * 10, __func__))
+    {
+        ESP_LOGE(kLoggingTag, "Database busy, not resetting it");
+        return;
+    }
+
+    if (dbFileExists())
+    {
+        auto removeResult = SPIFFS.remove(dbFilenameWithoutFs);
+        ESP_LOGI(kLoggingTag, "Remove result: %d", removeResult);
+    }
+    remove(zonesFilename);
+
+    // responses cached by clients are not valid anymore
+    dbGeneration++;
+    committedUntil = 0;
+
+    ESP_LOGI(kLoggingTag, "Clearing queue and live cache");
+    if (xSemaphoreTake(liveCacheMutex, 100) == pdTRUE)
+    {
+        liveCache.clear();
+        xSemaphoreGive(liveCacheMutex);
+    }
+    recordRing.clear();
+    xSemaphoreTake(spillMutex, portMAX_DELAY);
+    spillRing.clear();
+    spilling = false;
+    if (spillFile)
+        fclose(spillFile);
+    spillFile = nullptr;
+    remove(spillFilename);
+    spillFileBytes = 0;
+    spillMergedBytes = 0;
+    spillPreviousBootBytes = 0;
+    xSemaphoreGive(spillMutex);
+    remove(unsyncedFilename);
+    unsyncedFileBytes = 0;
+    unsyncedMergedBytes = 0;
+
+    dbAccessible = true;
+    releaseDbMutex(__func__);
+}
+
+bool dbFileExists(bool noLog)
+{
+    ESP_LOGD(kLoggingTag, "Entering dbFileExists()");
+
+    bool fileExists = SPIFFS.exists(dbFilenameWithoutFs);
+    if (!noLog)
+        ESP_LOGI(kLoggingTag, "Database file exists: %d", fileExists);
+    else
+        ESP_LOGD(kLoggingTag, "Database file exists: %d", fileExists);
+
+    return fileExists;
+}
+
+void dataResponseHandler(AsyncWebServerRequest *request)
+{
+    ESP_LOGD(kLoggingTag, "Entering respondWithData()");
+
+    time_t recordsFrom = 0, recordsUntil = 0;
+    time_t captureId = 0;
+    uint32_t maxPoints = 0;
+    MinMaxDownsampler downsampler;
+    DataRange ranges[maxDataRanges];
+    size_t rangeCount = 0;
+    String filename = dbFilename;
+    String etag;
+    DbCursor *cursor;
+    AwsResponseFiller filler;
+    ResponseCompression *compression;
+    AsyncWebServerResponse *response;
+    int64_t startMicros = esp_timer_get_time();
+
+    if (auto param = request->getParam("from"))
+        recordsFrom = param->value().toInt();
+    if (auto param = request->getParam("until"))
+        recordsUntil = param->value().toInt();
+    if (auto param = request->getParam("ranges"))
+    {
+        // several ranges at once, e.g. the parts of the chart that the client has not loaded yet
+        rangeCount = parseDataRanges(param->value(), ranges);
+        if (!rangeCount)
+        {
+            request->send(400);
+            return;
+        }
+        recordsFrom = ranges[0].from;
+        recordsUntil = ranges[rangeCount - 1].until;
+    }
+    if (auto param = request->getParam("maxPoints"))
+        maxPoints = param->value().toInt();
+    if (auto param = request->getParam("capture"))
+    {
+        // captures are small, so always respond with all of their samples
+        captureId = param->value().toInt();
+        if (captureId <= 0)
+        {
+            request->send(400);
+            return;
+        }
+        filename = getCaptureFilename(captureId, true);
+        recordsFrom = 0;
+        recordsUntil = 0;
+        maxPoints = 0;
+        rangeCount = 0;
+    }
+    else if (!recordsFrom)
+    {
+        time(&recordsFrom);
+        recordsFrom -= 60 * 60;
+    }
+    if (!rangeCount)
+    {
+        ranges[0] = {recordsFrom, recordsUntil};
+        rangeCount = 1;
+    }
+    if (maxPoints)
+    {
+        time_t now;
+        time(&now);
+        // records are logged every second, so only downsample if that actually leaves out rows
+        if (downsampler.begin(recordsFrom, recordsUntil ? recordsUntil : now, maxPoints) <= 1)
+            maxPoints = 0;
+    }
+    ESP_LOGI(kLoggingTag, "Responding with data: recordsFrom = %ld, recordsUntil = %ld, ranges = %d, captureId = %ld, maxPoints = %u",
+             recordsFrom, recordsUntil, rangeCount, captureId, maxPoints);
+    metrics.dataRequests.add();
+
+    // captures and completely committed ranges never change (until the database is reset), so they can be cached
+    if (captureId)
+        etag = "\"c" + String(captureId) + "\"";
+    else if (recordsUntil && recordsUntil <= committedUntil)
+    {
+        etag = "\"" + String(dbGeneration, HEX);
+        for (size_t i = 0; i < rangeCount; i++)
+            etag += "-" + String(ranges[i].from) + "-" + String(ranges[i].until);
+        etag += "-" + String(maxPoints) + "\"";
+    }
+    if (etag.length())
+    {
+        metrics.dataCacheable.add();
+        if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag)
+        {
+            metrics.dataNotModified.add();
+            response = request->beginResponse(304);
+            addDataCacheHeaders(response, etag);
+            addCompressionHeaders(response, nullptr);
+            request->send(response);
+            metrics.dataRequestDuration.observe(esp_timer_get_time() - startMicros);
+            return;
+        }
+    }
+
+    if (!captureId && cacheResponse(request, ranges, rangeCount, maxPoints ? &downsampler : nullptr, etag, startMicros, estimateDataBytes(ranges, rangeCount, maxPoints)))
+    {
+        metrics.dataFromCache.add();
+        return;
+    }
+
+    if (!aquireDbMutex(1000 * 10, __func__))
+    {
+        request->send(500);
+        return;
+    }
+
+    if (captureId && !SPIFFS.exists(getCaptureFilename(captureId, false)))
+    {
+        request->send(404);
+        releaseDbMutex("respondWithData no capture");
+        metrics.dataRequestDuration.observe(esp_timer_get_time() - startMicros);
+        return;
+    }
+
+    if (!captureId && !dbFileExists())
+    {
+        request->send(200, "application/json", "[]");
+        releaseDbMutex("respondWithData empty");
+        metrics.dataRequestDuration.observe(esp_timer_get_time() - startMicros);
+        return;
+    }
+
+    cursor = openDbCursor(filename.c_str(), ranges, rangeCount, captureId != 0);
+    releaseDbMutex(__func__);
+    if (!cursor)
+    {
+        request->send(openDbCursors >= maxDbCursors ? 503 : 500);
+        return;
+    }
+    cursor->downsample = maxPoints != 0;
+    cursor->downsampler = downsampler;
+    if (captureId)
+    {
+        // the capture file is about as large as its JSON
+        fseek(cursor->file, 0, SEEK_END);
+        compression = beginCompression(request, ftell(cursor->file));
+    }
+    else
+        compression = beginCompression(request, estimateDataBytes(ranges, rangeCount, maxPoints));
+
+    // every chunk is one slice: take the database mutex, fill the buffer from the cursor and release it again
+    filler = [cursor, startMicros](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        ESP_LOGV(kLoggingTag, "ChunkedResponse: rangeIndex = %d, finalize = %d, lastTimestamp = %ld, buffer = %p, maxLen = %d, index = %d",
+                 cursor->rangeIndex, cursor->finalize, cursor->lastTimestamp, buffer, maxLen, index);
         size_t bytesWritten;
 
-        if (dataReadFinalize)
+        if (cursor->finalize)
+        {
+            metrics.dataRequestDuration.observe(esp_timer_get_time() - startMicros);
             return 0;
+        }
+
+        // a waiting flush goes first, AsyncTCP calls again on the next poll
+        if (!tryAquireDbMutex("respondWithData chunk"))
+            return RESPONSE_TRY_AGAIN;
+        // the database has been reset since, so end the response with what has been sent already
+        if (cursor->generation != dbGeneration)
+            cursor->rangeIndex = cursor->rangeCount;
+        bytesWritten = cursor->downsample ? writeDownsampledRows(*cursor, (char *)buffer, maxLen) : writeDataRows(*cursor, (char *)buffer, maxLen);
+        releaseDbMutex("respondWithData chunk");
+
+        ESP_LOGV(kLoggingTag, "ChunkedResponse: bytesWritten = %d, buffer = '%.*s', finalize = %d, lastTimestamp = %ld",
+                 bytesWritten, bytesWritten, buffer, cursor->finalize, cursor->lastTimestamp);
+
+        metrics.dataResponseBytes.add(bytesWritten);
+        return bytesWritten;
+    };
+    response = request->beginChunkedResponse("application/json", compression ? compressFiller(compression, filler) : filler);
+    request->onDisconnect([cursor, compression]() {
+        closeDbCursor(cursor);
+        endCompression(compression);
+    });
+    addDataCacheHeaders(response, etag);
+    addCompressionHeaders(response, compression);
+    request->send(response);
+    metrics.dataFromDb.add();
+}
+
+// fills the buffer with rows as stored, pads it if there is no room for another one
+size_t writeDataRows(DbCursor &cursor, char *buffer, size_t maxLen)
+{
+    char *workBuffer = buffer;
+    size_t lengthRemaining = maxLen;
+    int64_t startMicros = esp_timer_get_time();
+
+    while (lengthRemaining > Record::JsonMaxChars + 1)
+    {
+        if (!nextDataRow(cursor))
+        {
+            if (!cursor.rowsSent)
+            {
+                *workBuffer++ = '[';
+                lengthRemaining--;
+            }
+            *workBuffer++ = ']';
+            cursor.finalize = true;
+            return workBuffer - buffer;
+        }
+
+        // rows of captures have fractional timestamps and can be longer than Record::JsonMaxChars, a row that does not
+        // fit anymore stays pending for the next chunk
+        auto rowBuffer = rowToBuffer(&cursor.ctx, nullptr);
+        if (rowBuffer.length() + 1 > lengthRemaining)
+            break;
+
+        *workBuffer++ = cursor.rowsSent ? ',' : '[';
+        lengthRemaining--;
+        memcpy(workBuffer, rowBuffer.c_str(), rowBuffer.length());
+        workBuffer += rowBuffer.length();
+        lengthRemaining -= rowBuffer.length();
+
+        cursor.rowPending = false;
+        cursor.rowsSent++;
+
+        // keep the slice short, the rest of the buffer is filled next time
+        if (esp_timer_get_time() - startMicros > dbSliceMicros)
+            return workBuffer - buffer;
+    }
+
+    // completely fill remaining buffer as otherwise we might get called again with a maxLen of 3 or so instead of with a new large buffer...
+    memset(workBuffer, ' ', lengthRemaining);
+    return maxLen;
+}
+
+void statsResponseHandler(AsyncWebServerRequest *request)
+{
+    ESP_LOGD(kLoggingTag, "Entering statsResponseHandler()");
+
+    time_t statsFrom = 0, statsUntil = 0;
+    uint8_t channelMask = (1 << RangeStats::ChannelCount) - 1;
+    bool covered = false;
+    RangeStats stats;
+    DataRange range;
+    DbCursor *cursor;
+    AsyncWebServerResponse *response;
+
+    if (auto param = request->getParam("from"))
+        statsFrom = param->value().toInt();
+    if (auto param = request->getParam("until"))
+        statsUntil = param->value().toInt();
+    if (auto param = request->getParam("channels"))
+        channelMask = parseStatsChannels(param->value());
+    if (!channelMask)
+    {
+        request->send(400);
+        return;
+    }
+    if (!statsFrom)
+    {
+        time(&statsFrom);
+        statsFrom -= 60 * 60;
+    }
+    ESP_LOGI(kLoggingTag, "Responding with stats: statsFrom = %ld, statsUntil = %ld, channelMask = %d", statsFrom, statsUntil, channelMask);
 
-        bool isFirstRecord = index == 0;
-        while (lengthRemaining > Record::JsonMaxChars)
+    // recent ranges are summed up from the live cache right away
+    if (xSemaphoreTake(liveCacheMutex, 100) == pdTRUE)
+    {
+        covered = liveCache.coversFullRes(statsFrom);
+        for (uint32_t seq = liveCache.fullRes.lowerBound(statsFrom); covered && seq != liveCache.fullRes.endSeq(); seq++)
         {
-            *workBuffer = isFirstRecord ? '[' : ',';
-            workBuffer += 1;
-            lengthRemaining -= 1;
+            const LiveSample &sample = liveCache.fullRes.at(seq);
+            if (statsUntil && sample.timestamp > statsUntil)
+                break;
+            stats.add(sample);
+        }
+        xSemaphoreGive(liveCacheMutex);
+    }
+    if (covered)
+    {
+        request->send(200, "application/json", statsToJson(stats, channelMask, statsFrom, statsUntil, "cache"));
+        return;
+    }
+
+    if (!aquireDbMutex(1000 * 10, __func__))
+    {
+        request->send(500);
+        return;
+    }
 
-            if (!isFirstRecord)
+    if (!dbFileExists())
+    {
+        request->send(200, "application/json", statsToJson(stats, channelMask, statsFrom, statsUntil, "db"));
+        releaseDbMutex("statsResponseHandler empty");
+        return;
+    }
+
+    // same search and row cursor as /data, but without formatting any rows
+    range = {statsFrom, statsUntil};
+    cursor = openDbCursor(dbFilename, &range, 1, false);
+    releaseDbMutex(__func__);
+    if (!cursor)
+    {
+        request->send(openDbCursors >= maxDbCursors ? 503 : 500);
+        return;
+    }
+
+    response = request->beginChunkedResponse("application/json", [cursor, channelMask, statsFrom, statsUntil](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        if (!cursor->json.length())
+        {
+            if (!tryAquireDbMutex("statsResponseHandler chunk"))
+                return RESPONSE_TRY_AGAIN;
+            if (cursor->generation != dbGeneration)
+                cursor->rangeIndex = cursor->rangeCount;
+
+            // scan for one slice per call, nothing is sent until the statistics are complete
+            int64_t startMicros = esp_timer_get_time();
+            LiveSample sample;
+            while (esp_timer_get_time() - startMicros < dbSliceMicros)
             {
-                if ((recordsUntil && dataReadLastTimestamp >= recordsUntil) || dblog_read_next_row(&dataReadDbContext))
+                if (!nextDataRow(*cursor) || !rowToSample(&cursor->ctx, sample))
                 {
-                    *(workBuffer - 1) = ']';
-                    dataReadFinalize = true;
-                    goto exitResponse;
+                    cursor->json = statsToJson(cursor->stats, channelMask, statsFrom, statsUntil, "db");
+                    break;
                 }
+                cursor->stats.add(sample);
+                cursor->rowPending = false;
             }
+            releaseDbMutex("statsResponseHandler chunk");
+
+            // AsyncTCP calls again on the next poll, without sending a chunk of padding for every slice
+            if (!cursor->json.length())
+                return RESPONSE_TRY_AGAIN;
+        }
+
+        size_t length = std::min<size_t>(maxLen, cursor->json.length() - cursor->jsonSent);
+        memcpy(buffer, cursor->json.c_str() + cursor->jsonSent, length);
+        cursor->jsonSent += length;
+        return length;
+    });
+    request->onDisconnect([cursor]() {
+        closeDbCursor(cursor);
+    });
+    request->send(response);
+}
 
-            auto rowBuffer = rowToBuffer(&dataReadDbContext, recordsUntil ? &dataReadLastTimestamp : nullptr);
-            rowBuffer.getBytes(workBuffer, lengthRemaining);
-            bytesWritten = rowBuffer.length();
-            workBuffer += bytesWritten;
-            lengthRemaining -= bytesWritten;
+// comma separated channel names, returns 0 if any of them is unknown
+uint8_t parseStatsChannels(const String &value)
+{
+    uint8_t channelMask = 0;
+    int start = 0;
+    while (start <= (int)value.length())
+    {
+        int end = value.indexOf(',', start);
+        if (end < 0)
+            end = value.length();
+        String name = value.substring(start, end);
+        int channel = 0;
+        while (channel < RangeStats::ChannelCount && name != statsChannelNames[channel])
+            channel++;
+        if (channel == RangeStats::ChannelCount)
+            return 0;
+        channelMask |= 1 << channel;
+        start = end + 1;
+    }
+    return channelMask;
+}
 
-            isFirstRecord = false;
+String statsToJson(const RangeStats &stats, uint8_t channelMask, time_t from, time_t until, const char *source)
+{
+    StreamString json;
+    json.printf("{\"from\":%ld,\"until\":%ld,\"source\":\"%s\",\"count\":%u,\"coveredSeconds\":%u",
+                from, until, source, stats.count(), stats.getCoveredSeconds());
+    for (int i = 0; i < RangeStats::ChannelCount; i++)
+    {
+        if (!(channelMask & (1 << i)))
+            continue;
+        const ChannelStats &channel = stats.channel(i);
+        if (!channel.count)
+        {
+            json.printf(",\"%s\":null", statsChannelNames[i]);
+            continue;
         }
+        json.printf(",\"%s\":{\"min\":%.2f,\"max\":%.2f,\"mean\":%.3f,\"stddev\":%.3f,\"first\":[%d,%.2f],\"last\":[%d,%.2f],\"integral\":%.4f,\"integralUnit\":\"%s\"}",
+                    statsChannelNames[i], channel.min, channel.max, channel.mean, channel.stddev(), channel.firstTimestamp, channel.first,
+                    channel.lastTimestamp, channel.last, channel.integral / 3600, statsIntegralUnits[i]);
+    }
+    json.print('}');
+    return json;
+}
 
-        // completely fill remaining buffer as otherwise we might get called again with a maxLen of 3 or so instead of with a new large buffer...
-        for (bytesWritten = 0; bytesWritten < lengthRemaining; bytesWritten++)
-            workBuffer[bytesWritten] = ' ';
-        workBuffer += bytesWritten;
-        lengthRemaining -= bytesWritten;
+// intervals in which a channel meets a condition, e.g. /find?where=current>2000&from=<t>&until=<t>&gap=<s>: matching
+// rows at most gap seconds (default 5) apart form one interval. Only the pages whose zone may match are read, and
+// only records that have been flushed to the database are found.
+void findResponseHandler(AsyncWebServerRequest *request)
+{
+    ZonePredicate predicate;
+    time_t from = 0, until = 0, maxGap = 5;
+    FindCursor *cursor;
+    AsyncWebServerResponse *response;
 
-    exitResponse:
-        bytesWritten = maxLen - lengthRemaining;
-        ESP_LOGV(kLoggingTag, "ChunkedResponse: bytesWritten = %d, buffer = '%.*s', lengthRemaining = %d, dataReadFinalize = %d, dataReadLastTimestamp = %ld",
-                 bytesWritten, bytesWritten, buffer, lengthRemaining, dataReadFinalize, dataReadLastTimestamp);
+    auto whereParam = request->getParam("where");
+    if (!whereParam || !predicate.parse(whereParam->value().c_str(), statsChannelNames, LiveSample::ChannelCount))
+    {
+        request->send(400, "text/plain", "where=<current|voltage><op><value> with op one of > >= < <= expected");
+        return;
+    }
+    if (auto param = request->getParam("from"))
+        from = param->value().toInt();
+    if (auto param = request->getParam("until"))
+        until = param->value().toInt();
+    if (auto param = request->getParam("gap"))
+        maxGap = param->value().toInt();
+    ESP_LOGI(kLoggingTag, "Responding with intervals: where = %s, from = %ld, until = %ld", whereParam->value().c_str(), from, until);
 
-        return bytesWritten;
+    if (!aquireDbMutex(1000 * 10, __func__))
+    {
+        request->send(500);
+        return;
+    }
+    cursor = openFindCursor(whereParam->value(), predicate, from, until, maxGap);
+    releaseDbMutex(__func__);
+    if (!cursor)
+    {
+        request->send(openDbCursors >= maxDbCursors ? 503 : 500);
+        return;
+    }
+
+    response = request->beginChunkedResponse("application/json", [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        if (!cursor->json.length())
+        {
+            if (!tryAquireDbMutex("findResponseHandler chunk"))
+                return RESPONSE_TRY_AGAIN;
+            if (cursor->generation != dbGeneration)
+                cursor->page = cursor->pageCount;
+
+            // scan for one slice per call, nothing is sent until the scan is complete
+            int64_t startMicros = esp_timer_get_time();
+            while (esp_timer_get_time() - startMicros < dbSliceMicros)
+            {
+                if (!scanNextPage(*cursor))
+                {
+                    cursor->json = findToJson(*cursor);
+                    break;
+                }
+            }
+            releaseDbMutex("findResponseHandler chunk");
+
+            // AsyncTCP calls again on the next poll, without sending a chunk of padding for every slice
+            if (!cursor->json.length())
+                return RESPONSE_TRY_AGAIN;
+        }
+
+        size_t length = std::min<size_t>(maxLen, cursor->json.length() - cursor->jsonSent);
+        memcpy(buffer, cursor->json.c_str() + cursor->jsonSent, length);
+        cursor->jsonSent += length;
+        return length;
     });
-    request->onDisconnect([]() {
-        fclose(dbFile);
-        releaseDbMutex("respondWithData onDisconnect");
+    request->onDisconnect([cursor]() {
+        closeFindCursor(cursor);
     });
     request->send(response);
-    sentResponse = true;
+}
+
+// opens the database and its zone map for reading page by page, needs the database mutex
+FindCursor *openFindCursor(const String &where, const ZonePredicate &predicate, time_t from, time_t until, time_t maxGap)
+{
+    FindCursor *cursor = nullptr;
+
+    if (openDbCursors >= maxDbCursors)
+    {
+        ESP_LOGW(kLoggingTag, "Too many database responses in progress");
+        return nullptr;
+    }
+
+    cursor = new FindCursor();
+    cursor->pageBuffer = (byte *)malloc(1 << dbPageSizeExp);
+    cursor->generation = dbGeneration;
+    cursor->where = where;
+    cursor->predicate = predicate;
+    cursor->from = from;
+    cursor->until = until;
+    cursor->maxGap = maxGap;
+    cursor->page = 1;
+    openDbCursors++;
+    if (!cursor->pageBuffer)
+    {
+        ESP_LOGE(kLoggingTag, "Error allocating the page buffer of a find cursor");
+        goto exit;
+    }
+    if (!dbFileExists(true))
+        return cursor;
+
+    cursor->file = fopen(dbFilename, "rb");
+    if (!cursor->file)
+    {
+        ESP_LOGE(kLoggingTag, "Error opening database file '%s'", dbFilename);
+        goto exit;
+    }
+    // whole pages are read anyway, and the writer must not be hidden behind a stale stdio buffer
+    setvbuf(cursor->file, nullptr, _IONBF, 0);
+    fseek(cursor->file, 0, SEEK_END);
+    cursor->pageCount = ftell(cursor->file) >> dbPageSizeExp;
+
+    // without a zone map every page is read
+    cursor->zoneFile = fopen(zonesFilename, "rb");
+    if (cursor->zoneFile)
+        setvbuf(cursor->zoneFile, nullptr, _IONBF, 0);
+    return cursor;
+
+exit:
+    closeFindCursor(cursor);
+    return nullptr;
+}
+
+void closeFindCursor(FindCursor *cursor)
+{
+    if (cursor->file)
+        fclose(cursor->file);
+    if (cursor->zoneFile)
+        fclose(cursor->zoneFile);
+    free(cursor->pageBuffer);
+    delete cursor;
+    openDbCursors--;
+}
 
-exitHandler:
-    if (!sentResponse)
+// reads the next page if its zone may contain matching rows (or is unknown), false once all pages are done
+bool scanNextPage(FindCursor &cursor)
+{
+    if (cursor.page >= cursor.pageCount)
+    {
+        closeFindInterval(cursor);
+        return false;
+    }
+
+    uint32_t page = cursor.page++;
+    PageZone zone;
+    if (readPageZone(cursor.zoneFile, page, zone) &&
+        (!cursor.predicate.mayMatch(zone) || zone.lastTimestamp < cursor.from || (cursor.until && zone.firstTimestamp > cursor.until)))
+    {
+        cursor.pagesSkipped++;
+        return true;
+    }
+
+    if (fseek(cursor.file, page << dbPageSizeExp, SEEK_SET) || fread(cursor.pageBuffer, 1, 1 << dbPageSizeExp, cursor.file) != 1 << dbPageSizeExp)
+    {
+        ESP_LOGE(kLoggingTag, "Error reading page %u", page);
+        cursor.page = cursor.pageCount;
+        return true;
+    }
+    metrics.dbPagesRead.add();
+    cursor.pagesScanned++;
+
+    // interior pages have no rows
+    LeafPageReader reader;
+    if (!reader.begin(cursor.pageBuffer, 1 << dbPageSizeExp))
+        return true;
+    double values[1 + LiveSample::ChannelCount];
+    for (uint16_t row = 0; row < reader.rowCount(); row++)
+    {
+        if (!reader.readRow(row, values, 1 + LiveSample::ChannelCount))
+            continue;
+        int32_t timestamp = values[0];
+        float value = values[1 + cursor.predicate.channel];
+        if (timestamp < cursor.from || (cursor.until && timestamp > cursor.until) || !cursor.predicate.matches(value))
+            continue;
+        addFindMatch(cursor, timestamp, value);
+    }
+    return true;
+}
+
+void addFindMatch(FindCursor &cursor, int32_t timestamp, float value)
+{
+    if (cursor.intervalRows && timestamp >= cursor.intervalEnd && timestamp - cursor.intervalEnd <= cursor.maxGap)
+    {
+        cursor.intervalEnd = timestamp;
+        if (cursor.predicate.greater ? value > cursor.intervalPeak : value < cursor.intervalPeak)
+            cursor.intervalPeak = value;
+        cursor.intervalRows++;
+        return;
+    }
+
+    closeFindInterval(cursor);
+    cursor.intervalStart = cursor.intervalEnd = timestamp;
+    cursor.intervalPeak = value;
+    cursor.intervalRows = 1;
+}
+
+// [start, end, peak, rows], peak is the maximum for > and the minimum for <
+void closeFindInterval(FindCursor &cursor)
+{
+    if (!cursor.intervalRows)
+        return;
+    if (cursor.intervalCount < maxFindIntervals)
+    {
+        char interval[64];
+        snprintf(interval, sizeof(interval), "%s[%d,%d,%.2f,%u]", cursor.intervalCount ? "," : "", cursor.intervalStart, cursor.intervalEnd,
+                 cursor.intervalPeak, cursor.intervalRows);
+        cursor.intervals += interval;
+    }
+    cursor.intervalCount++;
+    cursor.intervalRows = 0;
+}
+
+String findToJson(const FindCursor &cursor)
+{
+    StreamString json;
+    json.printf("{\"where\":\"%s\",\"from\":%ld,\"until\":%ld,\"gap\":%ld,\"pages\":%u,\"pagesScanned\":%u,\"pagesSkipped\":%u,\"intervalCount\":%u,\"truncated\":%s,\"intervals\":[",
+                cursor.where.c_str(), cursor.from, cursor.until, cursor.maxGap, cursor.pageCount ? cursor.pageCount - 1 : 0, cursor.pagesScanned,
+                cursor.pagesSkipped, cursor.intervalCount, cursor.intervalCount > maxFindIntervals ? "true" : "false");
+    json.print(cursor.intervals);
+    json.print("]}");
+    return json;
+}
+
+void addDataCacheHeaders(AsyncWebServerResponse *response, const String &etag)
+{
+    if (!etag.length())
+        return;
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", historicalCacheControl);
+}
+
+// compression for a response if the client accepts it and the response is expected to be large enough
+ResponseCompression *beginCompression(AsyncWebServerRequest *request, size_t estimatedBytes)
+{
+    if (!compressMinBytes || estimatedBytes < compressMinBytes || !request->hasHeader("Accept-Encoding"))
+        return nullptr;
+
+    String acceptEncoding = request->header("Accept-Encoding");
+    StreamDeflater::Format format;
+    const char *encoding;
+    if (acceptEncoding.indexOf("gzip") >= 0)
+    {
+        format = StreamDeflater::Format::Gzip;
+        encoding = "gzip";
+    }
+    else if (acceptEncoding.indexOf("deflate") >= 0)
+    {
+        format = StreamDeflater::Format::Zlib;
+        encoding = "deflate";
+    }
+    else
+        return nullptr;
+
+    if (++activeCompressions > maxCompressions)
+    {
+        activeCompressions--;
+        ESP_LOGI(kLoggingTag, "%d responses are being compressed already, sending this one uncompressed", maxCompressions);
+        return nullptr;
+    }
+    auto compression = new (std::nothrow) ResponseCompression();
+    if (!compression)
+    {
+        activeCompressions--;
+        ESP_LOGW(kLoggingTag, "Not enough memory to compress the response, sending it uncompressed");
+        return nullptr;
+    }
+    compression->deflater.begin(format);
+    compression->encoding = encoding;
+    return compression;
+}
+
+void endCompression(ResponseCompression *compression)
+{
+    if (!compression)
+        return;
+    delete compression;
+    activeCompressions--;
+}
+
+// every response that might be compressed varies by Accept-Encoding, even if this one is not compressed (the same
+// ETag is used for both)
+void addCompressionHeaders(AsyncWebServerResponse *response, const ResponseCompression *compression)
+{
+    response->addHeader("Vary", "Accept-Encoding");
+    if (compression)
+        response->addHeader("Content-Encoding", compression->encoding);
+}
+
+// the output of filler compressed, in slices that fit into the chunk, ends with the trailer once filler returns 0
+AwsResponseFiller compressFiller(ResponseCompression *compression, AwsResponseFiller filler)
+{
+    return [compression, filler](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        if (compression->deflater.isFinished())
+            return 0;
+        // the fillers need room for a few rows, a small chunk is better sent on the next call
+        size_t rawMaxLen = std::min(sizeof(compression->raw), StreamDeflater::maxInput(maxLen));
+        if (rawMaxLen < 4 * cacheRowMaxChars + 2)
+            return RESPONSE_TRY_AGAIN;
+
+        size_t rawLength = filler(compression->raw, rawMaxLen, compression->deflater.getTotalIn());
+        if (rawLength == RESPONSE_TRY_AGAIN)
+            return RESPONSE_TRY_AGAIN;
+
+        int64_t startMicros = esp_timer_get_time();
+        size_t length = compression->deflater.compress(compression->raw, rawLength, buffer, !rawLength);
+        metrics.compressMicros.add(esp_timer_get_time() - startMicros);
+        metrics.compressInBytes.add(rawLength);
+        metrics.compressOutBytes.add(length);
+        return length;
+    };
+}
+
+// expected size of a /data response, records are logged once per second
+size_t estimateDataBytes(const DataRange *ranges, size_t rangeCount, uint32_t maxPoints)
+{
+    time_t now;
+    time(&now);
+    uint64_t rows = 0;
+    for (size_t i = 0; i < rangeCount; i++)
+    {
+        time_t until = ranges[i].until ? ranges[i].until : now;
+        if (until > ranges[i].from)
+            rows += until - ranges[i].from;
+    }
+    if (maxPoints && rows > maxPoints)
+        rows = maxPoints;
+    return std::min<uint64_t>(rows * Record::JsonMaxChars, SIZE_MAX);
+}
+
+// the database file for download, read in slices under the database mutex like /data (a flush in between can still
+// change the last pages, tools/dbexport recovers such a file)
+void dbDownloadHandler(AsyncWebServerRequest *request)
+{
+    struct DbDownload
+    {
+        FILE *file;
+        long size;
+        long offset;
+        uint32_t generation;
+    };
+    DbDownload *download;
+    ResponseCompression *compression;
+    AsyncWebServerResponse *response;
+
+    if (!aquireDbMutex(1000 * 10, __func__))
     {
         request->send(500);
-        if (dbFile)
-            fclose(dbFile);
-        releaseDbMutex("respondWithData !sentResponse");
+        return;
+    }
+    if (!dbFileExists() || openDbCursors >= maxDbCursors)
+    {
+        request->send(openDbCursors >= maxDbCursors ? 503 : 404);
+        releaseDbMutex("dbDownloadHandler no file");
+        return;
+    }
+
+    download = new DbDownload();
+    download->file = fopen(dbFilename, "rb");
+    download->generation = dbGeneration;
+    if (download->file)
+    {
+        setvbuf(download->file, nullptr, _IONBF, 0);
+        fseek(download->file, 0, SEEK_END);
+        download->size = ftell(download->file);
+    }
+    releaseDbMutex(__func__);
+    if (!download->file)
+    {
+        ESP_LOGE(kLoggingTag, "Error opening database file '%s'", dbFilename);
+        delete download;
+        request->send(500);
+        return;
+    }
+    openDbCursors++;
+
+    AwsResponseFiller filler = [download](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        if (download->offset >= download->size || download->generation != dbGeneration)
+            return 0;
+        if (!tryAquireDbMutex("dbDownloadHandler chunk"))
+            return RESPONSE_TRY_AGAIN;
+        size_t length = std::min<size_t>(maxLen, download->size - download->offset);
+        if (fseek(download->file, download->offset, SEEK_SET) || fread(buffer, 1, length, download->file) != length)
+        {
+            ESP_LOGE(kLoggingTag, "Error reading database file at %ld", download->offset);
+            length = 0;
+        }
+        releaseDbMutex("dbDownloadHandler chunk");
+        download->offset += length;
+        return length;
+    };
+    compression = beginCompression(request, download->size);
+    response = request->beginChunkedResponse("application/x-sqlite3", compression ? compressFiller(compression, filler) : filler);
+    request->onDisconnect([download, compression]() {
+        fclose(download->file);
+        delete download;
+        endCompression(compression);
+        openDbCursors--;
+    });
+    response->addHeader("Content-Disposition", "attachment; filename=\"Esp32DataLogger.db\"");
+    addCompressionHeaders(response, compression);
+    request->send(response);
+}
+
+// opens the database (or capture) file with a cursor on the first row of the first range, needs the database mutex
+DbCursor *openDbCursor(const char *filename, const DataRange *ranges, size_t rangeCount, bool fromFirstRow)
+{
+    int res;
+    DbCursor *cursor = nullptr;
+
+    if (openDbCursors >= maxDbCursors)
+    {
+        ESP_LOGW(kLoggingTag, "Too many database responses in progress");
+        return nullptr;
+    }
+
+    cursor = new DbCursor();
+    cursor->pageBuffer = (byte *)malloc(1 << dbPageSizeExp);
+    cursor->ctx.buf = cursor->pageBuffer;
+    cursor->ctx.read_fn = read_fn_cursor;
+    cursor->generation = dbGeneration;
+    memcpy(cursor->ranges, ranges, rangeCount * sizeof(DataRange));
+    cursor->rangeCount = rangeCount;
+    cursor->rowPending = true;
+    openDbCursors++;
+    if (!cursor->pageBuffer)
+    {
+        ESP_LOGE(kLoggingTag, "Error allocating the page buffer of a database cursor");
+        goto exit;
+    }
+
+    cursor->file = fopen(filename, "rb");
+    if (!cursor->file)
+    {
+        ESP_LOGE(kLoggingTag, "Error opening database file '%s'", filename);
+        goto exit;
+    }
+    // whole pages are read anyway, and the writer must not be hidden behind a stale stdio buffer
+    setvbuf(cursor->file, nullptr, _IONBF, 0);
+    res = dblog_read_init(&cursor->ctx);
+    if (res)
+    {
+        ESP_LOGE(kLoggingTag, "dblog_read_init returned error %d", res);
+        goto exit;
     }
+    ESP_LOGI(kLoggingTag, "Page size: %d, last data page: %d", (int32_t)1 << cursor->ctx.page_size_exp, cursor->ctx.last_leaf_page);
+
+    res = fromFirstRow ? dblog_read_first_row(&cursor->ctx) : dblog_bin_srch_row_by_val(&cursor->ctx, 0, DBLOG_TYPE_INT, &cursor->ranges[0].from, sizeof(time_t), 0);
+    if (res)
+    {
+        ESP_LOGE(kLoggingTag, "dblog_bin_srch_row_by_val / dblog_read_first_row returned error %d", res);
+        goto exit;
+    }
+    return cursor;
+
+exit:
+    closeDbCursor(cursor);
+    return nullptr;
+}
+
+void closeDbCursor(DbCursor *cursor)
+{
+    if (cursor->file)
+        fclose(cursor->file);
+    free(cursor->pageBuffer);
+    delete cursor;
+    openDbCursors--;
+}
+
+// positions the cursor on the next row within the requested ranges, false when there are no more
+bool nextDataRow(DbCursor &cursor)
+{
+    double timestamp = cursor.lastTimestamp;
+    bool result = nextRangeRow(&cursor.ctx, cursor.ranges, cursor.rangeCount, cursor.rangeIndex, cursor.rowPending, timestamp);
+    cursor.lastTimestamp = timestamp;
+    return result;
+}
+
+// "from-until,from-until,..." with ascending, not overlapping ranges, returns their number or 0 if invalid
+size_t parseDataRanges(const String &value, DataRange *ranges)
+{
+    const char *text = value.c_str();
+    size_t count = 0;
+    while (*text)
+    {
+        long from, until;
+        int length;
+        if (count == maxDataRanges || sscanf(text, "%ld-%ld%n", &from, &until, &length) != 2 || from <= 0 || until < from ||
+            (count && from <= ranges[count - 1].until))
+            return 0;
+        ranges[count++] = {from, until};
+        text += length;
+        if (*text == ',' && text[1])
+            text++;
+        else if (*text)
+            return 0;
+    }
+    return count;
+}
+
+// fills the buffer with downsampled rows read from the cursor, pads it like the other chunks
+size_t writeDownsampledRows(DbCursor &cursor, char *buffer, size_t maxLen)
+{
+    char *workBuffer = buffer;
+    size_t lengthRemaining = maxLen;
+    int64_t startMicros = esp_timer_get_time();
+
+    // room for the rows of two buckets and the closing bracket
+    while (lengthRemaining > 4 * cacheRowMaxChars + 2)
+    {
+        LiveSample rows[2];
+        size_t count;
+
+        LiveSample sample;
+        if (nextDataRow(cursor) && rowToSample(&cursor.ctx, sample))
+        {
+            count = cursor.downsampler.add(sample, rows);
+            cursor.rowPending = false;
+        }
+        else
+        {
+            count = cursor.downsampler.finish(rows);
+            cursor.finalize = true;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            int written = writeJsonRow(workBuffer, lengthRemaining, rows[i], cursor.rowsSent++ == 0);
+            workBuffer += written;
+            lengthRemaining -= written;
+        }
+
+        if (cursor.finalize)
+        {
+            if (!cursor.rowsSent)
+                *workBuffer++ = '[';
+            *workBuffer++ = ']';
+            return workBuffer - buffer;
+        }
+
+        // many rows can go into a single bucket, so keep the slice short (whitespace is fine anywhere in between)
+        if (esp_timer_get_time() - startMicros > dbSliceMicros)
+        {
+            if (workBuffer == buffer)
+                *workBuffer++ = ' ';
+            return workBuffer - buffer;
+        }
+    }
+
+    memset(workBuffer, ' ', lengthRemaining);
+    return maxLen;
+}
+
+int writeJsonRow(char *buffer, size_t length, const LiveSample &row, bool isFirstRow)
+{
+    return snprintf(buffer, length, "%c[%d,%.2f,%.2f]", isFirstRow ? '[' : ',', row.timestamp, row.values[0], row.values[1]);
+}
+
+bool cacheResponse(AsyncWebServerRequest *request, const DataRange *ranges, size_t rangeCount, const MinMaxDownsampler *downsampler, const String &etag, int64_t startMicros,
+                   size_t estimatedBytes)
+{
+    struct CacheCursor
+    {
+        DataRange ranges[maxDataRanges];
+        size_t rangeCount;
+        size_t rangeIndex;
+        bool useRollups;
+        uint32_t rollupSeq;
+        uint32_t sampleSeq;
+        int32_t nextTimestamp; // samples are sent from here on once the rollups are done
+        int32_t until;
+        uint32_t rowsSent;
+        bool finalize;
+        bool downsample;
+        MinMaxDownsampler downsampler;
+    } cursor = {};
+
+    // the ranges are ascending, so if the first one is covered all of them are
+    auto startRange = [](CacheCursor &cursor) {
+        time_t from = cursor.ranges[cursor.rangeIndex].from;
+        cursor.nextTimestamp = from;
+        cursor.until = cursor.ranges[cursor.rangeIndex].until;
+        cursor.useRollups = !liveCache.coversFullRes(from);
+        if (cursor.useRollups)
+            cursor.rollupSeq = liveCache.rollups.lowerBound(from - from % liveCache.rollupBucketSeconds());
+        else
+            cursor.sampleSeq = liveCache.fullRes.lowerBound(from);
+    };
+
+    if (xSemaphoreTake(liveCacheMutex, 100) != pdTRUE)
+        return false;
+    bool covered = liveCache.coversFullRes(ranges[0].from) || liveCache.coversRollups(ranges[0].from);
+    if (covered)
+    {
+        memcpy(cursor.ranges, ranges, rangeCount * sizeof(DataRange));
+        cursor.rangeCount = rangeCount;
+        startRange(cursor);
+    }
+    xSemaphoreGive(liveCacheMutex);
+
+    if (!covered)
+        return false;
+    ESP_LOGI(kLoggingTag, "Responding from live cache, rollups: %d", cursor.useRollups);
+    if (downsampler)
+    {
+        cursor.downsample = true;
+        cursor.downsampler = *downsampler;
+    }
+
+    AwsResponseFiller filler = [cursor, startMicros, startRange](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        char *workBuffer = (char *)buffer;
+        size_t lengthRemaining = maxLen;
+
+        if (cursor.finalize)
+        {
+            metrics.dataRequestDuration.observe(esp_timer_get_time() - startMicros);
+            return 0;
+        }
+
+        auto writeRow = [&](const LiveSample &row) {
+            int written = writeJsonRow(workBuffer, lengthRemaining, row, cursor.rowsSent++ == 0);
+            workBuffer += written;
+            lengthRemaining -= written;
+        };
+        auto addRow = [&](const LiveSample &row) {
+            if (!cursor.downsample)
+                return writeRow(row);
+            LiveSample downsampled[2];
+            for (size_t i = 0, rowCount = cursor.downsampler.add(row, downsampled); i < rowCount; i++)
+                writeRow(downsampled[i]);
+        };
+
+        // room for at least one rollup (two rows), the rows a downsampler may still hold back and the closing bracket
+        while (lengthRemaining > 4 * cacheRowMaxChars + 2)
+        {
+            LiveSample rows[8];
+            LiveRollup rollups[4];
+            size_t count;
+            size_t maxRows = std::min<size_t>(8, (lengthRemaining - 2) / cacheRowMaxChars - 2);
+            bool useRollups = cursor.useRollups;
+
+            xSemaphoreTake(liveCacheMutex, portMAX_DELAY);
+            if (cursor.useRollups)
+            {
+                count = liveCache.rollups.read(cursor.rollupSeq, rollups, maxRows / 2, cursor.until);
+                if (count)
+                    cursor.nextTimestamp = rollups[count - 1].timestamp + liveCache.rollupBucketSeconds();
+                else
+                {
+                    // continue with the samples of the current, not yet completed bucket
+                    cursor.useRollups = false;
+                    cursor.sampleSeq = liveCache.fullRes.lowerBound(cursor.nextTimestamp);
+                }
+                // min and max as two rows to keep the peaks in the chart
+                for (size_t i = 0; i < count; i++)
+                {
+                    rows[2 * i].timestamp = rollups[i].timestamp;
+                    rows[2 * i + 1].timestamp = rollups[i].timestamp + liveCache.rollupBucketSeconds() / 2;
+                    for (int j = 0; j < LiveSample::ChannelCount; j++)
+                    {
+                        rows[2 * i].values[j] = rollups[i].min[j];
+                        rows[2 * i + 1].values[j] = rollups[i].max[j];
+                    }
+                }
+                count *= 2;
+            }
+            else
+                count = liveCache.fullRes.read(cursor.sampleSeq, rows, maxRows, cursor.until);
+            xSemaphoreGive(liveCacheMutex);
+
+            if (!count && useRollups)
+                continue;
+            if (!count && cursor.rangeIndex + 1 < cursor.rangeCount)
+            {
+                cursor.rangeIndex++;
+                xSemaphoreTake(liveCacheMutex, portMAX_DELAY);
+                startRange(cursor);
+                xSemaphoreGive(liveCacheMutex);
+                continue;
+            }
+
+            for (size_t i = 0; i < count; i++)
+                addRow(rows[i]);
+
+            if (!count)
+            {
+                LiveSample downsampled[2];
+                for (size_t i = 0, rowCount = cursor.downsample ? cursor.downsampler.finish(downsampled) : 0; i < rowCount; i++)
+                    writeRow(downsampled[i]);
+                if (!cursor.rowsSent)
+                {
+                    *workBuffer++ = '[';
+                    lengthRemaining--;
+                }
+                *workBuffer++ = ']';
+                lengthRemaining--;
+                cursor.finalize = true;
+                metrics.dataResponseBytes.add(maxLen - lengthRemaining);
+                return maxLen - lengthRemaining;
+            }
+        }
+
+        // completely fill remaining buffer as otherwise we might get called again with a maxLen of 3 or so instead of with a new large buffer...
+        memset(workBuffer, ' ', lengthRemaining);
+        metrics.dataResponseBytes.add(maxLen);
+        return maxLen;
+    };
+    ResponseCompression *compression = beginCompression(request, estimatedBytes);
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", compression ? compressFiller(compression, filler) : filler);
+    if (compression)
+    {
+        request->onDisconnect([compression]() {
+            endCompression(compression);
+        });
+    }
+    addDataCacheHeaders(response, etag);
+    addCompressionHeaders(response, compression);
+    request->send(response);
+
+    return true;
 }
 
 String rowToBuffer(struct dblog_read_context *ctx, time_t *timestamp)
@@ -415,6 +2194,36 @@ String rowToBuffer(struct dblog_read_context *ctx, time_t *timestamp)
     return buffer;
 }
 
+bool rowToSample(struct dblog_read_context *ctx, LiveSample &sample)
+{
+    double value;
+    if (!readColumnNumber(ctx, 0, value))
+        return false;
+    sample.timestamp = (int32_t)value;
+    for (int i = 0; i < LiveSample::ChannelCount; i++)
+    {
+        if (!readColumnNumber(ctx, i + 1, value))
+            return false;
+        sample.values[i] = value;
+    }
+    return true;
+}
+
+bool readColumnNumber(struct dblog_read_context *ctx, int col_idx, double &value)
+{
+    uint32_t col_type;
+    const byte *col_val = (const byte *)dblog_read_col_val(ctx, col_idx, &col_type);
+    if (!col_val)
+        return false;
+
+    if (!readDbNumber(col_val, col_type, value))
+    {
+        ESP_LOGE(kLoggingTag, "Unuspported column type %d for a number", col_type);
+        return false;
+    }
+    return true;
+}
+
 bool addColumnToBuffer(struct dblog_read_context *ctx, int col_idx, String &buffer)
 {
     uint32_t col_type;
@@ -452,7 +2261,11 @@ bool addColumnToBuffer(struct dblog_read_context *ctx, int col_idx, String &buff
     }
     break;
     case 7:
-        buffer.concat(read_double(col_val));
+        // REAL timestamps (of captures) carry fractional seconds
+        if (col_idx == 0)
+            buffer.concat(String(read_double(col_val), 6));
+        else
+            buffer.concat(read_double(col_val));
         break;
     default:
     {
@@ -479,45 +2292,42 @@ bool addColumnToBuffer(struct dblog_read_context *ctx, int col_idx, String &buff
     return true;
 }
 
-inline int16_t read_int16(const byte *ptr)
-{
-    return __bswap_16(*(int16_t *)ptr);
-}
-
-inline int32_t read_int32(const byte *ptr)
-{
-    return __bswap_32(*(int32_t *)ptr);
-}
-
-inline int64_t read_int64(const byte *ptr)
-{
-    return __bswap_64(*(int64_t *)ptr);
-}
-
-inline double read_double(const byte *ptr)
-{
-    int64_t doubleAsInt = read_int64(ptr);
-    // avoid strict-aliasing rules warning
-    double *doublePtr = (double *)&doubleAsInt;
-    return *doublePtr;
-}
-
 inline bool aquireDbMutex(uint blockMillis, const char *owner)
 {
     ESP_LOGD(kLoggingTag, "Mutex: xSemaphoreTake for owner '%s'", owner);
-    if (xSemaphoreTake(dbMutex, pdMS_TO_TICKS(blockMillis)) == pdFALSE)
+    int64_t waitStartMicros = esp_timer_get_time();
+    dbMutexWaiters++;
+    bool aquired = xSemaphoreTake(dbMutex, pdMS_TO_TICKS(blockMillis)) == pdTRUE;
+    dbMutexWaiters--;
+    int64_t nowMicros = esp_timer_get_time();
+    metrics.dbMutexWait.observe(nowMicros - waitStartMicros);
+    if (!aquired)
     {
         ESP_LOGE(kLoggingTag, "Timeout aquiring database mutex for owner '%s'", owner);
         return false;
     }
+    dbMutexAcquiredMicros = nowMicros;
 
     ESP_LOGD(kLoggingTag, "  Mutex: got it for owner '%s'", owner);
     return true;
 }
 
+// for readers between slices: gives way to anybody waiting for the mutex and does not block
+inline bool tryAquireDbMutex(const char *owner)
+{
+    if (dbMutexWaiters || xSemaphoreTake(dbMutex, 0) != pdTRUE)
+    {
+        ESP_LOGD(kLoggingTag, "Mutex: busy for owner '%s'", owner);
+        return false;
+    }
+    dbMutexAcquiredMicros = esp_timer_get_time();
+    return true;
+}
+
 inline void releaseDbMutex(const char *owner)
 {
     ESP_LOGD(kLoggingTag, "Mutex: xSemaphoreGive from owner '%s'", owner);
+    metrics.dbMutexHold.observe(esp_timer_get_time() - dbMutexAcquiredMicros);
     xSemaphoreGive(dbMutex);
 }
 
@@ -528,6 +2338,19 @@ int32_t read_fn_rctx(struct dblog_read_context *ctx, void *buf, uint32_t pos, si
     size_t ret = fread(buf, 1, len, dbFile);
     if (ret != len)
         return DBLOG_RES_READ_ERR;
+    metrics.dbPagesRead.add();
+    return ret;
+}
+
+int32_t read_fn_cursor(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    FILE *file = ((DbCursor *)ctx)->file;
+    if (fseek(file, pos, SEEK_SET))
+        return DBLOG_RES_SEEK_ERR;
+    size_t ret = fread(buf, 1, len, file);
+    if (ret != len)
+        return DBLOG_RES_READ_ERR;
+    metrics.dbPagesRead.add();
     return ret;
 }
 
@@ -538,16 +2361,25 @@ int32_t read_fn_wctx(struct dblog_write_context *ctx, void *buf, uint32_t pos, s
     size_t ret = fread(buf, 1, len, dbFile);
     if (ret != len)
         return DBLOG_RES_READ_ERR;
+    metrics.dbPagesRead.add();
     return ret;
 }
 
 int32_t write_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
 {
+    // the zone goes first so that it always covers the page content (see PageZones.hpp)
+    if (zoneFile && pos >> dbPageSizeExp && len == 1 << dbPageSizeExp)
+        writePageZone(zoneFile, pos >> dbPageSizeExp, (const byte *)buf);
+
     if (fseek(dbFile, pos, SEEK_SET))
         return DBLOG_RES_SEEK_ERR;
     size_t ret = fwrite(buf, 1, len, dbFile);
     if (ret != len)
         return DBLOG_RES_ERR;
+    flushBytesWritten += len;
+    metrics.dbPagesWritten.add();
+    if (pos >> dbPageSizeExp > flushLastPageWritten)
+        flushLastPageWritten = pos >> dbPageSizeExp;
     if (fflush(dbFile))
         return DBLOG_RES_FLUSH_ERR;
     fsync(fileno(dbFile));
@@ -1,18 +1,117 @@
 # pragma once
 
+const constexpr size_t maxDataRanges = 8;
+
+// state of a response that reads the database in slices, ctx must stay the first member (see read_fn_cursor)
+struct DbCursor
+{
+    struct dblog_read_context ctx;
+    FILE *file;
+    byte *pageBuffer;
+    uint32_t generation;
+    DataRange ranges[maxDataRanges];
+    size_t rangeCount;
+    size_t rangeIndex;
+    bool rowPending;
+    bool finalize;
+    uint32_t rowsSent;
+    time_t lastTimestamp;
+    bool downsample;
+    MinMaxDownsampler downsampler;
+    RangeStats stats;
+    String json;
+    size_t jsonSent;
+};
+
+// compression state of a /data or /db response, the raw output of the response is compressed chunk by chunk
+struct ResponseCompression
+{
+    StreamDeflater deflater;
+    const char *encoding;
+    uint8_t raw[2048];
+};
+
+// state of a /find response, pages are read straight from the file (see PageZones.hpp) without a dblog_read_context
+struct FindCursor
+{
+    FILE *file;
+    FILE *zoneFile;
+    byte *pageBuffer;
+    uint32_t generation;
+    String where;
+    ZonePredicate predicate;
+    time_t from;
+    time_t until;
+    time_t maxGap;
+    uint32_t page;
+    uint32_t pageCount;
+    uint32_t pagesScanned;
+    uint32_t pagesSkipped;
+    int32_t intervalStart;
+    int32_t intervalEnd;
+    float intervalPeak;
+    uint32_t intervalRows;
+    uint32_t intervalCount;
+    String intervals;
+    String json;
+    size_t jsonSent;
+};
+
+void *allocateLarge(size_t size);
+bool enqueueRecord(const Record &record);
+bool spillRecord(const Record &record);
+void writeSpilledRecords();
+bool mergeSpilledRecords(struct dblog_write_context *ctx);
+bool mergeSpilledRecord(struct dblog_write_context *ctx, Record record, bool previousBoot, uint32_t &merged, uint32_t &lost);
+bool mergeRecordFile(struct dblog_write_context *ctx, const char *filename, long &offset, long previousBootBytes, uint32_t &merged, uint32_t &lost);
+void holdUnsyncedRecords();
+bool mergeUnsyncedRecords(struct dblog_write_context *ctx, uint32_t &merged);
+void applyOverflowPolicy();
 void queueTask(void *taskParameter);
-void queueTaskFlush();
+void queueTaskFlush(FlushTrigger trigger);
+void resetDbInQueueTask();
 bool recoverDb();
+bool updateZoneMap();
+bool writePageZone(FILE *file, uint32_t page, const byte *pageData);
+bool readPageZone(FILE *file, uint32_t page, PageZone &zone);
+time_t readLastTimestamp();
 void dataResponseHandler(AsyncWebServerRequest *request);
+void statusResponseHandler(AsyncWebServerRequest *request);
+void statsResponseHandler(AsyncWebServerRequest *request);
+uint8_t parseStatsChannels(const String &value);
+String statsToJson(const RangeStats &stats, uint8_t channelMask, time_t from, time_t until, const char *source);
+void findResponseHandler(AsyncWebServerRequest *request);
+FindCursor *openFindCursor(const String &where, const ZonePredicate &predicate, time_t from, time_t until, time_t maxGap);
+void closeFindCursor(FindCursor *cursor);
+bool scanNextPage(FindCursor &cursor);
+void addFindMatch(FindCursor &cursor, int32_t timestamp, float value);
+void closeFindInterval(FindCursor &cursor);
+String findToJson(const FindCursor &cursor);
+void addDataCacheHeaders(AsyncWebServerResponse *response, const String &etag);
+bool cacheResponse(AsyncWebServerRequest *request, const DataRange *ranges, size_t rangeCount, const MinMaxDownsampler *downsampler, const String &etag, int64_t startMicros,
+                   size_t estimatedBytes);
+ResponseCompression *beginCompression(AsyncWebServerRequest *request, size_t estimatedBytes);
+void endCompression(ResponseCompression *compression);
+void addCompressionHeaders(AsyncWebServerResponse *response, const ResponseCompression *compression);
+AwsResponseFiller compressFiller(ResponseCompression *compression, AwsResponseFiller filler);
+size_t estimateDataBytes(const DataRange *ranges, size_t rangeCount, uint32_t maxPoints);
+void dbDownloadHandler(AsyncWebServerRequest *request);
+size_t writeDataRows(DbCursor &cursor, char *buffer, size_t maxLen);
+DbCursor *openDbCursor(const char *filename, const DataRange *ranges, size_t rangeCount, bool fromFirstRow);
+void closeDbCursor(DbCursor *cursor);
+bool nextDataRow(DbCursor &cursor);
+size_t parseDataRanges(const String &value, DataRange *ranges);
+size_t writeDownsampledRows(DbCursor &cursor, char *buffer, size_t maxLen);
+int writeJsonRow(char *buffer, size_t length, const LiveSample &row, bool isFirstRow);
 String rowToBuffer(struct dblog_read_context *ctx, time_t *timestamp);
+bool rowToSample(struct dblog_read_context *ctx, LiveSample &sample);
+bool readColumnNumber(struct dblog_read_context *ctx, int col_idx, double &value);
 bool addColumnToBuffer(struct dblog_read_context *ctx, int col_idx, String &buffer);
-inline int16_t read_int16(const byte *ptr);
-inline int32_t read_int32(const byte *ptr);
-inline int64_t read_int64(const byte *ptr);
-inline double read_double(const byte *ptr);
 inline bool aquireDbMutex(uint blockMillis, const char *owner);
+inline bool tryAquireDbMutex(const char *owner);
 inline void releaseDbMutex(const char *owner);
 int32_t read_fn_rctx(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len);
+int32_t read_fn_cursor(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len);
 int32_t read_fn_wctx(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
 int32_t write_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
 int flush_fn(struct dblog_write_context *ctx);
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+Decoding of the column values that dblog_read_col_val() returns: SQLite stores integers and doubles big endian,
+col_type is the SQLite serial type (1, 2, 4, 6: integers of 1, 2, 4, 8 bytes, 7: double, 0: NULL). Shared by the
+firmware and the host tools (tools/dbexport), so it must not depend on Arduino.
+*/
+
+inline int16_t read_int16(const uint8_t *ptr)
+{
+    uint16_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return __builtin_bswap16(value);
+}
+
+inline int32_t read_int32(const uint8_t *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return __builtin_bswap32(value);
+}
+
+inline int64_t read_int64(const uint8_t *ptr)
+{
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return __builtin_bswap64(value);
+}
+
+inline double read_double(const uint8_t *ptr)
+{
+    int64_t doubleAsInt = read_int64(ptr);
+    double value;
+    memcpy(&value, &doubleAsInt, sizeof(value));
+    return value;
+}
+
+inline bool readDbInteger(const uint8_t *col_val, uint32_t col_type, int64_t &value)
+{
+    switch (col_type)
+    {
+    case 1:
+        value = *((int8_t *)col_val);
+        return true;
+    case 2:
+        value = read_int16(col_val);
+        return true;
+    case 4:
+        value = read_int32(col_val);
+        return true;
+    case 6:
+        value = read_int64(col_val);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// integers and doubles, false for anything else
+inline bool readDbNumber(const uint8_t *col_val, uint32_t col_type, double &value)
+{
+    int64_t integer;
+    if (readDbInteger(col_val, col_type, integer))
+    {
+        value = integer;
+        return true;
+    }
+    if (col_type != 7)
+        return false;
+    value = read_double(col_val);
+    return true;
+}
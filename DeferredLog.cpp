@@ -0,0 +1,89 @@
+#include "Main.h"
+
+#ifdef LOG_DEFERRED
+
+namespace
+{
+    const constexpr char *kLoggingTag = "DeferredLog";
+
+    const constexpr int drainPeriodMillis = 100;
+    uint32_t serialSequence;
+}
+
+LogRing<128> Esp32Logging::deferredLog;
+
+void deferredLogTask(void *taskParameter);
+void logResponseHandler(AsyncWebServerRequest *request);
+
+// deferred log entries are printed by a low priority task (if toSerial) and can be fetched from /log
+void setupDeferredLog(bool toSerial)
+{
+    ESP_LOGD(kLoggingTag, "Entering setupDeferredLog()");
+
+    if (toSerial)
+    {
+        auto createTaskResult = xTaskCreate(deferredLogTask, "deferredLog", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr);
+        if (createTaskResult != pdPASS)
+            ESP_LOGE(kLoggingTag, "Error %d creating task", createTaskResult);
+    }
+
+    asyncWebServer.on("/log", HTTP_GET, logResponseHandler);
+}
+
+// one line per entry: "#L <sequence> <entry as hex>", or "#L lost <count>" if entries were overwritten before
+// they could be printed (tools/decode_log.py turns these into regular log lines)
+void deferredLogTask(void *taskParameter)
+{
+    LogEntry entry;
+    char line[4 + 10 + 1 + 2 * sizeof(LogEntry) + 2];
+
+    for (;;)
+    {
+        vTaskDelay(pdMS_TO_TICKS(drainPeriodMillis));
+
+        while (serialSequence != Esp32Logging::deferredLog.end())
+        {
+            if (!Esp32Logging::deferredLog.read(serialSequence, entry))
+            {
+                // either still being written (try again next time) or already overwritten
+                uint32_t oldest = Esp32Logging::deferredLog.begin();
+                if (serialSequence >= oldest)
+                    break;
+                printf("#L lost %u\n", oldest - serialSequence);
+                serialSequence = oldest;
+                continue;
+            }
+
+            char *linePos = line + sprintf(line, "#L %u ", serialSequence);
+            const byte *entryBytes = (const byte *)&entry;
+            for (size_t i = 0; i < sizeof(LogEntry); i++)
+                linePos += sprintf(linePos, "%02x", entryBytes[i]);
+            *linePos++ = '\n';
+            fwrite(line, 1, linePos - line, stdout);
+            serialSequence++;
+        }
+    }
+}
+
+// the entries still in the ring (or those from ?since=<sequence> on) as binary records of the sequence number
+// (4 bytes, little endian) followed by the raw LogEntry, X-Log-Next has the sequence number to continue with
+void logResponseHandler(AsyncWebServerRequest *request)
+{
+    uint32_t sequence = Esp32Logging::deferredLog.begin();
+    uint32_t end = Esp32Logging::deferredLog.end();
+    if (auto param = request->getParam("since"))
+        sequence = std::max<uint32_t>(sequence, param->value().toInt());
+
+    AsyncResponseStream *response = request->beginResponseStream("application/octet-stream");
+    for (LogEntry entry; sequence < end; sequence++)
+    {
+        if (!Esp32Logging::deferredLog.read(sequence, entry))
+            continue;
+        response->write((const uint8_t *)&sequence, sizeof(sequence));
+        response->write((const uint8_t *)&entry, sizeof(entry));
+    }
+    response->addHeader("X-Log-Next", String(end));
+    request->send(response);
+}
+
+#endif
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+Streaming deflate compressor (RFC 1951) with gzip (RFC 1952) or zlib (RFC 1950) framing for HTTP responses.
+
+Everything is sized up front (about 12 KB per compressor), so it can run inside a chunked response callback:
+* a single block with the fixed Huffman codes, no code tables to build or transmit
+* LZ77 over a 2 KB window with a hash chain of limited depth, enough for the repetitive JSON rows of /data
+* every call compresses all of its input, nothing is held back for a better match with the next call
+Data compressed with it is decoded by any inflate implementation (browsers, zlib, gzip).
+*/
+class StreamDeflater
+{
+public:
+    enum class Format : uint8_t
+    {
+        Gzip,
+        Zlib
+    };
+
+    void begin(Format streamFormat)
+    {
+        format = streamFormat;
+        position = 0;
+        end = 0;
+        bitBuffer = 0;
+        bitCount = 0;
+        headerWritten = false;
+        finished = false;
+        checksum = format == Format::Gzip ? 0 : 1;
+        totalIn = 0;
+        memset(hashHeads, 0, sizeof(hashHeads));
+    }
+
+    // bytes of output needed for inLen bytes of input in the worst case (a 3 byte match costs up to 31 bits)
+    static size_t maxOutput(size_t inLen)
+    {
+        return inLen * 11 / 8 + TrailerReserve;
+    }
+
+    // bytes of input that always fit into outLen bytes of output
+    static size_t maxInput(size_t outLen)
+    {
+        return outLen > TrailerReserve ? (outLen - TrailerReserve) * 8 / 11 : 0;
+    }
+
+    // compresses the input into out (room for maxOutput(inLen) bytes needed), the last call has final set and
+    // adds the end of the block and the trailer, returns the number of bytes written to out
+    size_t compress(const uint8_t *in, size_t inLen, uint8_t *out, bool final)
+    {
+        outPtr = out;
+        if (finished)
+            return 0;
+        if (!headerWritten)
+        {
+            writeHeader();
+            headerWritten = true;
+        }
+
+        updateChecksum(in, inLen);
+        totalIn += inLen;
+        while (inLen)
+        {
+            // at most a window of input at a time, so that the window before it is still in the buffer
+            size_t count = inLen < WindowSize ? inLen : WindowSize;
+            for (size_t i = 0; i < count; i++)
+                buffer[(end + i) & BufferMask] = in[i];
+            end += count;
+            in += count;
+            inLen -= count;
+            encode();
+        }
+
+        if (final)
+        {
+            writeBits(0, 7); // end of block, code 256
+            if (bitCount)
+                writeBits(0, 8 - bitCount);
+            writeTrailer();
+            finished = true;
+        }
+        return outPtr - out;
+    }
+
+    bool isFinished() const
+    {
+        return finished;
+    }
+
+    uint32_t getTotalIn() const
+    {
+        return totalIn;
+    }
+
+private:
+    static constexpr uint32_t WindowSize = 2048;
+    static constexpr uint32_t BufferMask = 2 * WindowSize - 1;
+    static constexpr int HashBits = 10;
+    static constexpr int MaxChainDepth = 8;
+    static constexpr uint32_t MinMatch = 3;
+    static constexpr uint32_t MaxMatch = 258;
+    static constexpr size_t TrailerReserve = 32;
+
+    void encode()
+    {
+        while (position < end)
+        {
+            uint32_t bestLength = 0, bestDistance = 0;
+            if (end - position >= MinMatch)
+            {
+                uint32_t hash = hashAt(position);
+                uint32_t maxLength = end - position < MaxMatch ? end - position : MaxMatch;
+                uint32_t candidate = hashHeads[hash];
+                for (int depth = 0; candidate && depth < MaxChainDepth; depth++)
+                {
+                    uint32_t candidatePosition = candidate - 1;
+                    uint32_t distance = position - candidatePosition;
+                    if (distance > WindowSize)
+                        break;
+                    uint32_t length = 0;
+                    while (length < maxLength && at(candidatePosition + length) == at(position + length))
+                        length++;
+                    if (length > bestLength)
+                    {
+                        bestLength = length;
+                        bestDistance = distance;
+                        if (length == maxLength)
+                            break;
+                    }
+                    uint16_t previous = hashChain[candidatePosition & (WindowSize - 1)];
+                    candidate = previous && previous < candidate ? candidate - previous : 0;
+                }
+            }
+
+            if (bestLength >= MinMatch)
+            {
+                writeMatch(bestLength, bestDistance);
+                for (uint32_t i = 0; i < bestLength; i++, position++)
+                    insertHash();
+            }
+            else
+            {
+                writeLiteral(at(position));
+                insertHash();
+                position++;
+            }
+        }
+    }
+
+    uint8_t at(uint32_t absolutePosition) const
+    {
+        return buffer[absolutePosition & BufferMask];
+    }
+
+    uint32_t hashAt(uint32_t absolutePosition) const
+    {
+        uint32_t value = at(absolutePosition) | at(absolutePosition + 1) << 8 | at(absolutePosition + 2) << 16;
+        return (value * 2654435761u) >> (32 - HashBits);
+    }
+
+    void insertHash()
+    {
+        if (end - position < MinMatch)
+            return;
+        uint32_t hash = hashAt(position);
+        uint32_t head = hashHeads[hash];
+        uint32_t distance = head ? position + 1 - head : 0;
+        hashChain[position & (WindowSize - 1)] = distance <= WindowSize ? distance : 0;
+        hashHeads[hash] = position + 1;
+    }
+
+    void writeLiteral(uint8_t literal)
+    {
+        if (literal < 144)
+            writeCode(0x30 + literal, 8);
+        else
+            writeCode(0x190 + literal - 144, 9);
+    }
+
+    void writeMatch(uint32_t length, uint32_t distance)
+    {
+        static const uint16_t lengthBase[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t distanceBase[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                                4097, 6145, 8193, 12289, 16385, 24577};
+        static const uint8_t distanceExtra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        int code = 28;
+        while (lengthBase[code] > length)
+            code--;
+        // length codes 257 - 279 have 7 bits, 280 - 285 have 8
+        if (code < 23)
+            writeCode(code + 1, 7);
+        else
+            writeCode(0xc0 + code - 23, 8);
+        writeBits(length - lengthBase[code], lengthExtra[code]);
+
+        code = 29;
+        while (distanceBase[code] > distance)
+            code--;
+        writeCode(code, 5);
+        writeBits(distance - distanceBase[code], distanceExtra[code]);
+    }
+
+    // Huffman codes are stored starting with their most significant bit
+    void writeCode(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++)
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        writeBits(reversed, length);
+    }
+
+    void writeBits(uint32_t value, int count)
+    {
+        bitBuffer |= value << bitCount;
+        bitCount += count;
+        while (bitCount >= 8)
+        {
+            *outPtr++ = bitBuffer;
+            bitBuffer >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    void writeHeader()
+    {
+        if (format == Format::Gzip)
+        {
+            static const uint8_t gzipHeader[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+            memcpy(outPtr, gzipHeader, sizeof(gzipHeader));
+            outPtr += sizeof(gzipHeader);
+        }
+        else
+        {
+            *outPtr++ = 0x78;
+            *outPtr++ = 0x01;
+        }
+        writeBits(1, 1); // last block
+        writeBits(1, 2); // fixed Huffman codes
+    }
+
+    void writeTrailer()
+    {
+        if (format == Format::Gzip)
+        {
+            writeBits(checksum & 0xffff, 16);
+            writeBits(checksum >> 16, 16);
+            writeBits(totalIn & 0xffff, 16);
+            writeBits(totalIn >> 16, 16);
+        }
+        else
+        {
+            for (int shift = 24; shift >= 0; shift -= 8)
+                writeBits((checksum >> shift) & 0xff, 8);
+        }
+    }
+
+    // CRC-32 with a 16 entry table for gzip, Adler-32 for zlib
+    void updateChecksum(const uint8_t *data, size_t length)
+    {
+        if (format == Format::Gzip)
+        {
+            static const uint32_t crcTable[16] = {0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+                                                  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+            uint32_t crc = ~checksum;
+            for (size_t i = 0; i < length; i++)
+            {
+                crc ^= data[i];
+                crc = (crc >> 4) ^ crcTable[crc & 15];
+                crc = (crc >> 4) ^ crcTable[crc & 15];
+            }
+            checksum = ~crc;
+        }
+        else
+        {
+            uint32_t a = checksum & 0xffff, b = checksum >> 16;
+            for (size_t i = 0; i < length; i++)
+            {
+                a = (a + data[i]) % 65521;
+                b = (b + a) % 65521;
+            }
+            checksum = b << 16 | a;
+        }
+    }
+
+    Format format;
+    uint8_t buffer[2 * WindowSize];
+    uint32_t hashHeads[1 << HashBits]; // position + 1 of the latest occurrence, 0 if none
+    uint16_t hashChain[WindowSize];    // distance to the previous occurrence with the same hash, 0 if none
+    uint32_t position;                 // next byte to encode (absolute)
+    uint32_t end;                      // end of the input in the buffer (absolute)
+    uint8_t *outPtr;
+    uint32_t bitBuffer;
+    int bitCount;
+    bool headerWritten;
+    bool finished;
+    uint32_t checksum;
+    uint32_t totalIn;
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "LiveCache.hpp"
+
+/*
+One pass min / max downsampler for chart data: the time range is split into buckets of equal length so that
+every bucket yields at most two rows, the samples with the minimum and the maximum of the first channel (in the
+order they occurred, so peaks stay where they were). The other channels get their minimum in the first and
+their maximum in the second row. Only the current bucket is kept, so ranges of any length can be streamed.
+*/
+class MinMaxDownsampler
+{
+public:
+    // maxPoints is the maximum number of rows for the whole range, returns the bucket length in seconds
+    uint32_t begin(int32_t from, int32_t until, uint32_t maxPoints)
+    {
+        uint32_t buckets = maxPoints / 2 ? maxPoints / 2 : 1;
+        uint32_t range = until > from ? until - from : 1;
+        bucketSeconds = (range + buckets - 1) / buckets;
+        if (!bucketSeconds)
+            bucketSeconds = 1;
+        origin = from;
+        count = 0;
+        return bucketSeconds;
+    }
+
+    // adds a sample (in ascending timestamp order), writes the rows of a completed bucket to rows
+    // (room for two needed) and returns their number
+    size_t add(const LiveSample &sample, LiveSample *rows)
+    {
+        int32_t bucket = bucketStart(sample.timestamp);
+        size_t completed = 0;
+        if (count && bucket != currentBucket)
+            completed = finish(rows);
+
+        if (!count)
+        {
+            currentBucket = bucket;
+            minRow = maxRow = sample;
+        }
+        else
+        {
+            if (sample.values[0] < minRow.values[0])
+                minRow.timestamp = sample.timestamp;
+            if (sample.values[0] > maxRow.values[0])
+                maxRow.timestamp = sample.timestamp;
+            for (int i = 0; i < LiveSample::ChannelCount; i++)
+            {
+                if (sample.values[i] < minRow.values[i])
+                    minRow.values[i] = sample.values[i];
+                if (sample.values[i] > maxRow.values[i])
+                    maxRow.values[i] = sample.values[i];
+            }
+        }
+        lastTimestamp = sample.timestamp;
+        count++;
+        return completed;
+    }
+
+    // writes the rows of the current bucket (if any) to rows and returns their number
+    size_t finish(LiveSample *rows)
+    {
+        if (!count)
+            return 0;
+
+        size_t rowCount = 0;
+        if (count == 1 || (minRow.timestamp == maxRow.timestamp && lastTimestamp == minRow.timestamp))
+            rows[rowCount++] = minRow;
+        else if (minRow.timestamp == maxRow.timestamp)
+        {
+            // the first channel was constant, keep the extremes of the others in two rows anyway
+            rows[rowCount++] = minRow;
+            rows[rowCount] = maxRow;
+            rows[rowCount++].timestamp = lastTimestamp;
+        }
+        else if (minRow.timestamp < maxRow.timestamp)
+        {
+            rows[rowCount++] = minRow;
+            rows[rowCount++] = maxRow;
+        }
+        else
+        {
+            rows[rowCount++] = maxRow;
+            rows[rowCount++] = minRow;
+        }
+        count = 0;
+        return rowCount;
+    }
+
+    uint32_t getBucketSeconds() const
+    {
+        return bucketSeconds;
+    }
+
+private:
+    int32_t bucketStart(int32_t timestamp) const
+    {
+        int32_t offset = timestamp - origin;
+        // floor division, samples before from still belong to a bucket of their own
+        int32_t index = offset >= 0 ? offset / (int32_t)bucketSeconds : -((-offset + (int32_t)bucketSeconds - 1) / (int32_t)bucketSeconds);
+        return origin + index * (int32_t)bucketSeconds;
+    }
+
+    uint32_t bucketSeconds = 1;
+    int32_t origin = 0;
+    int32_t currentBucket = 0;
+    int32_t lastTimestamp = 0;
+    uint32_t count = 0;
+    LiveSample minRow;
+    LiveSample maxRow;
+};
@@ -14,6 +14,14 @@ setup(): esp_log_level_set("*", ESP_LOG_INFO);
 * ESP_LOGx are redefined to include filename, line and function if used below this file,
   but not when used from SDK. Also ESP_LOG_BUFFER_HEXDUMP handles output inside compiled code,
   so it cannot benefit either.
+* Levels can be set per tag at compile time by defining LOG_TAG_LEVELS before including this file, e.g.
+  #define LOG_TAG_LEVELS {"App", ESP_LOG_DEBUG}, {"Logger", ESP_LOG_WARN}
+  Tags not listed use LOG_LOCAL_LEVEL. The level of the tag is a constexpr variable in the macros, so tags have to
+  be string literals or constexpr pointers to them, and calls above the level of their tag end up in an if on a
+  compile time constant that the compiler drops. The level set with esp_log_level_set still applies to the rest.
+* With -D LOG_DEFERRED, ESP_LOGI/D/V only store the format string address and the raw arguments in a RAM ring
+  (see LogRing.hpp), which is written out later and decoded on the host. Errors and warnings are still printed
+  right away. The runtime levels of esp_log_level_set do not apply to deferred calls.
 */
 
 // Revert redefines of Arduino-ESP32 esp32-hal-log.h to be able to use tags for logging again
@@ -25,25 +33,92 @@ setup(): esp_log_level_set("*", ESP_LOG_INFO);
 #undef LOG_FORMAT
 #undef ESP_LOG_LEVEL
 
-#define ESP_LOGE( tag, format, ... ) ESP_LOG_LEVEL_LOCAL(ESP_LOG_ERROR,   tag, format, ##__VA_ARGS__)
-#define ESP_LOGW( tag, format, ... ) ESP_LOG_LEVEL_LOCAL(ESP_LOG_WARN,    tag, format, ##__VA_ARGS__)
-#define ESP_LOGI( tag, format, ... ) ESP_LOG_LEVEL_LOCAL(ESP_LOG_INFO,    tag, format, ##__VA_ARGS__)
-#define ESP_LOGD( tag, format, ... ) ESP_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG,   tag, format, ##__VA_ARGS__)
-#define ESP_LOGV( tag, format, ... ) ESP_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+#ifndef LOG_TAG_LEVELS
+#define LOG_TAG_LEVELS
+#endif
+
+namespace Esp32Logging {
+    struct TagLevelEntry
+    {
+        const char *tag;
+        esp_log_level_t level;
+    };
+    // the first entry stands for all tags not listed
+    static constexpr TagLevelEntry tagLevels[] = { {nullptr, (esp_log_level_t)LOG_LOCAL_LEVEL}, LOG_TAG_LEVELS };
+    static constexpr size_t tagLevelCount = sizeof(tagLevels) / sizeof(tagLevels[0]);
+
+    // C++11 constexpr (single return statements), the macros below force compile time evaluation of TagLevel()
+
+    constexpr bool TagEquals(const char *a, const char *b)
+    {
+        return *a == *b && (!*a || TagEquals(a + 1, b + 1));
+    }
+
+    constexpr esp_log_level_t TagLevel(const char *tag, size_t index = tagLevelCount - 1)
+    {
+        return !index || TagEquals(tagLevels[index].tag, tag) ? tagLevels[index].level : TagLevel(tag, index - 1);
+    }
+
+    constexpr const char *FileNameAfter(const char *path, const char *fileName)
+    {
+        return !*path ? fileName : FileNameAfter(path + 1, *path == '/' || *path == '\\' ? path + 1 : fileName);
+    }
+
+    // compile time replacement for pathToFileName(__FILE__)
+    constexpr const char *FileName(const char *path)
+    {
+        return FileNameAfter(path, path);
+    }
+
+    // local time formatted at most once per second and task: thread local, so there is nothing to lock
+    inline const char *TimestampString()
+    {
+        static __thread time_t formattedTime = -1;
+        static __thread char formatted[20];
+        time_t now = time(nullptr);
+        if (now != formattedTime)
+        {
+            struct tm nowTm;
+            localtime_r(&now, &nowTm);
+            strftime(formatted, sizeof(formatted), "%Y-%m-%d %H:%M:%S", &nowTm);
+            formattedTime = now;
+        }
+        return formatted;
+    }
+}
+
+#define ESP_LOGE( tag, format, ... ) ESP_LOG_LEVEL_TAG(ESP_LOG_ERROR,   tag, format, ##__VA_ARGS__)
+#define ESP_LOGW( tag, format, ... ) ESP_LOG_LEVEL_TAG(ESP_LOG_WARN,    tag, format, ##__VA_ARGS__)
+#define ESP_LOGI( tag, format, ... ) ESP_LOG_LEVEL_TAG(ESP_LOG_INFO,    tag, format, ##__VA_ARGS__)
+#define ESP_LOGD( tag, format, ... ) ESP_LOG_LEVEL_TAG(ESP_LOG_DEBUG,   tag, format, ##__VA_ARGS__)
+#define ESP_LOGV( tag, format, ... ) ESP_LOG_LEVEL_TAG(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#ifdef LOG_DEFERRED
+#include "LogRing.hpp"
+
+namespace Esp32Logging {
+    extern LogRing<128> deferredLog;
+}
+
+#define ESP_LOG_LEVEL_TAG(level, tag, format, ...) do {                                    \
+        constexpr esp_log_level_t esp32LoggingTagLevel = Esp32Logging::TagLevel(tag);      \
+        if (esp32LoggingTagLevel >= level) {                                               \
+            if (level >= ESP_LOG_INFO)                                                     \
+                Esp32Logging::deferredLog.write(level, tag, Esp32Logging::FileName(__FILE__), __FUNCTION__, __LINE__, esp_timer_get_time(), format, ##__VA_ARGS__); \
+            else                                                                           \
+                ESP_LOG_LEVEL(level, tag, format, ##__VA_ARGS__);                          \
+        }} while(0)
+#else
+#define ESP_LOG_LEVEL_TAG(level, tag, format, ...) do {                                    \
+        constexpr esp_log_level_t esp32LoggingTagLevel = Esp32Logging::TagLevel(tag);      \
+        if (esp32LoggingTagLevel >= level) ESP_LOG_LEVEL(level, tag, format, ##__VA_ARGS__); \
+    } while(0)
+#endif
 
 #ifdef ESP_LOG_NO_SYSTIME
-#define LOG_FORMAT(letter, tag, format)  #letter " (%u / %lld) %s: [%s:%u] %s(): " format "\n", esp_log_timestamp(), esp_timer_get_time() / 1000, tag, pathToFileName(__FILE__), __LINE__, __FUNCTION__
+#define LOG_FORMAT(letter, tag, format)  #letter " (%u / %lld) %s: [%s:%u] %s(): " format "\n", esp_log_timestamp(), esp_timer_get_time() / 1000, tag, Esp32Logging::FileName(__FILE__), __LINE__, __FUNCTION__
 #else
-static time_t log_now_time;
-static struct tm log_now_tm;
-static char log_now_string[50];
-static const char* esp_log_timestamp_time() {
-    time(&log_now_time);
-    localtime_r(&log_now_time, &log_now_tm);
-    strftime(log_now_string, sizeof(log_now_string), "%Y-%m-%d %H:%M:%S", &log_now_tm);
-    return log_now_string;
-}
-#define LOG_FORMAT(letter, tag, format)  #letter " (%s / %u / %lld) %s: [%s:%u] %s(): " format "\n", esp_log_timestamp_time(), esp_log_timestamp(), esp_timer_get_time() / 1000, tag, pathToFileName(__FILE__), __LINE__, __FUNCTION__
+#define LOG_FORMAT(letter, tag, format)  #letter " (%s / %u / %lld) %s: [%s:%u] %s(): " format "\n", Esp32Logging::TimestampString(), esp_log_timestamp(), esp_timer_get_time() / 1000, tag, Esp32Logging::FileName(__FILE__), __LINE__, __FUNCTION__
 #endif
 
 #define ESP_LOG_LEVEL(level, tag, format, ...) do {                     \
@@ -129,6 +204,48 @@ namespace Esp32Logging {
 #endif
     }
 
+    // prints the cost per call of formatting a log line, with and without the caches (nothing is written to the UART)
+    static void __attribute__ ((unused)) LogFormattingCost(esp_log_level_t level)
+    {
+        const constexpr int iterations = 1000;
+        char line[160];
+
+        int64_t startMicros = esp_timer_get_time();
+        for (int i = 0; i < iterations; i++)
+        {
+            // what every call did before: format the local time and search the file name at run time
+            time_t now;
+            struct tm nowTm;
+            char nowString[20];
+            time(&now);
+            localtime_r(&now, &nowTm);
+            strftime(nowString, sizeof(nowString), "%Y-%m-%d %H:%M:%S", &nowTm);
+            snprintf(line, sizeof(line), "I (%s / %u / %lld) %s: [%s:%u] %s(): %d\n", nowString, esp_log_timestamp(), esp_timer_get_time() / 1000,
+                     kLoggingTag, pathToFileName(__FILE__), __LINE__, __FUNCTION__, i);
+        }
+        int64_t uncachedMicros = esp_timer_get_time() - startMicros;
+
+        startMicros = esp_timer_get_time();
+        for (int i = 0; i < iterations; i++)
+            snprintf(line, sizeof(line), "I (%s / %u / %lld) %s: [%s:%u] %s(): %d\n", TimestampString(), esp_log_timestamp(), esp_timer_get_time() / 1000,
+                     kLoggingTag, FileName(__FILE__), __LINE__, __FUNCTION__, i);
+        int64_t cachedMicros = esp_timer_get_time() - startMicros;
+
+#ifdef LOG_DEFERRED
+        // what a deferred call costs instead, into a ring of its own so that the real log is not flooded
+        LogRing<8> ring;
+        startMicros = esp_timer_get_time();
+        for (int i = 0; i < iterations; i++)
+            ring.write(ESP_LOG_INFO, kLoggingTag, FileName(__FILE__), __FUNCTION__, __LINE__, esp_timer_get_time(), "%d", i);
+        int64_t deferredMicros = esp_timer_get_time() - startMicros;
+        ESP_LOG_LEVEL_LOCAL(level, kLoggingTag, "Log call cost: %.2f us formatted uncached, %.2f us formatted cached, %.2f us deferred (UART output not included)",
+                            (double)uncachedMicros / iterations, (double)cachedMicros / iterations, (double)deferredMicros / iterations);
+#else
+        ESP_LOG_LEVEL_LOCAL(level, kLoggingTag, "Log line formatting per call: %.2f us uncached, %.2f us cached (UART output not included)",
+                            (double)uncachedMicros / iterations, (double)cachedMicros / iterations);
+#endif
+    }
+
     static void __attribute__ ((unused)) LogSysInfo(esp_log_level_t level, bool full)
     {
         if (full) {
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum class FlushTrigger : uint8_t
+{
+    None,
+    PageFull,  // enough records pending to fill up the last, partially written page
+    HighWater, // queue pressure, e.g. the ring is filling up or records are being spilled
+    MaxAge,    // oldest pending record has been waiting too long
+    Manual,
+    Count
+};
+
+struct FlushPolicy
+{
+    uint32_t highWaterPercent = 75;
+    uint32_t maxAgeMillis = 60 * 1000;
+};
+
+struct FlushStats
+{
+    uint32_t flushes;
+    uint32_t flushesByTrigger[(int)FlushTrigger::Count];
+    FlushTrigger lastTrigger;
+    uint32_t recordsFlushed;
+    uint64_t bytesWritten;
+    uint32_t pagesCompleted;
+    uint32_t recordsPerPage;
+    uint32_t lastDurationMillis;
+    uint32_t maxDurationMillis;
+    // bytes written to flash per byte of row data, 1 if every page would only ever be written once
+    float writeAmplification;
+};
+
+/*
+Decides when to flush the record queue to the database.
+
+Every flush rewrites the last, partially filled page and pays for opening and finalizing the database, so
+flushes are timed to write full pages: the scheduler keeps track of how many records fit into a page and how
+many are already on the last page and flushes as soon as that page can be completed. High queue pressure and
+a maximum age of the oldest pending record bound latency and RAM usage when records are coming in slowly.
+*/
+class FlushScheduler
+{
+public:
+    FlushScheduler(uint32_t pageSize, uint32_t estimatedRecordsPerPage)
+        : pageSize(pageSize), recordsPerPage(estimatedRecordsPerPage)
+    {
+    }
+
+    void setPolicy(const FlushPolicy &newPolicy)
+    {
+        policy = newPolicy;
+    }
+
+    const FlushPolicy &getPolicy() const
+    {
+        return policy;
+    }
+
+    // number of pending records at which the last page would be completed
+    size_t pageFullThreshold() const
+    {
+        return recordsPerPage - lastPageRecords;
+    }
+
+    size_t highWaterThreshold(size_t capacity) const
+    {
+        return capacity * policy.highWaterPercent / 100;
+    }
+
+    FlushTrigger evaluate(uint32_t nowMillis, size_t pending, size_t capacity, bool overflowing, bool manual)
+    {
+        if (!pending && !overflowing)
+        {
+            pendingSinceMillis = 0;
+            return manual ? FlushTrigger::Manual : FlushTrigger::None;
+        }
+        if (!pendingSinceMillis)
+            pendingSinceMillis = nowMillis ? nowMillis : 1;
+
+        if (manual)
+            return FlushTrigger::Manual;
+        if (overflowing || pending >= highWaterThreshold(capacity))
+            return FlushTrigger::HighWater;
+        if (pending >= pageFullThreshold())
+            return FlushTrigger::PageFull;
+        if (nowMillis - pendingSinceMillis >= policy.maxAgeMillis)
+            return FlushTrigger::MaxAge;
+        return FlushTrigger::None;
+    }
+
+    // lastPageWritten is the highest page index written by this flush (0 if unknown)
+    void recordFlush(FlushTrigger trigger, uint32_t records, uint32_t bytesWritten, uint32_t lastPageWritten, uint32_t durationMillis)
+    {
+        stats.flushes++;
+        stats.flushesByTrigger[(int)trigger]++;
+        stats.lastTrigger = trigger;
+        stats.recordsFlushed += records;
+        stats.bytesWritten += bytesWritten;
+        stats.lastDurationMillis = durationMillis;
+        if (durationMillis > stats.maxDurationMillis)
+            stats.maxDurationMillis = durationMillis;
+        pendingSinceMillis = 0;
+
+        uint32_t pagesAdvanced = lastPage && lastPageWritten > lastPage ? lastPageWritten - lastPage : 0;
+        if (lastPageWritten > lastPage)
+            lastPage = lastPageWritten;
+        stats.pagesCompleted += pagesAdvanced;
+
+        // learn the real number of records per page, counting from the first page boundary seen
+        if (learnPages || pagesAdvanced)
+        {
+            if (learnPages)
+                learnRecords += records;
+            learnPages += pagesAdvanced;
+            if (learnPages >= 3)
+                recordsPerPage = learnRecords / (learnPages - 1) ? learnRecords / (learnPages - 1) : 1;
+        }
+
+        int32_t lastPageTotal = lastPageRecords + records - pagesAdvanced * recordsPerPage;
+        lastPageRecords = lastPageTotal < 0 ? 0 : lastPageTotal >= (int32_t)recordsPerPage ? recordsPerPage - 1 : lastPageTotal;
+    }
+
+    FlushStats getStats() const
+    {
+        FlushStats result = stats;
+        result.recordsPerPage = recordsPerPage;
+        uint64_t rowBytes = (uint64_t)stats.recordsFlushed * pageSize / recordsPerPage;
+        result.writeAmplification = rowBytes ? (float)stats.bytesWritten / rowBytes : 0;
+        return result;
+    }
+
+private:
+    uint32_t pageSize;
+    uint32_t recordsPerPage;
+    uint32_t lastPageRecords = 0;
+    uint32_t lastPage = 0;
+    uint32_t learnRecords = 0;
+    uint32_t learnPages = 0;
+    uint32_t pendingSinceMillis = 0;
+    FlushPolicy policy;
+    FlushStats stats = {};
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+struct LiveSample
+{
+    static constexpr int ChannelCount = 2;
+
+    int32_t timestamp;
+    float values[ChannelCount];
+};
+
+struct LiveRollup
+{
+    int32_t timestamp; // start of the bucket
+    float min[LiveSample::ChannelCount];
+    float max[LiveSample::ChannelCount];
+    float mean[LiveSample::ChannelCount];
+};
+
+/*
+Ring of items sorted by timestamp, addressed by a sequence number that keeps counting up while old items are
+overwritten. Readers keep a sequence number as cursor, so they never have to search again between chunks.
+*/
+template <typename T>
+class TimeRing
+{
+public:
+    using allocate_fn = void *(*)(size_t size);
+
+    ~TimeRing()
+    {
+        free(buffer);
+    }
+
+    bool begin(size_t ringCapacity, allocate_fn allocate)
+    {
+        buffer = (T *)allocate(ringCapacity * sizeof(T));
+        capacity = buffer ? ringCapacity : 0;
+        return buffer != nullptr;
+    }
+
+    void clear()
+    {
+        firstSeq = nextSeq;
+    }
+
+    size_t size() const
+    {
+        return nextSeq - firstSeq;
+    }
+
+    uint32_t beginSeq() const
+    {
+        return firstSeq;
+    }
+
+    uint32_t endSeq() const
+    {
+        return nextSeq;
+    }
+
+    const T &at(uint32_t seq) const
+    {
+        return buffer[seq % capacity];
+    }
+
+    // items may be changed in place as long as their timestamp stays the same
+    T &at(uint32_t seq)
+    {
+        return buffer[seq % capacity];
+    }
+
+    const T &back() const
+    {
+        return at(nextSeq - 1);
+    }
+
+    void push(const T &item)
+    {
+        if (!capacity)
+            return;
+        buffer[nextSeq % capacity] = item;
+        nextSeq++;
+        if (nextSeq - firstSeq > capacity)
+            firstSeq = nextSeq - capacity;
+    }
+
+    // sequence number of the first item with a timestamp >= timestamp
+    uint32_t lowerBound(int32_t timestamp) const
+    {
+        uint32_t low = firstSeq, high = nextSeq;
+        while (low < high)
+        {
+            uint32_t mid = low + (high - low) / 2;
+            if (at(mid).timestamp < timestamp)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low;
+    }
+
+    // copies up to maxCount items starting at seq (skipping ahead if those have been overwritten already)
+    // and stopping after until (if not 0), advances seq
+    size_t read(uint32_t &seq, T *items, size_t maxCount, int32_t until) const
+    {
+        if ((int32_t)(seq - firstSeq) < 0)
+            seq = firstSeq;
+
+        size_t count = 0;
+        while (count < maxCount && seq != nextSeq && (!until || at(seq).timestamp <= until))
+            items[count++] = at(seq++);
+        return count;
+    }
+
+private:
+    T *buffer = nullptr;
+    size_t capacity = 0;
+    uint32_t firstSeq = 0;
+    uint32_t nextSeq = 0;
+};
+
+/*
+In-RAM cache of the most recent samples: the last minutes at full resolution plus min / max / mean rollups
+over longer windows, updated incrementally for every sample. Does not do any locking itself.
+*/
+class LiveCache
+{
+public:
+    bool begin(size_t fullResCapacity, size_t rollupCapacity, uint32_t rollupBucketSeconds, TimeRing<LiveSample>::allocate_fn allocate)
+    {
+        bucketSeconds = rollupBucketSeconds;
+        bucketCount = 0;
+        return fullRes.begin(fullResCapacity, allocate) && rollups.begin(rollupCapacity, allocate);
+    }
+
+    void clear()
+    {
+        fullRes.clear();
+        rollups.clear();
+        bucketCount = 0;
+    }
+
+    void add(const LiveSample &sample)
+    {
+        // both rings must stay sorted, so start over if the clock jumped backwards
+        if (fullRes.size() && sample.timestamp < fullRes.back().timestamp)
+            clear();
+
+        fullRes.push(sample);
+
+        int32_t bucketTimestamp = sample.timestamp - sample.timestamp % (int32_t)bucketSeconds;
+        if (bucketCount && bucketTimestamp != bucket.timestamp)
+        {
+            for (int i = 0; i < LiveSample::ChannelCount; i++)
+                bucket.mean[i] = bucketSums[i] / bucketCount;
+            rollups.push(bucket);
+            bucketCount = 0;
+        }
+
+        if (!bucketCount)
+        {
+            bucket.timestamp = bucketTimestamp;
+            for (int i = 0; i < LiveSample::ChannelCount; i++)
+            {
+                bucket.min[i] = bucket.max[i] = sample.values[i];
+                bucketSums[i] = 0;
+            }
+        }
+        for (int i = 0; i < LiveSample::ChannelCount; i++)
+        {
+            if (sample.values[i] < bucket.min[i])
+                bucket.min[i] = sample.values[i];
+            if (sample.values[i] > bucket.max[i])
+                bucket.max[i] = sample.values[i];
+            bucketSums[i] += sample.values[i];
+        }
+        bucketCount++;
+    }
+
+    bool coversFullRes(int32_t from) const
+    {
+        return fullRes.size() && from >= fullRes.at(fullRes.beginSeq()).timestamp;
+    }
+
+    bool coversRollups(int32_t from) const
+    {
+        return rollups.size() && from >= rollups.at(rollups.beginSeq()).timestamp;
+    }
+
+    uint32_t rollupBucketSeconds() const
+    {
+        return bucketSeconds;
+    }
+
+    TimeRing<LiveSample> fullRes;
+    TimeRing<LiveRollup> rollups;
+
+private:
+    uint32_t bucketSeconds = 60;
+    LiveRollup bucket;
+    double bucketSums[LiveSample::ChannelCount];
+    uint32_t bucketCount = 0;
+};
@@ -0,0 +1,582 @@
+#include "Main.h"
+
+#include <AsyncTCP.h>
+#include <algorithm>
+#include <atomic>
+
+namespace
+{
+    const constexpr char *kLoggingTag = "Stream";
+
+    const constexpr char *streamUrl = "/dataevents";
+    const constexpr int maxStreamClients = 4;
+    const constexpr int streamRowMaxChars = 40;
+    const constexpr size_t maxSamplesPerEvent = 64;
+    const constexpr int seedSeconds = 60;
+    // bytes a client may have queued before it gets decimated and then falls behind, bounds the heap per client
+    const constexpr size_t maxQueuedBytes = 4096;
+    const constexpr uint32_t maxDecimation = 16;
+
+    struct StreamClient
+    {
+        AsyncClient *client;
+        std::atomic<bool> disconnected;
+        bool starting;           // cursor has not been positioned yet
+        uint32_t resumeSeq;      // from Last-Event-ID
+        int32_t resumeTimestamp; // 0 if the client did not send a Last-Event-ID
+        uint32_t seq;            // next sample to send, clients behind publishSeq catch up from the cache
+        int32_t lastTimestamp;   // of the last sample sent
+        String pending;          // event data not yet accepted by the TCP stack
+        uint32_t decimation;
+    };
+
+    // the publisher task only queues events for the clients, the AsyncClient itself is only ever used on the AsyncTCP
+    // task: its ack and poll callbacks send the pending data and it is deleted when it disconnects
+    SemaphoreHandle_t streamMutex = xSemaphoreCreateMutex();
+    StreamClient streamClients[maxStreamClients];
+    TaskHandle_t publisherTaskHandle;
+    std::atomic<uint32_t> publishIntervalMillis;
+    uint32_t publishSeq;
+
+    std::atomic<uint32_t> eventsSent{0}, eventsDeferred{0}, samplesDecimated{0}, gapsSent{0}, clientsResumed{0}, clientsRejected{0};
+
+    // binary frames for clients that need less bandwidth and parsing than the JSON events, see ReadMe.md for the format
+    AsyncWebSocket webSocket("/ws");
+    const constexpr int maxSocketClients = 4;
+    const constexpr uint8_t frameTypeSamples = 1;
+    const constexpr uint8_t commandSubscribe = 1;
+    const constexpr float int16Scales[LiveSample::ChannelCount] = {0.1f, 2.0f}; // 0.1 mA, 2 mV per LSB
+    const constexpr size_t maxFrameBytes = 16 + 4 * LiveSample::ChannelCount + maxSamplesPerEvent * (2 + 4 * LiveSample::ChannelCount);
+
+    enum class SampleEncoding : uint8_t
+    {
+        Float32,
+        Int16 // scaled, the scale per channel is included in the frame header
+    };
+
+    struct SocketSubscription
+    {
+        uint32_t clientId; // 0 if unused
+        uint8_t channelMask;
+        uint8_t decimation;
+        SampleEncoding encoding;
+    };
+
+    portMUX_TYPE socketSubscriptionsMux = portMUX_INITIALIZER_UNLOCKED;
+    SocketSubscription socketSubscriptions[maxSocketClients];
+    std::atomic<uint32_t> framesSent{0}, framesDropped{0};
+
+    class LiveStreamResponse : public AsyncWebServerResponse
+    {
+    public:
+        LiveStreamResponse()
+        {
+            _code = 200;
+            _contentType = "text/event-stream";
+            _sendContentLength = false;
+            addHeader("Cache-Control", "no-cache");
+            addHeader("Connection", "keep-alive");
+        }
+        void _respond(AsyncWebServerRequest *request) override;
+        size_t _ack(AsyncWebServerRequest *request, size_t len, uint32_t time) override;
+        bool _sourceValid() const override
+        {
+            return true;
+        }
+    };
+
+    class LiveStreamHandler : public AsyncWebHandler
+    {
+    public:
+        bool canHandle(AsyncWebServerRequest *request) override
+        {
+            if (request->method() != HTTP_GET || request->url() != streamUrl)
+                return false;
+            request->addInterestingHeader("Last-Event-ID");
+            return true;
+        }
+        void handleRequest(AsyncWebServerRequest *request) override
+        {
+            request->send(new LiveStreamResponse());
+        }
+    };
+}
+
+void publisherTask(void *taskParameter);
+void addStreamClient(AsyncWebServerRequest *request);
+void removeStreamClient(StreamClient &streamClient);
+void startStreamClient(StreamClient &streamClient);
+void catchUpStreamClient(StreamClient &streamClient, LiveSample *samples);
+bool queueStreamEvent(StreamClient &streamClient, const LiveSample *samples, size_t count, uint32_t firstSeq);
+void queueGapEvent(StreamClient &streamClient, int32_t from, int32_t until);
+void writePending(StreamClient &streamClient);
+void onSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
+void publishSocketFrames(const LiveSample *samples, size_t count, uint32_t firstSeq);
+size_t buildSocketFrame(uint8_t *frame, const SocketSubscription &subscription, const LiveSample *samples, size_t count, uint32_t firstSeq);
+
+void setupLiveStream(uint32_t intervalMillis)
+{
+    ESP_LOGD(kLoggingTag, "Entering setupLiveStream()");
+
+    publishIntervalMillis = intervalMillis;
+    publishSeq = findLiveSample(time(nullptr));
+
+    auto createTaskResult = xTaskCreate(publisherTask, "livePublisher", 4096, nullptr, uxTaskPriorityGet(nullptr), &publisherTaskHandle);
+    if (createTaskResult != pdPASS)
+    {
+        ESP_LOGE(kLoggingTag, "Error %d creating task", createTaskResult);
+        return;
+    }
+
+    asyncWebServer.addHandler(new LiveStreamHandler());
+    webSocket.onEvent(onSocketEvent);
+    asyncWebServer.addHandler(&webSocket);
+}
+
+// takes effect after the current interval
+void setLivePublishInterval(uint32_t intervalMillis)
+{
+    publishIntervalMillis = intervalMillis;
+}
+
+LiveStreamStats getLiveStreamStats()
+{
+    LiveStreamStats stats = {};
+    if (xSemaphoreTake(streamMutex, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+        for (auto &streamClient : streamClients)
+        {
+            if (!streamClient.client)
+                continue;
+            stats.clients++;
+            stats.maxQueuedBytes = std::max<uint32_t>(stats.maxQueuedBytes, streamClient.pending.length());
+            stats.maxDecimation = std::max(stats.maxDecimation, streamClient.decimation);
+        }
+        xSemaphoreGive(streamMutex);
+    }
+
+    portENTER_CRITICAL(&socketSubscriptionsMux);
+    for (auto &subscription : socketSubscriptions)
+    {
+        if (subscription.clientId)
+            stats.socketClients++;
+    }
+    portEXIT_CRITICAL(&socketSubscriptionsMux);
+    stats.framesSent = framesSent;
+    stats.framesDropped = framesDropped;
+
+    stats.eventsSent = eventsSent;
+    stats.eventsDeferred = eventsDeferred;
+    stats.samplesDecimated = samplesDecimated;
+    stats.gapsSent = gapsSent;
+    stats.clientsResumed = clientsResumed;
+    stats.clientsRejected = clientsRejected;
+    return stats;
+}
+
+void LiveStreamResponse::_respond(AsyncWebServerRequest *request)
+{
+    String head = _assembleHead(request->version());
+    request->client()->write(head.c_str(), _headLength);
+    _state = RESPONSE_WAIT_ACK;
+}
+
+size_t LiveStreamResponse::_ack(AsyncWebServerRequest *request, size_t len, uint32_t time)
+{
+    // headers have been received, from now on the connection belongs to the stream (this deletes the request and us)
+    if (len)
+        addStreamClient(request);
+    return 0;
+}
+
+// runs on the AsyncTCP task
+void addStreamClient(AsyncWebServerRequest *request)
+{
+    AsyncClient *client = request->client();
+
+    // the id of the last event the client received before reconnecting, see queueStreamEvent()
+    uint32_t resumeSeq = 0;
+    int32_t resumeTimestamp = 0;
+    if (request->hasHeader("Last-Event-ID"))
+        sscanf(request->header("Last-Event-ID").c_str(), "%u:%d", &resumeSeq, &resumeTimestamp);
+
+    // only wait briefly, the publisher might be waiting for the TCP stack which in turn might be waiting for us
+    StreamClient *streamClient = std::end(streamClients);
+    if (xSemaphoreTake(streamMutex, pdMS_TO_TICKS(100)) == pdTRUE)
+    {
+        streamClient = std::find_if(std::begin(streamClients), std::end(streamClients), [](StreamClient &c) { return !c.client; });
+        if (streamClient != std::end(streamClients))
+        {
+            streamClient->client = client;
+            streamClient->disconnected = false;
+            streamClient->starting = true;
+            streamClient->resumeSeq = resumeSeq;
+            streamClient->resumeTimestamp = resumeTimestamp;
+            streamClient->pending = String();
+            streamClient->decimation = 1;
+        }
+        xSemaphoreGive(streamMutex);
+    }
+
+    if (streamClient == std::end(streamClients))
+    {
+        ESP_LOGW(kLoggingTag, "No free stream client slot, closing connection");
+        clientsRejected++;
+        client->close(true);
+        return;
+    }
+
+    client->setRxTimeout(0);
+    client->onError(nullptr, nullptr);
+    client->onData(nullptr, nullptr);
+    client->onAck([](void *arg, AsyncClient *c, size_t len, uint32_t time) {
+        // never block AsyncTCP, the next ack or poll writes any remaining data anyway
+        if (xSemaphoreTake(streamMutex, 0) == pdTRUE)
+        {
+            writePending(*(StreamClient *)arg);
+            xSemaphoreGive(streamMutex);
+        }
+    }, streamClient);
+    // every 500 ms, this is what sends new events while nothing is in flight
+    client->onPoll([](void *arg, AsyncClient *c) {
+        if (xSemaphoreTake(streamMutex, 0) == pdTRUE)
+        {
+            writePending(*(StreamClient *)arg);
+            xSemaphoreGive(streamMutex);
+        }
+    }, streamClient);
+    client->onTimeout([](void *arg, AsyncClient *c, uint32_t time) { c->close(true); }, nullptr);
+    // no more callbacks come for the client after this one, the publisher only frees the slot, it never dereferences
+    // the client
+    client->onDisconnect([](void *arg, AsyncClient *c) {
+        ((StreamClient *)arg)->disconnected = true;
+        delete c;
+        xTaskNotifyGive(publisherTaskHandle);
+    }, streamClient);
+    delete request;
+
+    ESP_LOGI(kLoggingTag, "Stream client connected, last event: %u:%d", resumeSeq, resumeTimestamp);
+    xTaskNotifyGive(publisherTaskHandle);
+}
+
+// the client has already been deleted by its disconnect callback
+void removeStreamClient(StreamClient &streamClient)
+{
+    ESP_LOGI(kLoggingTag, "Stream client disconnected");
+    streamClient.client = nullptr;
+    streamClient.pending = String();
+}
+
+void publisherTask(void *taskParameter)
+{
+    ESP_LOGD(kLoggingTag, "Entering publisherTask()");
+
+    LiveSample samples[maxSamplesPerEvent];
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(publishIntervalMillis));
+
+        xSemaphoreTake(streamMutex, portMAX_DELAY);
+
+        for (auto &streamClient : streamClients)
+        {
+            if (streamClient.client && streamClient.disconnected)
+                removeStreamClient(streamClient);
+            if (streamClient.client && streamClient.starting)
+                startStreamClient(streamClient);
+        }
+
+        // records are coalesced into one event per interval (of up to maxSamplesPerEvent records each)
+        size_t count;
+        while ((count = readLiveSamples(publishSeq, samples, maxSamplesPerEvent)))
+        {
+            uint32_t firstSeq = publishSeq - count;
+            publishSocketFrames(samples, count, firstSeq);
+            for (auto &streamClient : streamClients)
+            {
+                if (!streamClient.client || streamClient.seq != firstSeq)
+                    continue;
+                if (queueStreamEvent(streamClient, samples, count, firstSeq))
+                    streamClient.seq = publishSeq;
+                else
+                    eventsDeferred++;
+            }
+        }
+
+        // clients that have just (re)connected or could not keep up are sent what they missed from the cache
+        for (auto &streamClient : streamClients)
+        {
+            if (streamClient.client && streamClient.seq != publishSeq)
+                catchUpStreamClient(streamClient, samples);
+        }
+
+        xSemaphoreGive(streamMutex);
+
+        webSocket.cleanupClients(maxSocketClients);
+    }
+
+    vTaskDelete(nullptr);
+}
+
+void startStreamClient(StreamClient &streamClient)
+{
+    if (streamClient.resumeTimestamp)
+    {
+        // continue right after the last event the client received, what is not in the cache anymore the client fetches from /data
+        time_t missingUntil;
+        streamClient.seq = resumeLiveSamples(streamClient.resumeSeq, streamClient.resumeTimestamp, missingUntil);
+        streamClient.lastTimestamp = streamClient.resumeTimestamp;
+        if (missingUntil)
+            queueGapEvent(streamClient, streamClient.resumeTimestamp + 1, missingUntil);
+        clientsResumed++;
+    }
+    else
+    {
+        // new clients first get the last minute so the chart does not start empty
+        streamClient.seq = findLiveSample(time(nullptr) - seedSeconds);
+        streamClient.lastTimestamp = 0;
+    }
+    streamClient.starting = false;
+}
+
+void catchUpStreamClient(StreamClient &streamClient, LiveSample *samples)
+{
+    // only as much as the client takes right now, the rest follows with the next runs
+    while ((int32_t)(publishSeq - streamClient.seq) > 0 && streamClient.pending.length() < maxQueuedBytes / 2)
+    {
+        // leave room for the event framing and a gap event so that the event always fits
+        size_t maxCount = std::min<size_t>({maxSamplesPerEvent, publishSeq - streamClient.seq, (maxQueuedBytes - streamClient.pending.length()) / streamRowMaxChars - 3});
+        uint32_t seq = streamClient.seq;
+        size_t count = readLiveSamples(seq, samples, maxCount);
+        if (!count)
+        {
+            // cache has been cleared
+            streamClient.seq = publishSeq;
+            break;
+        }
+
+        uint32_t firstSeq = seq - count;
+        if (firstSeq != streamClient.seq && streamClient.lastTimestamp)
+            queueGapEvent(streamClient, streamClient.lastTimestamp + 1, samples[0].timestamp - 1);
+        if (!queueStreamEvent(streamClient, samples, count, firstSeq))
+            break;
+        streamClient.seq = seq;
+    }
+}
+
+// appends an event with the samples to the client's pending data, decimated for slow clients, returns false
+// if it does not fit
+bool queueStreamEvent(StreamClient &streamClient, const LiveSample *samples, size_t count, uint32_t firstSeq)
+{
+    // back off while the client keeps falling behind, recover once it has caught up
+    if (streamClient.pending.length() > maxQueuedBytes / 2 && streamClient.decimation < maxDecimation)
+        streamClient.decimation *= 2;
+    else if (!streamClient.pending.length() && streamClient.decimation > 1)
+        streamClient.decimation /= 2;
+
+    // the id is the sequence number and timestamp of the last sample, the timestamp allows resuming after a restart
+    char row[streamRowMaxChars];
+    String event;
+    event.reserve(32 + count * streamRowMaxChars / streamClient.decimation);
+    snprintf(row, sizeof(row), "id: %u:%d\ndata: ", firstSeq + count - 1, samples[count - 1].timestamp);
+    event.concat(row);
+    size_t headerLength = event.length();
+    for (size_t i = 0; i < count; i++)
+    {
+        // decimate by sequence number so that all clients at the same level get the same samples
+        if ((firstSeq + i) % streamClient.decimation)
+        {
+            samplesDecimated++;
+            continue;
+        }
+        snprintf(row, sizeof(row), "%c[%d,%.2f,%.2f]", event.length() > headerLength ? ',' : '[', samples[i].timestamp, samples[i].values[0], samples[i].values[1]);
+        event.concat(row);
+    }
+    if (event.length() == headerLength)
+        event.concat('[');
+    event.concat("]\n\n");
+
+    if (streamClient.pending.length() + event.length() > maxQueuedBytes)
+        return false;
+    streamClient.pending.concat(event);
+    streamClient.lastTimestamp = samples[count - 1].timestamp;
+    eventsSent++;
+    return true;
+}
+
+void queueGapEvent(StreamClient &streamClient, int32_t from, int32_t until)
+{
+    ESP_LOGI(kLoggingTag, "Records %d - %d are not in the live cache anymore", from, until);
+    char event[64];
+    snprintf(event, sizeof(event), "event: gap\ndata: [%d,%d]\n\n", from, until);
+    streamClient.pending.concat(event);
+    gapsSent++;
+}
+
+// hands as much pending data to the TCP stack as it accepts right now, runs on the AsyncTCP task, caller must hold
+// streamMutex
+void writePending(StreamClient &streamClient)
+{
+    AsyncClient *client = streamClient.client;
+    if (!client || streamClient.disconnected || !streamClient.pending.length() || !client->canSend())
+        return;
+
+    size_t length = std::min<size_t>(client->space(), streamClient.pending.length());
+    if (!length)
+        return;
+    // once added the data is queued in the TCP stack even if sending it right away fails
+    length = client->add(streamClient.pending.c_str(), length);
+    if (!length)
+        return;
+    client->send();
+    streamClient.pending.remove(0, length);
+    metrics.streamBytes.add(length);
+}
+
+// runs on the AsyncTCP task
+void onSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+    if (type == WS_EVT_CONNECT)
+    {
+        // all channels at full rate as float32 until the client subscribes to something else
+        bool added = false;
+        portENTER_CRITICAL(&socketSubscriptionsMux);
+        for (auto &subscription : socketSubscriptions)
+        {
+            if (subscription.clientId)
+                continue;
+            subscription = {client->id(), (1 << LiveSample::ChannelCount) - 1, 1, SampleEncoding::Float32};
+            added = true;
+            break;
+        }
+        portEXIT_CRITICAL(&socketSubscriptionsMux);
+
+        if (!added)
+        {
+            ESP_LOGW(kLoggingTag, "No free socket client slot, closing connection");
+            clientsRejected++;
+            client->close();
+            return;
+        }
+        ESP_LOGI(kLoggingTag, "Socket client %u connected", client->id());
+    }
+    else if (type == WS_EVT_DISCONNECT)
+    {
+        portENTER_CRITICAL(&socketSubscriptionsMux);
+        for (auto &subscription : socketSubscriptions)
+        {
+            if (subscription.clientId == client->id())
+                subscription.clientId = 0;
+        }
+        portEXIT_CRITICAL(&socketSubscriptionsMux);
+        ESP_LOGI(kLoggingTag, "Socket client %u disconnected", client->id());
+    }
+    else if (type == WS_EVT_DATA)
+    {
+        // subscribe command: type, channel mask, decimation, encoding (one byte each)
+        auto info = (AwsFrameInfo *)arg;
+        if (info->opcode != WS_BINARY || info->index || info->len != len || len < 4 || data[0] != commandSubscribe)
+            return;
+
+        uint8_t channelMask = data[1] & ((1 << LiveSample::ChannelCount) - 1);
+        uint8_t decimation = std::max<uint8_t>(1, data[2]);
+        auto encoding = data[3] == (uint8_t)SampleEncoding::Int16 ? SampleEncoding::Int16 : SampleEncoding::Float32;
+        portENTER_CRITICAL(&socketSubscriptionsMux);
+        for (auto &subscription : socketSubscriptions)
+        {
+            if (subscription.clientId == client->id())
+                subscription = {client->id(), channelMask, decimation, encoding};
+        }
+        portEXIT_CRITICAL(&socketSubscriptionsMux);
+        ESP_LOGI(kLoggingTag, "Socket client %u subscribed, channels: %u, decimation: %u, encoding: %u", client->id(), channelMask, decimation, (uint8_t)encoding);
+    }
+}
+
+void publishSocketFrames(const LiveSample *samples, size_t count, uint32_t firstSeq)
+{
+    static uint8_t frame[maxFrameBytes];
+
+    portENTER_CRITICAL(&socketSubscriptionsMux);
+    SocketSubscription subscriptions[maxSocketClients];
+    memcpy(subscriptions, socketSubscriptions, sizeof(subscriptions));
+    portEXIT_CRITICAL(&socketSubscriptionsMux);
+
+    for (auto &subscription : subscriptions)
+    {
+        if (!subscription.clientId)
+            continue;
+
+        // slow clients lose whole frames rather than piling up messages in the heap
+        AsyncWebSocketClient *client = webSocket.client(subscription.clientId);
+        if (!client || client->status() != WS_CONNECTED)
+            continue;
+        if (client->queueIsFull())
+        {
+            framesDropped++;
+            continue;
+        }
+
+        size_t length = buildSocketFrame(frame, subscription, samples, count, firstSeq);
+        if (!length)
+            continue;
+        client->binary(frame, length);
+        framesSent++;
+        metrics.socketBytes.add(length);
+    }
+}
+
+// little endian: type, channel mask, encoding, decimation, first sequence number, base timestamp, sample count,
+// scale per channel (int16 only), then per sample the uint16 seconds since the previous one followed by its values
+size_t buildSocketFrame(uint8_t *frame, const SocketSubscription &subscription, const LiveSample *samples, size_t count, uint32_t firstSeq)
+{
+    // keep the decimated samples aligned to the sequence number, same as for the event stream
+    size_t first = (subscription.decimation - firstSeq % subscription.decimation) % subscription.decimation;
+    if (first >= count)
+        return 0;
+
+    uint8_t *pos = frame;
+    auto put = [&pos](const void *value, size_t size) {
+        memcpy(pos, value, size);
+        pos += size;
+    };
+
+    uint32_t seq = firstSeq + first;
+    int32_t previousTimestamp = samples[first].timestamp;
+    uint16_t sampleCount = (count - first + subscription.decimation - 1) / subscription.decimation;
+    *pos++ = frameTypeSamples;
+    *pos++ = subscription.channelMask;
+    *pos++ = (uint8_t)subscription.encoding;
+    *pos++ = subscription.decimation;
+    put(&seq, sizeof(seq));
+    put(&previousTimestamp, sizeof(previousTimestamp));
+    put(&sampleCount, sizeof(sampleCount));
+    if (subscription.encoding == SampleEncoding::Int16)
+    {
+        for (int channel = 0; channel < LiveSample::ChannelCount; channel++)
+        {
+            if (subscription.channelMask & (1 << channel))
+                put(&int16Scales[channel], sizeof(float));
+        }
+    }
+
+    for (size_t i = first; i < count; i += subscription.decimation)
+    {
+        uint16_t delta = std::min<int32_t>(UINT16_MAX, samples[i].timestamp - previousTimestamp);
+        previousTimestamp = samples[i].timestamp;
+        put(&delta, sizeof(delta));
+        for (int channel = 0; channel < LiveSample::ChannelCount; channel++)
+        {
+            if (!(subscription.channelMask & (1 << channel)))
+                continue;
+            if (subscription.encoding == SampleEncoding::Int16)
+            {
+                int16_t value = std::max(-32767.0f, std::min(32767.0f, roundf(samples[i].values[channel] / int16Scales[channel])));
+                put(&value, sizeof(value));
+            }
+            else
+                put(&samples[i].values[channel], sizeof(float));
+        }
+    }
+    return pos - frame;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// one deferred log call, strings are only referenced by their address (resolved from the ELF file on the host)
+struct LogEntry
+{
+    static constexpr int MaxWords = 8;
+
+    uint32_t format;
+    uint32_t tag;
+    uint32_t file;
+    uint32_t function;
+    uint16_t line;
+    uint8_t level;
+    uint8_t wordCount; // MaxWords + 1 if arguments were left out
+    int64_t micros;
+    uint32_t words[MaxWords];
+};
+
+/*
+Multi producer ring of deferred log calls: a call site only stores the addresses of its format string, tag, file and
+function, a timestamp and the raw arguments (as printf would see them after promotion: 4 bytes for up to 32 bit
+integers and pointers, 8 bytes for 64 bit integers and doubles). Formatting happens on the host (tools/decode_log.py).
+
+* Producers claim a slot with a single atomic increment and mark it complete with the sequence number, no locks.
+* The ring always accepts new entries and overwrites the oldest ones. Readers check the sequence number of a slot
+  before and after copying it, so entries overwritten while being read are detected and counted as lost.
+* %s arguments are only meaningful for strings in flash (literals), anything else decodes as an address.
+*/
+template <size_t Capacity>
+class LogRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    template <typename... Args>
+    void write(uint8_t level, const char *tag, const char *file, const char *function, uint16_t line, int64_t micros, const char *format, Args... args)
+    {
+        uint32_t sequence = head.fetch_add(1, std::memory_order_relaxed);
+        Slot &slot = slots[sequence & (Capacity - 1)];
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        LogEntry &entry = slot.entry;
+        entry.format = address(format);
+        entry.tag = address(tag);
+        entry.file = address(file);
+        entry.function = address(function);
+        entry.line = line;
+        entry.level = level;
+        entry.micros = micros;
+        size_t wordCount = 0;
+        pack(entry.words, wordCount, args...);
+        entry.wordCount = wordCount;
+
+        slot.sequence.store(sequence + 1, std::memory_order_release);
+    }
+
+    // sequence number of the next entry to be written
+    uint32_t end() const
+    {
+        return head.load(std::memory_order_acquire);
+    }
+
+    // the oldest sequence number that may still be in the ring
+    uint32_t begin() const
+    {
+        uint32_t currentHead = end();
+        return currentHead > Capacity ? currentHead - Capacity : 0;
+    }
+
+    // copies the entry with the given sequence number, false if it is not complete yet or has been overwritten
+    bool read(uint32_t sequence, LogEntry &entry) const
+    {
+        const Slot &slot = slots[sequence & (Capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != sequence + 1)
+            return false;
+        memcpy(&entry, &slot.entry, sizeof(LogEntry));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.sequence.load(std::memory_order_relaxed) == sequence + 1;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint32_t> sequence; // sequence number + 1 once complete, 0 while being written
+        LogEntry entry;
+    };
+
+    static uint32_t address(const void *pointer)
+    {
+        return (uint32_t)(uintptr_t)pointer;
+    }
+
+    static void pack(uint32_t *, size_t &)
+    {
+    }
+
+    template <typename T, typename... Rest>
+    static void pack(uint32_t *words, size_t &wordCount, T value, Rest... rest)
+    {
+        packValue(words, wordCount, value);
+        pack(words, wordCount, rest...);
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type packValue(uint32_t *words, size_t &wordCount, T value)
+    {
+        if (sizeof(T) > 4)
+            packBytes(words, wordCount, &value, 8);
+        else
+            packWord(words, wordCount, (uint32_t)value);
+    }
+
+    static void packValue(uint32_t *words, size_t &wordCount, double value)
+    {
+        packBytes(words, wordCount, &value, 8);
+    }
+
+    static void packValue(uint32_t *words, size_t &wordCount, const void *value)
+    {
+        packWord(words, wordCount, address(value));
+    }
+
+    static void packBytes(uint32_t *words, size_t &wordCount, const void *value, size_t length)
+    {
+        if (wordCount + length / 4 > LogEntry::MaxWords)
+        {
+            wordCount = LogEntry::MaxWords + 1;
+            return;
+        }
+        memcpy(&words[wordCount], value, length);
+        wordCount += length / 4;
+    }
+
+    static void packWord(uint32_t *words, size_t &wordCount, uint32_t value)
+    {
+        packBytes(words, wordCount, &value, 4);
+    }
+
+    std::atomic<uint32_t> head{0};
+    Slot slots[Capacity] = {};
+};
@@ -3,7 +3,6 @@
 // #include <SPI.h>
 #include <TFT_eSPI.h>
 #include <Button2.h>
-#include <EEPROM.h>
 
 TFT_eSPI tft = TFT_eSPI(135, 240);
 Button2 button1(35);
@@ -16,59 +15,79 @@ INA_Class INA;
 namespace
 {
     const constexpr char *kLoggingTag = "App";
+
+    // the INA is read at this rate, records are averaged from these samples. setup() samples at the default rate until
+    // the settings have been loaded and switches to the stored rate then, only setup() writes it, so changes saved
+    // later apply with the next restart (the trigger capture is set up with it), like /config reports
+    std::atomic<int> fastSamplePeriodMillis;
+
+    portMUX_TYPE sampleAccuMux = portMUX_INITIALIZER_UNLOCKED;
+    double currentAccu, voltageAccu;
+    uint32_t sampleAccuCount;
 }
 
 void collectDataPointsTask(void *pvParameters);
+void fastSampleTask(void *pvParameters);
+bool takeAveragedSample(Record &record);
+void applyInaSettings(const Settings &settings);
+#ifdef LOG_BENCH
+void logCostTask(void *pvParameters);
+#endif
 
 void setup()
 {
     // default first as it will clear all existing entries
     esp_log_level_set("*", ESP_LOG_INFO);
 
-    esp_log_level_set("App", ESP_LOG_DEBUG);
-    esp_log_level_set("Logger", ESP_LOG_VERBOSE);
-
     ESP_LOGI("Setup", "*** ESP32 DataLogger starting ***");
 
     Serial.begin(115200);
     Serial.println();
     Serial.setDebugOutput(true);
 
-    tft.init();
-    tft.setRotation(1);
-    tft.setTextFont(4);
-    tft.fillScreen(TFT_BLACK);
-
-    ESP_LOGI("SetupWiFi", "Connecting to %s", ssid);
-    if (String(WiFi.SSID()) != String(ssid))
-    {
-        WiFi.mode(WIFI_STA);
-        WiFi.begin(ssid, password);
-    }
-    while (WiFi.status() != WL_CONNECTED)
-    {
-        delay(500);
-        log_printf(".");
-    }
-    log_printf("\n");
-    ESP_LOGI("SetupWiFi", "Connected! IP address: %s", WiFi.localIP().toString().c_str());
-
-    MDNS.begin(hostName);
-    ESP_LOGI("SetupWiFi", "Open http://%s.local/edit to see the file browser", hostName);
-
-    configTzTime("CET-1CEST,M3.5.0/2:00,M10.5.0/3:00:", "pool.ntp.org");
+    // sampling starts before anything that might take long after a reset (mounting SPIFFS, NVS, the data logger), with
+    // the default INA configuration until the stored settings have been loaded, fastSampleTask applies them then
+    Settings defaults;
+    uint8_t devicesFound = INA.begin(1, 100000); // Expected max Amp & shunt resistance
+    ESP_LOGW(kLoggingTag, "Detected %d INA devices on the I2C bus", devicesFound);
+    if (devicesFound != 1)
+        while (true)
+            ;
+    ESP_LOGI(kLoggingTag, "INA device address: %d, name: %s", INA.getDeviceAddress(), INA.getDeviceName());
+    INA.setI2CSpeed(INA_I2C_FAST_MODE);    // Reading both registers every 2ms needs more than 100kHz
+    applyInaSettings(defaults);
+    INA.setMode(INA_MODE_CONTINUOUS_BOTH); // Bus/shunt measured continuously
+    fastSamplePeriodMillis = defaults.fastSamplePeriodMillis;
+    xTaskCreate(fastSampleTask, "fastSample", 4096, nullptr, configMAX_PRIORITIES - 2, nullptr);
 
+    // records are queued in RAM and get their wall clock time once NTP has synced (see Network.cpp), the database is
+    // recovered by the queue task
     SPIFFS.begin();
-    EEPROM.begin(16);
-    setupDataLogger(60, 60 * 5); // account for long delays due to database being queried
+    setupSettings();
+    Settings settings = getSettings();
+    // the only change at runtime, fastSampleTask applies the stored INA configuration itself (settings generation)
+    fastSamplePeriodMillis = settings.fastSamplePeriodMillis;
+    setupDataLogger(settings.flushEverySeconds, settings.queueLength, (OverflowPolicy)settings.overflowPolicy);
+    applySettings(settings);
+    loggingEnabled = settings.loggingEnabled;
+    // needs the queue, the samples taken until now are averaged into its first record
+    xTaskCreate(collectDataPointsTask, "collectDataPoints", 8192 * 2, nullptr, uxTaskPriorityGet(nullptr) + 1, nullptr);
+    setupTriggerCapture(fastSamplePeriodMillis);
+
+    setupLiveStream(settings.livePublishMillis);
+    setupMetrics();
+    setupTaskStats(5, 240);
+#ifdef LOG_DEFERRED
+    setupDeferredLog(true);
+#endif
 
-    loggingEnabled = EEPROM.read(0) && isDatabaseAccessible();
     button1.setTapHandler([](Button2 &btn) {
         if (loggingEnabled)
             flushQueue();
-        loggingEnabled = !loggingEnabled && isDatabaseAccessible();
-        EEPROM.write(0, loggingEnabled);
-        EEPROM.commit();
+        loggingEnabled = !loggingEnabled && (isDatabaseAccessible() || isDatabaseRecovering());
+        Settings settings = getSettings();
+        settings.loggingEnabled = loggingEnabled;
+        saveSettings(settings);
     });
     button2.setClickHandler([](Button2 &btn) {
         flushQueue();
@@ -78,20 +97,12 @@ void setup()
             resetDb();
     });
 
-    setupWebServer();
-
-    uint8_t devicesFound = INA.begin(1, 100000); // Expected max Amp & shunt resistance
-    ESP_LOGW(kLoggingTag, "Detected %d INA devices on the I2C bus", devicesFound);
-    if (devicesFound != 1)
-        while (true)
-            ;
-    ESP_LOGI(kLoggingTag, "INA device address: %d, name: %s", INA.getDeviceAddress(), INA.getDeviceName());
-    INA.setBusConversion(8500);            // Maximum conversion time 8.244ms
-    INA.setShuntConversion(8500);          // Maximum conversion time 8.244ms
-    INA.setAveraging(64);                  // Average each reading n-times
-    INA.setMode(INA_MODE_CONTINUOUS_BOTH); // Bus/shunt measured continuously
-
-    xTaskCreate(collectDataPointsTask, "collectDataPoints", 8192 * 2, nullptr, uxTaskPriorityGet(nullptr) + 1, nullptr);
+    // last, so that all handlers are registered when the network task starts the web server
+    setupNetwork();
+#ifdef LOG_BENCH
+    xTaskCreate(logCostTask, "logCost", 4096, nullptr, tskIDLE_PRIORITY + 1, nullptr);
+#endif
+    ESP_LOGI(kLoggingTag, "Setup done %u ms after boot", (uint32_t)(esp_timer_get_time() / 1000));
 }
 
 void loop()
@@ -105,6 +116,10 @@ void collectDataPointsTask(void *pvParameters)
 {
     ESP_LOGD(kLoggingTag, "Entering collectDataPointsTask()");
 
+    // the display is not needed for sampling, so it is initialized here rather than in setup()
+    tft.init();
+    tft.setRotation(1);
+    tft.setTextFont(4);
     tft.fillScreen(TFT_BLACK);
     tft.setTextSize(2);
     int tftWidth = tft.width();
@@ -117,20 +132,39 @@ void collectDataPointsTask(void *pvParameters)
     tft.drawString(" V", alignPosX, fontHeight * 1);
     int vPadding = tft.textWidth("-20.00");
 
+    Settings settings = getSettings();
+    uint32_t settingsGeneration = getSettingsGeneration();
     TickType_t xLastWakeTime = xTaskGetTickCount();
-    int latestRecordsCounter = 0;
     for (;;)
     {
         Record record;
 
-        record.currentMilliAmps = INA.getBusMicroAmps() / 1000;
+        if (settingsGeneration != getSettingsGeneration())
+        {
+            settingsGeneration = getSettingsGeneration();
+            settings = getSettings();
+            if (!settings.loggingEnabled && loggingEnabled)
+                flushQueue();
+            loggingEnabled = settings.loggingEnabled && (isDatabaseAccessible() || isDatabaseRecovering());
+        }
+        // records are queued while the database is recovered, but there is no point if that failed
+        if (loggingEnabled && !isDatabaseAccessible() && !isDatabaseRecovering())
+        {
+            ESP_LOGE(kLoggingTag, "Database not accessible, logging stopped");
+            loggingEnabled = false;
+        }
+
+        if (!takeAveragedSample(record))
+        {
+            ESP_LOGW(kLoggingTag, "No samples available");
+            vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(settings.recordPeriodMillis));
+            continue;
+        }
         ESP_LOGD(kLoggingTag, "currentMilliAmps: %f", record.currentMilliAmps);
-        record.voltageMilliVolts = INA.getBusMilliVolts();
         ESP_LOGD(kLoggingTag, "voltageMilliVolts: %f", record.voltageMilliVolts);
 
-        if (loggingEnabled)
-            addRecord(record, latestRecordsCounter % 10 == 0);
-        latestRecordsCounter++;
+        if (loggingEnabled && !addRecord(record))
+            ESP_LOGW(kLoggingTag, "Record with timestamp %ld was dropped", record.timestamp);
 
         tft.setTextSize(2);
         tft.setTextDatum(TR_DATUM); // right aligned
@@ -144,7 +178,84 @@ void collectDataPointsTask(void *pvParameters)
         tft.setTextDatum(TL_DATUM); // left aligned
         tft.setCursor(0, fontHeight * 2);
         tft.printf("Lg: %d, Qu: %d, Db: %d   ", loggingEnabled, getQueueSize(), dbFileExists(true));
+        auto overflowStats = getOverflowStats();
+        tft.setCursor(0, fontHeight * 2 + tft.fontHeight());
+        tft.printf("Dr: %u, Dc: %u, Sp: %u%s   ", overflowStats.dropped, overflowStats.decimated, overflowStats.spilled, overflowStats.spilling ? "*" : "");
+
+        vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(settings.recordPeriodMillis));
+    }
+}
+
+void fastSampleTask(void *pvParameters)
+{
+    ESP_LOGD(kLoggingTag, "Entering fastSampleTask()");
+
+    uint32_t settingsGeneration = getSettingsGeneration();
+    bool firstSample = true;
+    TickType_t xLastWakeTime = xTaskGetTickCount();
+    for (;;)
+    {
+        // the INA is only accessed from this task, so it also takes the new configuration
+        if (settingsGeneration != getSettingsGeneration())
+        {
+            settingsGeneration = getSettingsGeneration();
+            applyInaSettings(getSettings());
+        }
+
+        CaptureSample sample;
+        sample.timeMicros = esp_timer_get_time();
+        sample.currentMilliAmps = INA.getBusMicroAmps() / 1000.0f;
+        sample.voltageMilliVolts = INA.getBusMilliVolts();
+        if (firstSample)
+        {
+            metrics.bootFirstSampleMicros.update(sample.timeMicros);
+            ESP_LOGI(kLoggingTag, "First sample %u us after boot", (uint32_t)sample.timeMicros);
+            firstSample = false;
+        }
+
+        portENTER_CRITICAL(&sampleAccuMux);
+        currentAccu += sample.currentMilliAmps;
+        voltageAccu += sample.voltageMilliVolts;
+        sampleAccuCount++;
+        portEXIT_CRITICAL(&sampleAccuMux);
+
+        addCaptureSample(sample);
 
-        vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(1000));
+        vTaskDelayUntil(&xLastWakeTime, pdMS_TO_TICKS(fastSamplePeriodMillis));
     }
 }
+
+#ifdef LOG_BENCH
+// measures what logging costs once the boot is over, at a priority that does not get in the way of sampling
+void logCostTask(void *pvParameters)
+{
+    vTaskDelay(pdMS_TO_TICKS(10000));
+    Esp32Logging::LogFormattingCost(ESP_LOG_INFO);
+    vTaskDelete(nullptr);
+}
+#endif
+
+void applyInaSettings(const Settings &settings)
+{
+    ESP_LOGI(kLoggingTag, "INA conversion time %u us, averaging %u", settings.inaConversionMicros, settings.inaAveraging);
+    INA.setBusConversion(settings.inaConversionMicros);
+    INA.setShuntConversion(settings.inaConversionMicros);
+    INA.setAveraging(settings.inaAveraging); // the records are averaged in software over the fast samples on top
+}
+
+bool takeAveragedSample(Record &record)
+{
+    portENTER_CRITICAL(&sampleAccuMux);
+    double current = currentAccu, voltage = voltageAccu;
+    uint32_t count = sampleAccuCount;
+    currentAccu = voltageAccu = 0;
+    sampleAccuCount = 0;
+    portEXIT_CRITICAL(&sampleAccuMux);
+
+    if (!count)
+        return false;
+
+    record.currentMilliAmps = current / count;
+    record.voltageMilliVolts = voltage / count;
+    return true;
+}
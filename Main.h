@@ -9,9 +9,30 @@
 
 #include "ulog_sqlite.h"
 
+// compile time log levels per tag, anything above is left out of the binary (esp_log_level_set in setup() applies on top),
+// the per record debug lines of the sampling and queue tasks are only worth their cost while debugging
+#define LOG_TAG_LEVELS {"App", ESP_LOG_INFO}, {"Logger", ESP_LOG_INFO}, {"Stream", ESP_LOG_INFO}
 #include <Esp32Logging.hpp>
 
 #include "Consts.h"
+#include "FlushScheduler.hpp"
+#include "LiveCache.hpp"
+#include "Metrics.hpp"
+#include "RecordPipeline.hpp"
+
+//
+// Network.cpp
+
+void setupNetwork();
+bool isTimeSynced();
+time_t getRecordTimestamp();
+bool fixupTimestamp(time_t &timestamp);
+
+// records taken before the time was synced carry the seconds since boot instead, far below any real time
+inline bool isBootRelativeTimestamp(time_t timestamp)
+{
+    return timestamp < 1577836800; // 2020-01-01
+}
 
 //
 // Record
@@ -24,7 +45,7 @@ struct Record
 
     Record()
     {
-        time(&timestamp);
+        timestamp = getRecordTimestamp();
     }
 
     static constexpr int ColumnCount = 3;
@@ -45,18 +66,181 @@ struct Record
     static constexpr int JsonMaxChars = 30;
 };
 
+//
+// CaptureSample
+
+struct CaptureSample
+{
+    int64_t timeMicros; // esp_timer_get_time()
+    float currentMilliAmps;
+    float voltageMilliVolts;
+
+    static constexpr int ColumnCount = 3;
+    int AppendToDb(struct dblog_write_context *wctx, int64_t epochOffsetMicros) const
+    {
+        // fractional seconds so that captures can be charted on the same time axis as records
+        double timestamp = (timeMicros + epochOffsetMicros) / 1000000.0;
+        static uint8_t types[] = {DBLOG_TYPE_REAL, DBLOG_TYPE_REAL, DBLOG_TYPE_REAL};
+        const void *values[] = {&timestamp, &currentMilliAmps, &voltageMilliVolts};
+        static uint16_t lengths[] = {sizeof(double), sizeof(float), sizeof(float)};
+        return dblog_append_row_with_values(wctx, types, values, lengths);
+    }
+};
+
 //
 // DataLogger.cpp
 
-void setupDataLogger(int flushEverySeconds, int queueLength);
+struct OverflowStats
+{
+    uint32_t dropped;
+    uint32_t decimated;
+    uint32_t spilled;
+    uint32_t merged;
+    uint32_t unsynced; // moved to flash before the time was synced
+    bool spilling;
+};
+
+void setupDataLogger(int flushEverySeconds, int queueLength, OverflowPolicy policy);
 bool isDatabaseAccessible();
-bool addRecord(const Record &record, bool addToRingbuffer);
+bool isDatabaseRecovering();
+bool addRecord(const Record &record);
 void flushQueue();
 uint getQueueSize();
+void setOverflowPolicy(OverflowPolicy policy);
+OverflowPolicy getOverflowPolicy();
+OverflowStats getOverflowStats();
+FlushStats getFlushStats();
+void setFlushPolicy(const FlushPolicy &policy);
+void setCompressionMinBytes(size_t minBytes);
 void resetDb();
 bool dbFileExists(bool noLog = false);
+bool saveCapture(const char *filename, int64_t epochOffsetMicros, std::function<bool(CaptureSample &)> nextSample);
+uint32_t findLiveSample(time_t timestamp);
+size_t readLiveSamples(uint32_t &seq, LiveSample *samples, size_t maxCount);
+uint32_t resumeLiveSamples(uint32_t lastSeq, time_t lastTimestamp, time_t &missingUntil);
+
+//
+// LiveStream.cpp
+
+struct LiveStreamStats
+{
+    uint32_t clients;
+    uint32_t eventsSent;
+    uint32_t eventsDeferred; // could not be queued right away, sent later from the cache
+    uint32_t samplesDecimated;
+    uint32_t gapsSent;
+    uint32_t clientsResumed;
+    uint32_t clientsRejected;
+    uint32_t maxQueuedBytes;
+    uint32_t maxDecimation;
+    uint32_t socketClients;
+    uint32_t framesSent;
+    uint32_t framesDropped;
+};
+
+void setupLiveStream(uint32_t publishIntervalMillis);
+void setLivePublishInterval(uint32_t publishIntervalMillis);
+LiveStreamStats getLiveStreamStats();
+
+//
+// DeferredLog.cpp
+
+#ifdef LOG_DEFERRED
+void setupDeferredLog(bool toSerial);
+#endif
+
+//
+// Metrics.cpp
+
+struct LoggerMetrics
+{
+    MetricMax queueHighWater;
+    MetricHistogram flushDuration;
+    MetricHistogram dbMutexWait;
+    MetricHistogram dbMutexHold;
+    MetricCounter dbPagesRead;
+    MetricCounter dbPagesWritten;
+    MetricCounter dataRequests;
+    MetricCounter dataNotModified;
+    MetricCounter dataFromCache;
+    MetricCounter dataFromDb;
+    MetricCounter dataCacheable;
+    MetricHistogram dataRequestDuration;
+    MetricCounter dataResponseBytes;
+    MetricCounter compressInBytes;
+    MetricCounter compressOutBytes;
+    MetricCounter compressMicros;
+    MetricCounter streamBytes;
+    MetricCounter socketBytes;
+    MetricMax bootFirstSampleMicros;
+    MetricMax bootDbReadyMillis;
+    MetricMax bootWifiConnectedMillis;
+    MetricMax bootTimeSyncedMillis;
+};
+
+extern LoggerMetrics metrics;
+
+void setupMetrics();
+
+//
+// Settings.cpp
+
+// persisted in NVS, see Settings.cpp for the limits and which ones apply without a restart
+struct Settings
+{
+    uint32_t loggingEnabled = 0;
+    uint32_t recordPeriodMillis = 1000;
+    uint32_t fastSamplePeriodMillis = 2;
+    uint32_t inaAveraging = 1;
+    uint32_t inaConversionMicros = 588;
+    uint32_t flushEverySeconds = 60;
+    uint32_t flushHighWaterPercent = 75;
+    uint32_t queueLength = 60 * 5; // account for long delays due to database being queried
+    uint32_t overflowPolicy = (uint32_t)OverflowPolicy::SpillToFlash;
+    uint32_t compressMinBytes = 4 * 1024;
+    uint32_t livePublishMillis = 1000; // /dataevents and /ws batch the records of this interval into one event
+};
+
+void setupSettings();
+Settings getSettings();
+uint32_t getSettingsGeneration();
+bool saveSettings(const Settings &settings);
+void applySettings(const Settings &settings);
+
+//
+// TaskStats.cpp
+
+void setupTaskStats(uint32_t periodSeconds, size_t historyLength);
+
+//
+// TriggerCapture.cpp
+
+enum class TriggerChannel : uint8_t
+{
+    Current,
+    Voltage
+};
+
+enum class TriggerCondition : uint8_t
+{
+    Rising,  // crossing the threshold upwards
+    Falling, // crossing the threshold downwards
+    Step     // change between two consecutive samples of at least the threshold
+};
+
+struct TriggerConfig
+{
+    bool enabled = false;
+    TriggerChannel channel = TriggerChannel::Current;
+    TriggerCondition condition = TriggerCondition::Step;
+    float threshold = 100;
+    uint32_t preTriggerMillis = 500;
+    uint32_t postTriggerMillis = 1500;
+};
 
-static constexpr size_t latestRecordsBufferSize = 6;
+void setupTriggerCapture(int samplePeriodMillis);
+void addCaptureSample(const CaptureSample &sample);
+String getCaptureFilename(time_t captureId, bool withFs);
 
 //
 // WebserverAsync.cpp
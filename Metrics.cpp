@@ -0,0 +1,126 @@
+#include "Main.h"
+
+namespace
+{
+    const constexpr char *kLoggingTag = "Metrics";
+
+    const constexpr char *overflowPolicyNames[] = {"dropNewest", "dropOldest", "decimate", "spillToFlash"};
+}
+
+LoggerMetrics metrics;
+
+void metricsResponseHandler(AsyncWebServerRequest *request);
+void printMetric(Print &out, const char *name, const char *type, const char *help, uint64_t value);
+void printHistogram(Print &out, const char *name, const char *help, const MetricHistogram &histogram);
+void printTaskMetrics(Print &out);
+
+void setupMetrics()
+{
+    ESP_LOGD(kLoggingTag, "Entering setupMetrics()");
+
+    asyncWebServer.on("/metrics", HTTP_GET, metricsResponseHandler);
+}
+
+// Prometheus text exposition format
+void metricsResponseHandler(AsyncWebServerRequest *request)
+{
+    auto overflowStats = getOverflowStats();
+    auto flushStats = getFlushStats();
+    auto streamStats = getLiveStreamStats();
+
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+
+    printMetric(*response, "logger_queue_depth", "gauge", "Records waiting to be flushed", getQueueSize());
+    printMetric(*response, "logger_queue_high_water", "gauge", "Maximum number of records waiting to be flushed since start", metrics.queueHighWater.get());
+    printMetric(*response, "logger_records_flushed_total", "counter", "Records written to the database", flushStats.recordsFlushed);
+    printMetric(*response, "logger_records_dropped_total", "counter", "Records dropped because the queue was full", overflowStats.dropped);
+    printMetric(*response, "logger_records_decimated_total", "counter", "Records dropped by decimation because the queue was filling up", overflowStats.decimated);
+    printMetric(*response, "logger_records_spilled_total", "counter", "Records spilled to flash because the queue was full", overflowStats.spilled);
+    printMetric(*response, "logger_records_unsynced_total", "counter", "Records moved to flash because the time was not synced yet", overflowStats.unsynced);
+    response->printf("# HELP logger_overflow_policy Active queue overflow policy\n# TYPE logger_overflow_policy gauge\n");
+    response->printf("logger_overflow_policy{policy=\"%s\"} 1\n", overflowPolicyNames[(int)getOverflowPolicy()]);
+    printMetric(*response, "logger_flushes_total", "counter", "Database flushes", flushStats.flushes);
+    printHistogram(*response, "logger_flush_duration_seconds", "Duration of database flushes", metrics.flushDuration);
+    printHistogram(*response, "logger_db_mutex_wait_seconds", "Time spent waiting for the database mutex", metrics.dbMutexWait);
+    printHistogram(*response, "logger_db_mutex_hold_seconds", "Time the database mutex was held", metrics.dbMutexHold);
+    printMetric(*response, "logger_db_pages_read_total", "counter", "Database page reads", metrics.dbPagesRead.get());
+    printMetric(*response, "logger_db_pages_written_total", "counter", "Database page writes", metrics.dbPagesWritten.get());
+
+    printMetric(*response, "http_data_requests_total", "counter", "Requests to /data", metrics.dataRequests.get());
+    printMetric(*response, "http_data_not_modified_total", "counter", "Requests to /data answered with 304", metrics.dataNotModified.get());
+    printMetric(*response, "http_data_from_cache_total", "counter", "Requests to /data served from the live cache", metrics.dataFromCache.get());
+    printMetric(*response, "http_data_from_db_total", "counter", "Requests to /data served from the database", metrics.dataFromDb.get());
+    printHistogram(*response, "http_data_request_duration_seconds", "Time from receiving a /data request until its response is complete", metrics.dataRequestDuration);
+    printMetric(*response, "http_data_response_bytes_total", "counter", "Bytes of /data responses", metrics.dataResponseBytes.get());
+    printMetric(*response, "http_compress_input_bytes_total", "counter", "Bytes of /data and /db responses before compression", metrics.compressInBytes.get());
+    printMetric(*response, "http_compress_output_bytes_total", "counter", "Bytes of /data and /db responses after compression", metrics.compressOutBytes.get());
+    printMetric(*response, "http_compress_cpu_microseconds_total", "counter", "Time spent compressing responses", metrics.compressMicros.get());
+    if (metrics.compressOutBytes.get())
+    {
+        response->printf("# HELP http_compress_ratio Response bytes before per byte after compression\n# TYPE http_compress_ratio gauge\n");
+        response->printf("http_compress_ratio %.2f\n", (double)metrics.compressInBytes.get() / metrics.compressOutBytes.get());
+        response->printf("# HELP http_compress_cpu_microseconds_per_kilobyte Time spent compressing per KB before compression\n# TYPE http_compress_cpu_microseconds_per_kilobyte gauge\n");
+        response->printf("http_compress_cpu_microseconds_per_kilobyte %.1f\n", metrics.compressMicros.get() * 1024.0 / metrics.compressInBytes.get());
+    }
+
+    printMetric(*response, "stream_clients", "gauge", "Connected live event stream clients", streamStats.clients);
+    printMetric(*response, "stream_events_total", "counter", "Live events queued for clients", streamStats.eventsSent);
+    printMetric(*response, "stream_bytes_total", "counter", "Bytes sent to live event stream clients", metrics.streamBytes.get());
+    printMetric(*response, "stream_samples_decimated_total", "counter", "Samples left out for slow live event stream clients", streamStats.samplesDecimated);
+    printMetric(*response, "socket_clients", "gauge", "Connected binary live stream clients", streamStats.socketClients);
+    printMetric(*response, "socket_frames_total", "counter", "Frames sent to binary live stream clients", streamStats.framesSent);
+    printMetric(*response, "socket_frames_dropped_total", "counter", "Frames dropped for slow binary live stream clients", streamStats.framesDropped);
+    printMetric(*response, "socket_bytes_total", "counter", "Bytes sent to binary live stream clients", metrics.socketBytes.get());
+
+    printMetric(*response, "heap_free_bytes", "gauge", "Free heap", ESP.getFreeHeap());
+    printMetric(*response, "heap_min_free_bytes", "gauge", "Minimum free heap since start", ESP.getMinFreeHeap());
+    printMetric(*response, "heap_largest_free_block_bytes", "gauge", "Largest allocatable heap block", heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    printMetric(*response, "uptime_seconds", "counter", "Time since start", esp_timer_get_time() / 1000000);
+    printMetric(*response, "boot_first_sample_microseconds", "gauge", "Time from start until the first sample was taken", metrics.bootFirstSampleMicros.get());
+    printMetric(*response, "boot_db_ready_milliseconds", "gauge", "Time from start until the database was recovered, 0 while recovering", metrics.bootDbReadyMillis.get());
+    printMetric(*response, "boot_wifi_connected_milliseconds", "gauge", "Time from start until WiFi was first connected", metrics.bootWifiConnectedMillis.get());
+    printMetric(*response, "boot_time_synced_milliseconds", "gauge", "Time from start until the time was first synced by NTP", metrics.bootTimeSyncedMillis.get());
+
+    printTaskMetrics(*response);
+
+    request->send(response);
+}
+
+void printMetric(Print &out, const char *name, const char *type, const char *help, uint64_t value)
+{
+    out.printf("# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+void printHistogram(Print &out, const char *name, const char *help, const MetricHistogram &histogram)
+{
+    out.printf("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int bucket = 0; bucket < MetricHistogram::BucketCount; bucket++)
+        out.printf("%s_bucket{le=\"%g\"} %u\n", name, metricBucketBoundsMicros[bucket] / 1e6, histogram.cumulativeCount(bucket));
+    out.printf("%s_bucket{le=\"+Inf\"} %u\n%s_sum %.6f\n%s_count %u\n", name, histogram.count(), name, histogram.sumSeconds(), name, histogram.count());
+}
+
+void printTaskMetrics(Print &out)
+{
+#ifdef CONFIG_FREERTOS_USE_TRACE_FACILITY
+    int numTasks = uxTaskGetNumberOfTasks();
+    TaskStatus_t *stats = (TaskStatus_t *)malloc(numTasks * sizeof(TaskStatus_t));
+    if (!stats)
+        return;
+
+    uint32_t tasksTotalTime;
+    numTasks = uxTaskGetSystemState(stats, numTasks, &tasksTotalTime);
+
+    out.printf("# HELP task_stack_high_water_bytes Minimum free stack of the task since it was started\n# TYPE task_stack_high_water_bytes gauge\n");
+    for (int i = 0; i < numTasks; i++)
+        out.printf("task_stack_high_water_bytes{task=\"%s\"} %u\n", stats[i].pcTaskName, (uint)stats[i].usStackHighWaterMark);
+#ifdef CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    // rate() of this divided by rate() of the total gives the CPU share per task
+    out.printf("# HELP task_runtime_ticks_total Run time counter of the task\n# TYPE task_runtime_ticks_total counter\n");
+    for (int i = 0; i < numTasks; i++)
+        out.printf("task_runtime_ticks_total{task=\"%s\"} %u\n", stats[i].pcTaskName, stats[i].ulRunTimeCounter);
+    out.printf("task_runtime_ticks_total{task=\"_total\"} %u\n", tasksTotalTime * portNUM_PROCESSORS);
+#endif
+
+    free(stats);
+#endif
+}
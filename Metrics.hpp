@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+Lock-free building blocks for the /metrics endpoint. Updating them is a single relaxed atomic add (or a short
+compare-and-swap loop for the maximum), so they can be used from the sampling and flush paths and from AsyncTCP
+callbacks. Reading is not synchronized with updates, which is fine for monitoring.
+*/
+
+class MetricCounter
+{
+public:
+    void add(uint32_t value = 1)
+    {
+        // 64 bit atomics are not lock-free on the ESP32, so count wrap-arounds of the low word instead
+        uint32_t previous = low.fetch_add(value, std::memory_order_relaxed);
+        if ((uint32_t)(previous + value) < previous)
+            wraps.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return ((uint64_t)wraps.load(std::memory_order_relaxed) << 32) | low.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint32_t> low{0};
+    std::atomic<uint32_t> wraps{0};
+};
+
+class MetricMax
+{
+public:
+    void update(uint32_t value)
+    {
+        uint32_t current = maximum.load(std::memory_order_relaxed);
+        while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+            ;
+    }
+
+    uint32_t get() const
+    {
+        return maximum.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint32_t> maximum{0};
+};
+
+// upper bounds of the histogram buckets, the same for all histograms
+static constexpr uint32_t metricBucketBoundsMicros[] = {100, 500, 1000, 5000, 10000, 50000, 100000, 250000, 500000, 1000000, 5000000, 10000000};
+
+// durations in microseconds, exported in seconds
+class MetricHistogram
+{
+public:
+    static constexpr int BucketCount = sizeof(metricBucketBoundsMicros) / sizeof(metricBucketBoundsMicros[0]);
+
+    void observe(uint32_t micros)
+    {
+        int bucket = 0;
+        while (bucket < BucketCount && micros > metricBucketBoundsMicros[bucket])
+            bucket++;
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        sumMicros.add(micros);
+    }
+
+    // cumulative count of observations <= metricBucketBoundsMicros[bucket], bucket == BucketCount is +Inf
+    uint32_t cumulativeCount(int bucket) const
+    {
+        uint32_t count = 0;
+        for (int i = 0; i <= bucket; i++)
+            count += buckets[i].load(std::memory_order_relaxed);
+        return count;
+    }
+
+    uint32_t count() const
+    {
+        return cumulativeCount(BucketCount);
+    }
+
+    double sumSeconds() const
+    {
+        return sumMicros.get() / 1e6;
+    }
+
+private:
+    std::atomic<uint32_t> buckets[BucketCount + 1] = {};
+    MetricCounter sumMicros;
+};
@@ -0,0 +1,93 @@
+#include "Main.h"
+
+#include <esp_sntp.h>
+
+namespace
+{
+    const constexpr char *kLoggingTag = "Network";
+
+    // wall clock time of the boot in seconds since the epoch, 0 until the time has been synced
+    std::atomic<int32_t> bootEpochSeconds{0};
+}
+
+void networkTask(void *taskParameter);
+void timeSyncedCallback(struct timeval *tv);
+
+// WiFi, mDNS, NTP and the web server are brought up in the background, sampling does not wait for any of them
+void setupNetwork()
+{
+    ESP_LOGD(kLoggingTag, "Entering setupNetwork()");
+
+    auto createTaskResult = xTaskCreate(networkTask, "network", 8192, nullptr, uxTaskPriorityGet(nullptr), nullptr);
+    if (createTaskResult != pdPASS)
+        ESP_LOGE(kLoggingTag, "Error %d creating task", createTaskResult);
+}
+
+bool isTimeSynced()
+{
+    return bootEpochSeconds.load(std::memory_order_acquire) != 0;
+}
+
+// seconds since the epoch once the time has been synced, seconds since boot before
+time_t getRecordTimestamp()
+{
+    if (isTimeSynced())
+        return time(nullptr);
+    return esp_timer_get_time() / 1000000;
+}
+
+// turns a timestamp taken before the time was synced into seconds since the epoch, false if not synced yet
+bool fixupTimestamp(time_t &timestamp)
+{
+    if (!isBootRelativeTimestamp(timestamp))
+        return true;
+    int32_t bootEpoch = bootEpochSeconds.load(std::memory_order_acquire);
+    if (!bootEpoch)
+        return false;
+    timestamp += bootEpoch;
+    return true;
+}
+
+void networkTask(void *taskParameter)
+{
+    ESP_LOGD(kLoggingTag, "Entering networkTask()");
+
+    ESP_LOGI(kLoggingTag, "Connecting to %s", ssid);
+    if (String(WiFi.SSID()) != String(ssid))
+    {
+        WiFi.mode(WIFI_STA);
+        WiFi.begin(ssid, password);
+    }
+    // reconnects are left to the WiFi driver
+    while (WiFi.status() != WL_CONNECTED)
+        vTaskDelay(pdMS_TO_TICKS(100));
+    uint32_t connectedMillis = esp_timer_get_time() / 1000;
+    metrics.bootWifiConnectedMillis.update(connectedMillis);
+    ESP_LOGI(kLoggingTag, "Connected %u ms after boot! IP address: %s", connectedMillis, WiFi.localIP().toString().c_str());
+
+    MDNS.begin(hostName);
+    ESP_LOGI(kLoggingTag, "Open http://%s.local/edit to see the file browser", hostName);
+
+    sntp_set_time_sync_notification_cb(timeSyncedCallback);
+    configTzTime("CET-1CEST,M3.5.0/2:00,M10.5.0/3:00:", "pool.ntp.org");
+
+    setupWebServer();
+
+    vTaskDelete(nullptr);
+}
+
+// called from the lwIP task with every sync, the boot time is only taken from the first one
+void timeSyncedCallback(struct timeval *tv)
+{
+    if (isTimeSynced())
+        return;
+
+    int64_t sinceBootMicros = esp_timer_get_time();
+    bootEpochSeconds.store(((int64_t)tv->tv_sec * 1000000 + tv->tv_usec - sinceBootMicros) / 1000000, std::memory_order_release);
+    uint32_t syncedMillis = sinceBootMicros / 1000;
+    metrics.bootTimeSyncedMillis.update(syncedMillis);
+    ESP_LOGI(kLoggingTag, "Time synced %u ms after boot, fixing up the records taken so far", syncedMillis);
+
+    // the records held back until now can be written
+    flushQueue();
+}
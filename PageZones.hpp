@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "DbColumns.hpp"
+#include "LiveCache.hpp"
+
+/*
+Zone map of the database: one PageZone per data page with the timestamp span and the minimum / maximum of every
+channel, kept in a sidecar file next to the database (entry n - 1 for page n, page 0 is the database header).
+Queries with a value predicate only read the pages whose zone may match. A zone with rowCount 0 is unknown and
+the page has to be read.
+
+Zones are computed from the page buffers while they are written, so nothing has to be tracked per row. Sqlite
+Micro Logger only ever appends to the last data page, so writing the zone before the page keeps every zone a
+superset of the page content even if the write is interrupted.
+*/
+struct PageZone
+{
+    int32_t firstTimestamp;
+    int32_t lastTimestamp;
+    float min[LiveSample::ChannelCount];
+    float max[LiveSample::ChannelCount];
+    uint16_t rowCount;
+    uint16_t reserved;
+};
+
+// SQLite varint (big endian, 7 bits per byte, the 9th byte has 8), returns its length or 0 if it is cut off
+inline size_t readDbVarint(const uint8_t *ptr, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < 9 && ptr + i < end; i++)
+    {
+        if (i == 8)
+        {
+            value = (value << 8) | ptr[i];
+            return 9;
+        }
+        value = (value << 7) | (ptr[i] & 0x7f);
+        if (!(ptr[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+// length of a value of the given SQLite serial type
+inline size_t dbSerialTypeLength(uint64_t serialType)
+{
+    static const uint8_t lengths[] = {0, 1, 2, 3, 4, 6, 8, 8, 0, 0};
+    if (serialType < sizeof(lengths))
+        return lengths[serialType];
+    return serialType >= 12 ? (serialType - 12) / 2 : 0;
+}
+
+// rows of a table b-tree leaf page as written by Sqlite Micro Logger (small rows, no overflow pages)
+class LeafPageReader
+{
+public:
+    static constexpr uint8_t LeafPageType = 13;
+
+    // headerOffset is 100 for the first page of the file, false if this is not a leaf page
+    bool begin(const uint8_t *pageData, size_t pageSize, size_t headerOffset = 0)
+    {
+        page = pageData;
+        end = pageData + pageSize;
+        cellCount = 0;
+        if (pageSize < headerOffset + 8 || page[headerOffset] != LeafPageType)
+            return false;
+        cellCount = (page[headerOffset + 3] << 8) | page[headerOffset + 4];
+        cellPointers = page + headerOffset + 8;
+        if (cellPointers + 2 * cellCount > end)
+            cellCount = 0;
+        return cellCount || !(page[headerOffset + 3] | page[headerOffset + 4]);
+    }
+
+    uint16_t rowCount() const
+    {
+        return cellCount;
+    }
+
+    // the first columnCount columns of a row as numbers, false if one of them is not a number
+    bool readRow(uint16_t index, double *values, int columnCount) const
+    {
+        if (index >= cellCount)
+            return false;
+        const uint8_t *cell = page + ((cellPointers[2 * index] << 8) | cellPointers[2 * index + 1]);
+        uint64_t payloadLength, rowId, headerLength, serialType;
+        size_t length;
+        if (cell >= end || !(length = readDbVarint(cell, end, payloadLength)))
+            return false;
+        cell += length;
+        if (!(length = readDbVarint(cell, end, rowId)))
+            return false;
+        const uint8_t *payload = cell + length;
+        if (!(length = readDbVarint(payload, end, headerLength)) || payload + headerLength > end)
+            return false;
+
+        const uint8_t *header = payload + length;
+        const uint8_t *value = payload + headerLength;
+        for (int i = 0; i < columnCount; i++)
+        {
+            if (header >= payload + headerLength || !(length = readDbVarint(header, payload + headerLength, serialType)))
+                return false;
+            header += length;
+            if (value + dbSerialTypeLength(serialType) > end || !readDbNumber(value, serialType, values[i]))
+                return false;
+            value += dbSerialTypeLength(serialType);
+        }
+        return true;
+    }
+
+private:
+    const uint8_t *page;
+    const uint8_t *end;
+    const uint8_t *cellPointers;
+    uint16_t cellCount;
+};
+
+// zone of a data page (timestamp followed by the channels), false if it is not a leaf page or has no rows
+inline bool computePageZone(const uint8_t *page, size_t pageSize, PageZone &zone)
+{
+    LeafPageReader reader;
+    memset(&zone, 0, sizeof(zone));
+    if (!reader.begin(page, pageSize))
+        return false;
+
+    double values[1 + LiveSample::ChannelCount];
+    for (uint16_t row = 0; row < reader.rowCount(); row++)
+    {
+        if (!reader.readRow(row, values, 1 + LiveSample::ChannelCount))
+            continue;
+        int32_t timestamp = values[0];
+        if (!zone.rowCount || timestamp < zone.firstTimestamp)
+            zone.firstTimestamp = timestamp;
+        if (!zone.rowCount || timestamp > zone.lastTimestamp)
+            zone.lastTimestamp = timestamp;
+        for (int i = 0; i < LiveSample::ChannelCount; i++)
+        {
+            float value = values[1 + i];
+            if (!zone.rowCount || value < zone.min[i])
+                zone.min[i] = value;
+            if (!zone.rowCount || value > zone.max[i])
+                zone.max[i] = value;
+        }
+        zone.rowCount++;
+    }
+    return zone.rowCount;
+}
+
+// "<channel><op><value>" with op one of > >= < <=, e.g. current>2000
+struct ZonePredicate
+{
+    int channel;
+    bool greater;
+    bool orEqual;
+    float value;
+
+    bool matches(float sample) const
+    {
+        return greater ? (sample > value || (orEqual && sample == value)) : (sample < value || (orEqual && sample == value));
+    }
+
+    // false only if no row of the page can match
+    bool mayMatch(const PageZone &zone) const
+    {
+        return !zone.rowCount || matches(greater ? zone.max[channel] : zone.min[channel]);
+    }
+
+    bool parse(const char *text, const char *const *channelNames, int channelCount)
+    {
+        size_t nameLength = strcspn(text, "<>");
+        for (channel = 0; channel < channelCount; channel++)
+            if (strlen(channelNames[channel]) == nameLength && !strncmp(text, channelNames[channel], nameLength))
+                break;
+        if (channel == channelCount || !text[nameLength])
+            return false;
+
+        const char *op = text + nameLength;
+        greater = *op == '>';
+        orEqual = op[1] == '=';
+        const char *number = op + 1 + orEqual;
+        char *numberEnd;
+        value = strtof(number, &numberEnd);
+        return numberEnd != number && !*numberEnd;
+    }
+};
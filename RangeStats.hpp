@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "LiveCache.hpp"
+
+struct ChannelStats
+{
+    uint32_t count;
+    float min;
+    float max;
+    double mean;
+    double m2; // sum of squared differences from the mean (Welford)
+    int32_t firstTimestamp;
+    float first;
+    int32_t lastTimestamp;
+    float last;
+    double integral; // value * seconds, trapezoidal
+
+    double stddev() const
+    {
+        return count > 1 ? std::sqrt(m2 / (count - 1)) : 0;
+    }
+};
+
+/*
+Summary statistics of a time range in one pass: count, min / max, mean and standard deviation (Welford) as well as
+the time weighted integral per channel. Besides the sampled channels (current in mA, voltage in mV) there is the
+power in mW derived from them, so the integrals give mAh and mWh. Intervals longer than maxGapSeconds (logging was
+stopped) do not count towards the integral.
+*/
+class RangeStats
+{
+public:
+    static constexpr int ChannelCount = LiveSample::ChannelCount + 1;
+    static constexpr int PowerChannel = LiveSample::ChannelCount;
+
+    explicit RangeStats(uint32_t maxGapSeconds = 10)
+        : maxGapSeconds(maxGapSeconds)
+    {
+    }
+
+    void add(const LiveSample &sample)
+    {
+        float values[ChannelCount];
+        for (int i = 0; i < LiveSample::ChannelCount; i++)
+            values[i] = sample.values[i];
+        values[PowerChannel] = sample.values[0] * sample.values[1] / 1000;
+
+        int32_t elapsed = channels[0].count ? sample.timestamp - channels[0].lastTimestamp : 0;
+        bool connected = channels[0].count && elapsed >= 0 && (uint32_t)elapsed <= maxGapSeconds;
+        if (connected)
+            coveredSeconds += elapsed;
+
+        for (int i = 0; i < ChannelCount; i++)
+        {
+            ChannelStats &channel = channels[i];
+            float value = values[i];
+            if (!channel.count)
+            {
+                channel.min = channel.max = channel.first = value;
+                channel.firstTimestamp = sample.timestamp;
+            }
+            else
+            {
+                if (value < channel.min)
+                    channel.min = value;
+                if (value > channel.max)
+                    channel.max = value;
+                if (connected)
+                    channel.integral += (channel.last + value) / 2.0 * elapsed;
+            }
+            channel.count++;
+            double delta = value - channel.mean;
+            channel.mean += delta / channel.count;
+            channel.m2 += delta * (value - channel.mean);
+            channel.last = value;
+            channel.lastTimestamp = sample.timestamp;
+        }
+    }
+
+    const ChannelStats &channel(int index) const
+    {
+        return channels[index];
+    }
+
+    uint32_t count() const
+    {
+        return channels[0].count;
+    }
+
+    // seconds between samples that counted towards the integrals
+    uint32_t getCoveredSeconds() const
+    {
+        return coveredSeconds;
+    }
+
+private:
+    uint32_t maxGapSeconds;
+    uint32_t coveredSeconds = 0;
+    ChannelStats channels[ChannelCount] = {};
+};
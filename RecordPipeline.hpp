@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+#include "DbColumns.hpp"
+#include "RecordRing.hpp"
+
+/*
+The parts of the record pipeline in DataLogger.cpp that the host replay (tools/replay) runs as well, so that it
+measures the firmware's code and not a copy of it:
+
+* the producer side of the overflow policies (enqueueRecord)
+* when the producer wakes up the flushing task (FlushWakeup)
+* draining the ring into the database (drainRecords)
+* reading the rows of time ranges from a database cursor (nextRangeRow)
+
+Must not depend on Arduino. ulog_sqlite.h has to be included before.
+*/
+
+enum class OverflowPolicy : uint8_t
+{
+    DropNewest,
+    DropOldest,
+    Decimate,    // keep only every n-th record the fuller the queue gets
+    SpillToFlash // append to an overflow file that is merged with the next flush
+};
+
+enum class EnqueueResult : uint8_t
+{
+    Queued,
+    QueuedDroppingOldest, // queued, but the oldest record was dropped for it
+    Dropped,
+    Decimated,
+    Spill // the ring is full or spilling has started, the record has to go to the spill file
+};
+
+// requested time range of /data, until is 0 for open ended ranges
+struct DataRange
+{
+    time_t from;
+    time_t until;
+};
+
+// producer side: pushes a record to the ring according to the overflow policy, the spill file is up to the caller
+template <typename T>
+EnqueueResult enqueueRecord(RecordRing<T> &ring, OverflowPolicy policy, bool spilling, uint32_t &decimateCounter, const T &record)
+{
+    // once spilling, all records go to the spill file until it has been merged to keep them in order, even if the
+    // policy has been changed since
+    if (spilling)
+        return EnqueueResult::Spill;
+
+    switch (policy)
+    {
+    case OverflowPolicy::DropNewest:
+        break;
+
+    case OverflowPolicy::DropOldest:
+        return ring.pushDroppingOldest(record) ? EnqueueResult::Queued : EnqueueResult::QueuedDroppingOldest;
+
+    case OverflowPolicy::Decimate:
+    {
+        // keep only every 2nd, 4th or 8th record the fuller the ring gets
+        size_t fillEighths = ring.size() * 8 / ring.capacity();
+        uint32_t keepEvery = fillEighths >= 7 ? 8 : fillEighths >= 6 ? 4 : fillEighths >= 4 ? 2 : 1;
+        if (decimateCounter++ % keepEvery)
+            return EnqueueResult::Decimated;
+        break;
+    }
+
+    case OverflowPolicy::SpillToFlash:
+        if (!ring.tryPush(record))
+            return EnqueueResult::Spill;
+        return EnqueueResult::Queued;
+    }
+
+    return ring.tryPush(record) ? EnqueueResult::Queued : EnqueueResult::Dropped;
+}
+
+/*
+Producer side: wakes up the flushing task once each time the queue reaches the page full or the high water threshold
+(see FlushScheduler) instead of waiting for its next periodic check. Compares with >= as the queue can go past a
+threshold without the producer ever seeing the exact count, e.g. when records are dropped or the consumer drains
+concurrently. A threshold is armed again once the queue is below it.
+*/
+class FlushWakeup
+{
+public:
+    bool update(size_t pending, size_t pageFullThreshold, size_t highWaterThreshold)
+    {
+        bool pageFull = reached(pending, pageFullThreshold, pageFullArmed);
+        bool highWater = reached(pending, highWaterThreshold, highWaterArmed);
+        return pageFull || highWater;
+    }
+
+private:
+    static bool reached(size_t pending, size_t threshold, bool &armed)
+    {
+        if (pending < threshold)
+        {
+            armed = true;
+            return false;
+        }
+        bool wake = armed;
+        armed = false;
+        return wake;
+    }
+
+    bool pageFullArmed = true;
+    bool highWaterArmed = true;
+};
+
+struct DrainResult
+{
+    size_t appended;
+    size_t dropped;   // the failing record and, when copying out, the rest of its batch
+    int error;        // of the append that failed, 0 if all were appended
+    bool overwritten; // the producer dropped records while they were being appended
+};
+
+/*
+Consumer side: drains the ring into append(const T &record), which returns 0 or an error, until the ring is empty or
+an append fails. Records are appended in contiguous spans straight from the ring, or copied out in batches first if
+the producer might overwrite them while they are appended (drop oldest). The failing record is dropped, retrying it
+would most probably just fail again.
+*/
+template <typename T, typename Append>
+DrainResult drainRecords(RecordRing<T> &ring, bool copyOut, Append append)
+{
+    const constexpr size_t batchSize = 32;
+    DrainResult result = {0, 0, 0, false};
+    const T *records;
+    T batch[batchSize];
+
+    while (size_t count = copyOut ? ring.pop(batch, batchSize) : ring.peek(records))
+    {
+        if (copyOut)
+            records = batch;
+        for (size_t i = 0; i < count; i++)
+        {
+            result.error = append(records[i]);
+            if (result.error)
+            {
+                if (!copyOut)
+                    ring.consume(i + 1);
+                result.appended += i;
+                result.dropped = copyOut ? count - i : 1;
+                return result;
+            }
+        }
+        if (!copyOut && !ring.consume(count))
+            result.overwritten = true;
+        result.appended += count;
+    }
+    return result;
+}
+
+/*
+Moves the cursor to the next row within the ranges, the cursor starts on the row dblog_bin_srch_row_by_val() found for
+the first one. timestamp is set to the timestamp of every row read, including the one after the last range. Returns
+false at the end of the ranges or the database, or on errors. rowPending is set while the row that was read has not
+been used by the caller, it is not read again then.
+*/
+inline bool nextRangeRow(struct dblog_read_context *ctx, const DataRange *ranges, size_t rangeCount, size_t &rangeIndex, bool &rowPending,
+                         double &timestamp)
+{
+    while (rangeIndex < rangeCount)
+    {
+        const DataRange &range = ranges[rangeIndex];
+        if (!rowPending && dblog_read_next_row(ctx))
+            return false;
+        rowPending = true;
+
+        uint32_t col_type;
+        const uint8_t *col_val = (const uint8_t *)dblog_read_col_val(ctx, 0, &col_type);
+        if (!col_val || !readDbNumber(col_val, col_type, timestamp))
+            return false;
+        if (timestamp < range.from)
+        {
+            // the binary search ends up on the row before the range if there is no exact match
+            rowPending = false;
+            continue;
+        }
+        if (!range.until || timestamp <= range.until)
+            return true;
+
+        // continue with the next range, timestamps are stored as 32 bit integers
+        if (++rangeIndex < rangeCount)
+        {
+            int32_t from = ranges[rangeIndex].from;
+            if (dblog_bin_srch_row_by_val(ctx, 0, DBLOG_TYPE_INT, &from, sizeof(from), 0))
+                return false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+
+/*
+Single producer / single consumer lock-free ring buffer.
+
+* The producer only ever writes head, the consumer only ever writes tail, so no locks or critical sections
+  are needed as long as there is exactly one task on each side.
+* The consumer drains the ring in contiguous spans (peek + consume) directly from the storage, which
+  avoids copying every item out one by one.
+* For a drop-oldest overflow policy the producer may also advance tail (only ever by one item and only
+  when the ring is full), so tail is updated with compare-and-swap. A consumer that must never see an
+  item being overwritten uses pop(), which copies the items out and only then commits.
+* Capacity is rounded up to a power of two so indices can run freely and wrap around.
+*/
+template <typename T>
+class RecordRing
+{
+    static_assert(std::is_trivially_copyable<T>::value, "RecordRing items are copied as raw memory");
+
+public:
+    using allocate_fn = void *(*)(size_t size);
+
+    ~RecordRing()
+    {
+        free(buffer);
+    }
+
+    bool begin(size_t minCapacity, allocate_fn allocate = malloc)
+    {
+        size_t capacity = 1;
+        while (capacity < minCapacity)
+            capacity <<= 1;
+
+        buffer = (T *)allocate(capacity * sizeof(T));
+        mask = buffer ? capacity - 1 : 0;
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        return buffer != nullptr;
+    }
+
+    size_t capacity() const
+    {
+        return buffer ? mask + 1 : 0;
+    }
+
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    // producer side
+    bool tryPush(const T &item)
+    {
+        size_t currentHead = head.load(std::memory_order_relaxed);
+        if (!buffer || currentHead - tail.load(std::memory_order_acquire) > mask)
+            return false;
+
+        buffer[currentHead & mask] = item;
+        head.store(currentHead + 1, std::memory_order_release);
+        return true;
+    }
+
+    // producer side: makes room by dropping the oldest item if full, returns false if that happened
+    bool pushDroppingOldest(const T &item)
+    {
+        if (!buffer)
+            return false;
+
+        size_t currentHead = head.load(std::memory_order_relaxed);
+        size_t currentTail = tail.load(std::memory_order_acquire);
+        bool droppedOldest = false;
+        // fails if the consumer released items in the meantime, then there is room anyway
+        if (currentHead - currentTail > mask)
+            droppedOldest = tail.compare_exchange_strong(currentTail, currentTail + 1, std::memory_order_acq_rel);
+
+        buffer[currentHead & mask] = item;
+        head.store(currentHead + 1, std::memory_order_release);
+        return !droppedOldest;
+    }
+
+    // consumer side: returns the number of items available contiguously starting at items
+    size_t peek(const T *&items)
+    {
+        peekedTail = tail.load(std::memory_order_acquire);
+        size_t available = head.load(std::memory_order_acquire) - peekedTail;
+        size_t tailIndex = peekedTail & mask;
+        items = &buffer[tailIndex];
+        return available < mask + 1 - tailIndex ? available : mask + 1 - tailIndex;
+    }
+
+    // consumer side: releases count items returned by peek, returns false if the producer dropped
+    // (and possibly overwrote) some of them in the meantime
+    bool consume(size_t count)
+    {
+        size_t expectedTail = peekedTail;
+        size_t newTail = peekedTail + count;
+        if (tail.compare_exchange_strong(expectedTail, newTail, std::memory_order_acq_rel))
+            return true;
+
+        // do not move tail backwards if the producer dropped more than was consumed
+        while ((std::ptrdiff_t)(newTail - expectedTail) > 0 && !tail.compare_exchange_weak(expectedTail, newTail, std::memory_order_acq_rel))
+            ;
+        return false;
+    }
+
+    // consumer side: copies up to maxCount items out of the ring, safe against pushDroppingOldest()
+    size_t pop(T *items, size_t maxCount)
+    {
+        size_t currentTail = tail.load(std::memory_order_acquire);
+        while (true)
+        {
+            size_t available = head.load(std::memory_order_acquire) - currentTail;
+            size_t count = available < maxCount ? available : maxCount;
+            for (size_t i = 0; i < count; i++)
+                items[i] = buffer[(currentTail + i) & mask];
+
+            // if the producer dropped items while copying, the copies might be torn, so start over
+            if (tail.compare_exchange_weak(currentTail, currentTail + count, std::memory_order_acq_rel))
+                return count;
+        }
+    }
+
+    // consumer side: drops everything currently in the ring
+    void clear()
+    {
+        tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+private:
+    T *buffer = nullptr;
+    size_t mask = 0;
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    size_t peekedTail = 0;
+};
@@ -0,0 +1,313 @@
+#include "Main.h"
+
+#include <Preferences.h>
+#include <EEPROM.h>
+#include <algorithm>
+
+namespace
+{
+    const constexpr char *kLoggingTag = "Settings";
+
+    // stored with the settings, bump it when the meaning of a stored value changes and migrate in loadSettings()
+    const constexpr uint32_t settingsVersion = 1;
+    const constexpr char *preferencesNamespace = "settings";
+
+    const constexpr uint32_t inaConversionMicros[] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+    const constexpr uint32_t inaAveragingCounts[] = {1, 4, 16, 64, 128, 256, 512, 1024};
+    const constexpr char *overflowPolicyNames[] = {"dropNewest", "dropOldest", "decimate", "spillToFlash"};
+
+    struct SettingField
+    {
+        const char *name; // in the REST API and as NVS key (at most 15 characters)
+        uint32_t Settings::*member;
+        uint32_t min;
+        uint32_t max;
+        bool live; // applied right away, otherwise with the next restart
+        const uint32_t *allowedValues;
+        size_t allowedCount;
+        const char *const *valueNames; // values can also be given by name, and are returned as such
+    };
+
+    const SettingField settingFields[] = {
+        {"loggingEnabled", &Settings::loggingEnabled, 0, 1, true},
+        {"recordPeriodMs", &Settings::recordPeriodMillis, 1000, 3600 * 1000, true},
+        {"fastPeriodMs", &Settings::fastSamplePeriodMillis, 1, 100, false},
+        {"inaAveraging", &Settings::inaAveraging, 1, 1024, true, inaAveragingCounts, sizeof(inaAveragingCounts) / sizeof(uint32_t)},
+        {"inaConversionUs", &Settings::inaConversionMicros, 140, 8244, true, inaConversionMicros, sizeof(inaConversionMicros) / sizeof(uint32_t)},
+        {"flushEverySec", &Settings::flushEverySeconds, 1, 3600, true},
+        {"flushHighWater", &Settings::flushHighWaterPercent, 10, 100, true},
+        {"queueLength", &Settings::queueLength, 16, 16384, false},
+        {"overflowPolicy", &Settings::overflowPolicy, 0, 3, true, nullptr, 0, overflowPolicyNames},
+        {"compressMin", &Settings::compressMinBytes, 0, 1024 * 1024, true},
+        {"livePublishMs", &Settings::livePublishMillis, 100, 10000, true},
+    };
+
+    // the settings in NVS, and those the restart-only fields were set up with
+    Settings settings;
+    Settings bootSettings;
+    portMUX_TYPE settingsMux = portMUX_INITIALIZER_UNLOCKED;
+    std::atomic<uint32_t> settingsGeneration{0};
+}
+
+bool loadSettings(Settings &loaded);
+void migrateLoggingEnabled(Settings &loaded);
+bool parseSettingValue(const SettingField &field, const String &text, uint32_t &value, String &error);
+bool checkSettingValue(const SettingField &field, uint32_t value, String &error);
+bool validateSettings(const Settings &candidate, String &error);
+void configGetHandler(AsyncWebServerRequest *request);
+void configPostHandler(AsyncWebServerRequest *request);
+
+// loads the settings (defaults for anything not stored yet), everything else reads them with getSettings()
+void setupSettings()
+{
+    ESP_LOGD(kLoggingTag, "Entering setupSettings()");
+
+    Settings loaded;
+    String error;
+    if (!loadSettings(loaded) || !validateSettings(loaded, error))
+    {
+        ESP_LOGW(kLoggingTag, "Stored settings not usable (%s), using defaults", error.c_str());
+        loaded = Settings();
+    }
+    migrateLoggingEnabled(loaded);
+    portENTER_CRITICAL(&settingsMux);
+    settings = bootSettings = loaded;
+    portEXIT_CRITICAL(&settingsMux);
+    // the sampling task is started with the defaults before, it applies the loaded INA settings like saved ones (the
+    // fast sample period is set by setup() itself)
+    settingsGeneration.fetch_add(1, std::memory_order_release);
+
+    asyncWebServer.on("/config", HTTP_GET, configGetHandler);
+    asyncWebServer.on("/config", HTTP_POST, configPostHandler);
+}
+
+Settings getSettings()
+{
+    portENTER_CRITICAL(&settingsMux);
+    Settings current = settings;
+    portEXIT_CRITICAL(&settingsMux);
+    return current;
+}
+
+// changes with every save, so that tasks only copy the settings when there is something new
+uint32_t getSettingsGeneration()
+{
+    return settingsGeneration.load(std::memory_order_acquire);
+}
+
+// stores the settings and applies the live ones, the caller has to validate them
+bool saveSettings(const Settings &newSettings)
+{
+    Preferences preferences;
+    if (!preferences.begin(preferencesNamespace, false))
+    {
+        ESP_LOGE(kLoggingTag, "Error opening NVS namespace '%s'", preferencesNamespace);
+        return false;
+    }
+    bool result = true;
+    for (const auto &field : settingFields)
+        result &= preferences.putUInt(field.name, newSettings.*field.member) == sizeof(uint32_t);
+    result &= preferences.putUInt("version", settingsVersion) == sizeof(uint32_t);
+    preferences.end();
+    if (!result)
+    {
+        ESP_LOGE(kLoggingTag, "Error writing settings to NVS");
+        return false;
+    }
+
+    portENTER_CRITICAL(&settingsMux);
+    settings = newSettings;
+    portEXIT_CRITICAL(&settingsMux);
+    applySettings(newSettings);
+    settingsGeneration.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+// the settings that the data logger takes live, the sampling tasks watch getSettingsGeneration() themselves
+void applySettings(const Settings &applied)
+{
+    FlushPolicy flushPolicy;
+    flushPolicy.maxAgeMillis = applied.flushEverySeconds * 1000;
+    flushPolicy.highWaterPercent = applied.flushHighWaterPercent;
+    setFlushPolicy(flushPolicy);
+    setOverflowPolicy((OverflowPolicy)applied.overflowPolicy);
+    setCompressionMinBytes(applied.compressMinBytes);
+    setLivePublishInterval(applied.livePublishMillis);
+}
+
+bool loadSettings(Settings &loaded)
+{
+    Preferences preferences;
+    // read only fails if nothing has been stored yet
+    if (!preferences.begin(preferencesNamespace, true))
+        return true;
+
+    uint32_t version = preferences.getUInt("version", settingsVersion);
+    if (version > settingsVersion)
+    {
+        ESP_LOGW(kLoggingTag, "Settings were stored by a newer firmware (version %u)", version);
+        preferences.end();
+        return false;
+    }
+    for (const auto &field : settingFields)
+        loaded.*field.member = preferences.getUInt(field.name, loaded.*field.member);
+    preferences.end();
+
+    ESP_LOGI(kLoggingTag, "Loaded settings version %u", version);
+    return true;
+}
+
+// the logging flag used to be the first byte of the EEPROM emulation, it is taken over once while NVS does not have it
+void migrateLoggingEnabled(Settings &loaded)
+{
+    const constexpr uint32_t notStored = UINT32_MAX;
+    Preferences preferences;
+    if (preferences.begin(preferencesNamespace, true))
+    {
+        uint32_t stored = preferences.getUInt("loggingEnabled", notStored);
+        preferences.end();
+        if (stored != notStored)
+            return;
+    }
+
+    EEPROM.begin(16);
+    loaded.loggingEnabled = EEPROM.read(0) ? 1 : 0;
+    EEPROM.end();
+
+    if (!preferences.begin(preferencesNamespace, false))
+    {
+        ESP_LOGE(kLoggingTag, "Error opening NVS namespace '%s'", preferencesNamespace);
+        return;
+    }
+    if (preferences.putUInt("loggingEnabled", loaded.loggingEnabled) != sizeof(uint32_t))
+        ESP_LOGE(kLoggingTag, "Error writing the migrated logging flag to NVS");
+    preferences.end();
+    ESP_LOGI(kLoggingTag, "Logging flag %u taken over from EEPROM", loaded.loggingEnabled);
+}
+
+bool parseSettingValue(const SettingField &field, const String &text, uint32_t &value, String &error)
+{
+    for (size_t i = 0; field.valueNames && i <= field.max; i++)
+    {
+        if (text == field.valueNames[i])
+        {
+            value = i;
+            return true;
+        }
+    }
+
+    char *end;
+    value = strtoul(text.c_str(), &end, 10);
+    if (!text.length() || *end)
+    {
+        error = String(field.name) + ": not a number";
+        return false;
+    }
+    return checkSettingValue(field, value, error);
+}
+
+bool checkSettingValue(const SettingField &field, uint32_t value, String &error)
+{
+    if (value < field.min || value > field.max)
+    {
+        error = String(field.name) + ": must be between " + field.min + " and " + field.max;
+        return false;
+    }
+    if (field.allowedValues && std::find(field.allowedValues, field.allowedValues + field.allowedCount, value) == field.allowedValues + field.allowedCount)
+    {
+        error = String(field.name) + ": must be one of";
+        for (size_t i = 0; i < field.allowedCount; i++)
+            error += String(i ? ", " : " ") + field.allowedValues[i];
+        return false;
+    }
+    return true;
+}
+
+// the limits of every field and how they depend on each other
+bool validateSettings(const Settings &candidate, String &error)
+{
+    for (const auto &field : settingFields)
+    {
+        if (!checkSettingValue(field, candidate.*field.member, error))
+            return false;
+    }
+
+    // bus and shunt are converted alternately in continuous mode, every fast sample should see a new result
+    uint32_t inaCycleMicros = 2 * candidate.inaConversionMicros * candidate.inaAveraging;
+    if (inaCycleMicros > candidate.fastSamplePeriodMillis * 1000)
+    {
+        error = String("inaConversionUs * inaAveraging * 2 (") + inaCycleMicros + " us) must not exceed fastPeriodMs";
+        return false;
+    }
+    return true;
+}
+
+// {"version":1,"settings":{"loggingEnabled":1,...,"overflowPolicy":"spillToFlash"},"live":[...],"restartRequired":[...]}
+void configGetHandler(AsyncWebServerRequest *request)
+{
+    Settings current = getSettings();
+
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->printf("{\"version\":%u,\"settings\":{", settingsVersion);
+    for (size_t i = 0; i < sizeof(settingFields) / sizeof(SettingField); i++)
+    {
+        const SettingField &field = settingFields[i];
+        if (field.valueNames)
+            response->printf("%s\"%s\":\"%s\"", i ? "," : "", field.name, field.valueNames[current.*field.member]);
+        else
+            response->printf("%s\"%s\":%u", i ? "," : "", field.name, current.*field.member);
+    }
+    response->print("},\"live\":[");
+    bool first = true;
+    for (const auto &field : settingFields)
+    {
+        if (!field.live)
+            continue;
+        response->printf("%s\"%s\"", first ? "" : ",", field.name);
+        first = false;
+    }
+    // changed restart-only settings
+    response->print("],\"restartRequired\":[");
+    first = true;
+    for (const auto &field : settingFields)
+    {
+        if (field.live || current.*field.member == bootSettings.*field.member)
+            continue;
+        response->printf("%s\"%s\"", first ? "" : ",", field.name);
+        first = false;
+    }
+    response->print("]}");
+    request->send(response);
+}
+
+// form parameters with the names from GET /config, all of them are validated before anything is stored,
+// defaults=1 starts from the defaults instead of the current settings
+void configPostHandler(AsyncWebServerRequest *request)
+{
+    Settings candidate = request->hasParam("defaults", true) ? Settings() : getSettings();
+    String error;
+
+    for (const auto &field : settingFields)
+    {
+        auto param = request->getParam(field.name, true);
+        if (param && !parseSettingValue(field, param->value(), candidate.*field.member, error))
+        {
+            request->send(400, "text/plain", error);
+            return;
+        }
+    }
+    if (!validateSettings(candidate, error))
+    {
+        request->send(400, "text/plain", error);
+        return;
+    }
+
+    if (!saveSettings(candidate))
+    {
+        request->send(500);
+        return;
+    }
+    ESP_LOGI(kLoggingTag, "Settings saved");
+
+    configGetHandler(request);
+}
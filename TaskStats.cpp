@@ -0,0 +1,244 @@
+#include "Main.h"
+
+namespace
+{
+    const constexpr char *kLoggingTag = "TaskStats";
+
+#if defined(CONFIG_FREERTOS_USE_TRACE_FACILITY) && defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+    const constexpr int maxTrackedTasks = 16;
+    const constexpr int maxSampledTasks = 24;
+    const constexpr uint16_t notRunning = 0xffff;
+
+    struct TrackedTask
+    {
+        TaskHandle_t handle;
+        char name[configMAX_TASK_NAME_LEN];
+        int32_t core;
+        uint32_t priority;
+        uint32_t lastRunTime;
+    };
+
+    struct TaskStatsSample
+    {
+        int32_t timestamp;
+        uint16_t coreLoadPermille[portNUM_PROCESSORS];
+        uint16_t cpuPermille[maxTrackedTasks]; // of one core, notRunning if the task did not exist (yet)
+        uint16_t stackHighWater[maxTrackedTasks];
+    };
+
+    // everything is allocated up front, sampling only copies counters
+    TaskStatus_t taskStatus[maxSampledTasks];
+    TrackedTask trackedTasks[maxTrackedTasks];
+    int trackedTaskCount;
+    uint32_t lastTotalRunTime;
+    uint32_t samplePeriodSeconds;
+    TimeRing<TaskStatsSample> history;
+    // guards the history and the tracked tasks
+    SemaphoreHandle_t historyMutex;
+#endif
+}
+
+void taskStatsResponseHandler(AsyncWebServerRequest *request);
+#if defined(CONFIG_FREERTOS_USE_TRACE_FACILITY) && defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+void taskStatsTask(void *taskParameter);
+void sampleTaskStats();
+int trackTask(const TaskStatus_t &status);
+void untrackDeletedTasks(const bool *seen);
+#endif
+
+void setupTaskStats(uint32_t periodSeconds, size_t historyLength)
+{
+    ESP_LOGD(kLoggingTag, "Entering setupTaskStats()");
+
+#if defined(CONFIG_FREERTOS_USE_TRACE_FACILITY) && defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+    historyMutex = xSemaphoreCreateMutex();
+#endif
+    asyncWebServer.on("/tasks", HTTP_GET, taskStatsResponseHandler);
+
+#if defined(CONFIG_FREERTOS_USE_TRACE_FACILITY) && defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+    samplePeriodSeconds = periodSeconds;
+    if (!history.begin(historyLength, malloc))
+    {
+        ESP_LOGE(kLoggingTag, "Error allocating task statistics history");
+        return;
+    }
+
+    auto createTaskResult = xTaskCreate(taskStatsTask, "taskStats", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr);
+    if (createTaskResult != pdPASS)
+        ESP_LOGE(kLoggingTag, "Error %d creating task", createTaskResult);
+#else
+    ESP_LOGW(kLoggingTag, "Task statistics need CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS");
+#endif
+}
+
+#if defined(CONFIG_FREERTOS_USE_TRACE_FACILITY) && defined(CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+
+void taskStatsTask(void *taskParameter)
+{
+    ESP_LOGD(kLoggingTag, "Entering taskStatsTask()");
+
+    TickType_t lastWakeTime = xTaskGetTickCount();
+    for (;;)
+    {
+        sampleTaskStats();
+        vTaskDelayUntil(&lastWakeTime, pdMS_TO_TICKS(samplePeriodSeconds * 1000));
+    }
+}
+
+// run time deltas since the previous call as share of one core, the idle tasks give the load per core
+void sampleTaskStats()
+{
+    uint32_t totalRunTime;
+    int taskCount = uxTaskGetSystemState(taskStatus, maxSampledTasks, &totalRunTime);
+    if (!taskCount)
+    {
+        ESP_LOGW(kLoggingTag, "More than %d tasks, not sampled", maxSampledTasks);
+        return;
+    }
+    uint32_t elapsed = totalRunTime - lastTotalRunTime;
+    bool firstSample = !lastTotalRunTime;
+    lastTotalRunTime = totalRunTime;
+
+    TaskStatsSample sample;
+    sample.timestamp = time(nullptr);
+    for (int i = 0; i < maxTrackedTasks; i++)
+        sample.cpuPermille[i] = sample.stackHighWater[i] = notRunning;
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+        sample.coreLoadPermille[core] = 0;
+
+    // the response handler reads the tracked tasks as well
+    if (xSemaphoreTake(historyMutex, pdMS_TO_TICKS(100)) != pdTRUE)
+        return;
+
+    bool seen[maxTrackedTasks] = {};
+    for (int i = 0; i < taskCount; i++)
+    {
+        const TaskStatus_t &status = taskStatus[i];
+        int index = trackTask(status);
+        if (index < 0)
+            continue;
+        seen[index] = true;
+        TrackedTask &task = trackedTasks[index];
+        uint32_t runTime = status.ulRunTimeCounter - task.lastRunTime;
+        bool newTask = !task.lastRunTime;
+        task.lastRunTime = status.ulRunTimeCounter;
+        sample.stackHighWater[index] = status.usStackHighWaterMark;
+        if (firstSample || newTask || !elapsed)
+            continue;
+
+        uint16_t permille = std::min<uint64_t>(1000, (uint64_t)runTime * 1000 / elapsed);
+        sample.cpuPermille[index] = permille;
+        if (!strncmp(status.pcTaskName, "IDLE", 4) && status.xCoreID < portNUM_PROCESSORS)
+            sample.coreLoadPermille[status.xCoreID] = 1000 - permille;
+    }
+    untrackDeletedTasks(seen);
+
+    if (!firstSample)
+        history.push(sample);
+    xSemaphoreGive(historyMutex);
+}
+
+// index of the task in trackedTasks, adding it if it is new, -1 if there is no room left
+int trackTask(const TaskStatus_t &status)
+{
+    // handles of deleted tasks are reused by FreeRTOS, so compare the names as well
+    int index = -1;
+    for (int i = 0; i < trackedTaskCount; i++)
+    {
+        if (trackedTasks[i].handle == status.xHandle && !strncmp(trackedTasks[i].name, status.pcTaskName, sizeof(trackedTasks[i].name)))
+            return i;
+        if (!trackedTasks[i].handle && index < 0)
+            index = i;
+    }
+    if (index < 0 && trackedTaskCount == maxTrackedTasks)
+        return -1;
+
+    if (index < 0)
+        index = trackedTaskCount++;
+    else
+    {
+        // the slot of a deleted task, its samples in the history must not be shown for the new one
+        ESP_LOGI(kLoggingTag, "Task '%s' takes the slot of deleted task '%s'", status.pcTaskName, trackedTasks[index].name);
+        for (uint32_t seq = history.beginSeq(); seq != history.endSeq(); seq++)
+            history.at(seq).cpuPermille[index] = history.at(seq).stackHighWater[index] = notRunning;
+    }
+
+    TrackedTask &task = trackedTasks[index];
+    task.handle = status.xHandle;
+    strlcpy(task.name, status.pcTaskName, sizeof(task.name));
+    task.core = status.xCoreID < portNUM_PROCESSORS ? (int32_t)status.xCoreID : -1;
+    task.priority = status.uxCurrentPriority;
+    task.lastRunTime = 0;
+    return index;
+}
+
+// frees the slots of tasks that have been deleted, they keep their name for the history until taken by a new task
+void untrackDeletedTasks(const bool *seen)
+{
+    for (int i = 0; i < trackedTaskCount; i++)
+    {
+        if (seen[i] || !trackedTasks[i].handle)
+            continue;
+        ESP_LOGI(kLoggingTag, "Task '%s' has been deleted", trackedTasks[i].name);
+        trackedTasks[i].handle = nullptr;
+    }
+}
+
+// {"periodSeconds":5,"cores":2,"tasks":[{"name":"loopTask","core":1,"priority":1},...],
+//  "samples":[[timestamp,[load per core in %],[cpu per task in % of one core],[stack high water per task in bytes]],...]}
+void taskStatsResponseHandler(AsyncWebServerRequest *request)
+{
+    time_t since = 0;
+    if (auto param = request->getParam("since"))
+        since = param->value().toInt();
+
+    if (xSemaphoreTake(historyMutex, pdMS_TO_TICKS(1000)) != pdTRUE)
+    {
+        request->send(503);
+        return;
+    }
+
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->printf("{\"periodSeconds\":%u,\"cores\":%d,\"tasks\":[", samplePeriodSeconds, portNUM_PROCESSORS);
+    for (int i = 0; i < trackedTaskCount; i++)
+        response->printf("%s{\"name\":\"%s\",\"core\":%d,\"priority\":%u}", i ? "," : "", trackedTasks[i].name, trackedTasks[i].core, trackedTasks[i].priority);
+    response->print("],\"samples\":[");
+    uint32_t firstSeq = history.lowerBound(since + 1);
+    for (uint32_t seq = firstSeq; seq != history.endSeq(); seq++)
+    {
+        const TaskStatsSample &sample = history.at(seq);
+        response->printf("%s[%d,[", seq != firstSeq ? "," : "", sample.timestamp);
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+            response->printf("%s%.1f", core ? "," : "", sample.coreLoadPermille[core] / 10.0);
+        response->print("],[");
+        for (int i = 0; i < trackedTaskCount; i++)
+        {
+            if (sample.cpuPermille[i] == notRunning)
+                response->print(i ? ",null" : "null");
+            else
+                response->printf("%s%.1f", i ? "," : "", sample.cpuPermille[i] / 10.0);
+        }
+        response->print("],[");
+        for (int i = 0; i < trackedTaskCount; i++)
+        {
+            if (sample.stackHighWater[i] == notRunning)
+                response->print(i ? ",null" : "null");
+            else
+                response->printf("%s%u", i ? "," : "", sample.stackHighWater[i]);
+        }
+        response->print("]]");
+    }
+    response->print("]}");
+    xSemaphoreGive(historyMutex);
+
+    request->send(response);
+}
+
+#else
+
+void taskStatsResponseHandler(AsyncWebServerRequest *request)
+{
+    request->send(501);
+}
+
+#endif
@@ -0,0 +1,319 @@
+#include "Main.h"
+
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    const constexpr char *kLoggingTag = "Trigger";
+
+    const constexpr size_t captureRingSize = 1024;
+    const constexpr int maxCaptures = 8;
+    const constexpr char *captureFilePrefix = "/cap-";
+
+    enum class CaptureState : uint8_t
+    {
+        Disabled,
+        Armed,
+        PostTrigger,
+        Frozen // ring is not written to until the capture has been saved
+    };
+
+    // the capture state is only changed by the sampling task, everything else asks it to re-arm
+    enum class RearmRequest : uint8_t
+    {
+        None,
+        ConfigChanged, // waits until a capture in progress has been saved
+        CaptureSaved
+    };
+
+    int samplePeriodMillis;
+    CaptureSample *captureRing;
+    uint32_t ringSamplesWritten;
+    volatile CaptureState captureState = CaptureState::Disabled;
+    uint32_t triggerSampleNumber;
+    uint32_t postTriggerRemaining;
+    bool havePreviousValue;
+    float previousValue;
+    TaskHandle_t captureWriterTaskHandle;
+    std::atomic<RearmRequest> rearmRequest{RearmRequest::None};
+
+    portMUX_TYPE triggerConfigMux = portMUX_INITIALIZER_UNLOCKED;
+    TriggerConfig triggerConfig;
+}
+
+void captureWriterTask(void *taskParameter);
+void requestRearm(RearmRequest request);
+void rearmTrigger();
+bool isTriggered(const TriggerConfig &config, const CaptureSample &sample);
+std::vector<time_t> listCaptureIds();
+void removeOldCaptures();
+void triggerGetHandler(AsyncWebServerRequest *request);
+void triggerPostHandler(AsyncWebServerRequest *request);
+void capturesResponseHandler(AsyncWebServerRequest *request);
+
+void setupTriggerCapture(int samplePeriod)
+{
+    ESP_LOGD(kLoggingTag, "Entering setupTriggerCapture()");
+
+    samplePeriodMillis = samplePeriod;
+    captureRing = (CaptureSample *)malloc(captureRingSize * sizeof(CaptureSample));
+    if (!captureRing)
+    {
+        ESP_LOGE(kLoggingTag, "Error allocating capture ring buffer, triggered captures disabled");
+        return;
+    }
+
+    auto createTaskResult = xTaskCreate(captureWriterTask, "captureWriter", 8192, nullptr, uxTaskPriorityGet(nullptr), &captureWriterTaskHandle);
+    if (createTaskResult != pdPASS)
+    {
+        ESP_LOGE(kLoggingTag, "Error %d creating task", createTaskResult);
+        return;
+    }
+
+    requestRearm(RearmRequest::ConfigChanged);
+
+    asyncWebServer.on("/trigger", HTTP_GET, triggerGetHandler);
+    asyncWebServer.on("/trigger", HTTP_POST, triggerPostHandler);
+    asyncWebServer.on("/captures", HTTP_GET, capturesResponseHandler);
+}
+
+// called from the sampling task for every high rate sample, so keep it cheap
+void addCaptureSample(const CaptureSample &sample)
+{
+    auto request = rearmRequest.load();
+    if (request == RearmRequest::CaptureSaved || (request == RearmRequest::ConfigChanged && captureState != CaptureState::PostTrigger && captureState != CaptureState::Frozen))
+    {
+        rearmRequest = RearmRequest::None;
+        rearmTrigger();
+    }
+
+    auto state = captureState;
+    if (state == CaptureState::Disabled || state == CaptureState::Frozen)
+        return;
+
+    captureRing[ringSamplesWritten % captureRingSize] = sample;
+    ringSamplesWritten++;
+
+    if (state == CaptureState::Armed)
+    {
+        portENTER_CRITICAL(&triggerConfigMux);
+        TriggerConfig config = triggerConfig;
+        portEXIT_CRITICAL(&triggerConfigMux);
+
+        if (isTriggered(config, sample))
+        {
+            triggerSampleNumber = ringSamplesWritten - 1;
+            postTriggerRemaining = std::max<uint32_t>(1, config.postTriggerMillis / samplePeriodMillis);
+            captureState = CaptureState::PostTrigger;
+        }
+    }
+    else if (--postTriggerRemaining == 0)
+    {
+        captureState = CaptureState::Frozen;
+        xTaskNotifyGive(captureWriterTaskHandle);
+    }
+}
+
+bool isTriggered(const TriggerConfig &config, const CaptureSample &sample)
+{
+    float value = config.channel == TriggerChannel::Current ? sample.currentMilliAmps : sample.voltageMilliVolts;
+    bool triggered = false;
+
+    if (havePreviousValue)
+    {
+        switch (config.condition)
+        {
+        case TriggerCondition::Rising:
+            triggered = previousValue < config.threshold && value >= config.threshold;
+            break;
+        case TriggerCondition::Falling:
+            triggered = previousValue > config.threshold && value <= config.threshold;
+            break;
+        case TriggerCondition::Step:
+            triggered = fabsf(value - previousValue) >= config.threshold;
+            break;
+        }
+    }
+
+    previousValue = value;
+    havePreviousValue = true;
+    return triggered;
+}
+
+// handled by addCaptureSample() with the next sample
+void requestRearm(RearmRequest request)
+{
+    if (request == RearmRequest::CaptureSaved)
+        rearmRequest = request;
+    else
+    {
+        // a pending CaptureSaved must not be replaced, it re-arms with the new config anyway
+        RearmRequest expected = RearmRequest::None;
+        rearmRequest.compare_exchange_strong(expected, request);
+    }
+
+    portENTER_CRITICAL(&triggerConfigMux);
+    bool enabled = triggerConfig.enabled;
+    portEXIT_CRITICAL(&triggerConfigMux);
+    ESP_LOGI(kLoggingTag, "Trigger %s", enabled ? "armed" : "disabled");
+}
+
+// only called from the sampling task
+void rearmTrigger()
+{
+    portENTER_CRITICAL(&triggerConfigMux);
+    bool enabled = triggerConfig.enabled;
+    portEXIT_CRITICAL(&triggerConfigMux);
+
+    ringSamplesWritten = 0;
+    havePreviousValue = false;
+    captureState = enabled && captureRing ? CaptureState::Armed : CaptureState::Disabled;
+}
+
+void captureWriterTask(void *taskParameter)
+{
+    ESP_LOGD(kLoggingTag, "Entering captureWriterTask()");
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (captureState != CaptureState::Frozen)
+            continue;
+
+        portENTER_CRITICAL(&triggerConfigMux);
+        uint32_t preTriggerMillis = triggerConfig.preTriggerMillis;
+        portEXIT_CRITICAL(&triggerConfigMux);
+
+        // oldest sample still available in the ring, limited by the configured pre trigger time
+        uint32_t firstSample = ringSamplesWritten > captureRingSize ? ringSamplesWritten - captureRingSize : 0;
+        uint32_t preTriggerSamples = preTriggerMillis / samplePeriodMillis;
+        if (triggerSampleNumber - firstSample > preTriggerSamples)
+            firstSample = triggerSampleNumber - preTriggerSamples;
+        uint32_t endSample = ringSamplesWritten;
+
+        // map the monotonic sample clock to wall clock time
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        int64_t epochOffsetMicros = (int64_t)now.tv_sec * 1000000 + now.tv_usec - esp_timer_get_time();
+
+        time_t captureId = (captureRing[triggerSampleNumber % captureRingSize].timeMicros + epochOffsetMicros) / 1000000;
+        while (SPIFFS.exists(getCaptureFilename(captureId, false)))
+            captureId++;
+
+        ESP_LOGI(kLoggingTag, "Saving capture %ld with %u samples (%u before trigger)", captureId, endSample - firstSample, triggerSampleNumber - firstSample);
+        uint32_t sampleNumber = firstSample;
+        saveCapture(getCaptureFilename(captureId, true).c_str(), epochOffsetMicros, [&sampleNumber, endSample](CaptureSample &sample) {
+            if (sampleNumber == endSample)
+                return false;
+            sample = captureRing[sampleNumber++ % captureRingSize];
+            return true;
+        });
+
+        removeOldCaptures();
+        requestRearm(RearmRequest::CaptureSaved);
+    }
+
+    vTaskDelete(nullptr);
+}
+
+String getCaptureFilename(time_t captureId, bool withFs)
+{
+    return String(withFs ? "/spiffs" : "") + captureFilePrefix + String(captureId) + ".db";
+}
+
+std::vector<time_t> listCaptureIds()
+{
+    std::vector<time_t> captureIds;
+
+    File root = SPIFFS.open("/");
+    for (File file = root.openNextFile(); file; file = root.openNextFile())
+    {
+        // depending on the core version the name might or might not include the leading slash
+        String name = file.name();
+        int prefixPos = name.indexOf(&captureFilePrefix[1]);
+        if (prefixPos >= 0 && name.endsWith(".db"))
+            captureIds.push_back(name.substring(prefixPos + strlen(captureFilePrefix) - 1).toInt());
+    }
+
+    std::sort(captureIds.begin(), captureIds.end());
+    return captureIds;
+}
+
+void removeOldCaptures()
+{
+    auto captureIds = listCaptureIds();
+    for (int i = 0; i < (int)captureIds.size() - maxCaptures; i++)
+    {
+        ESP_LOGI(kLoggingTag, "Removing old capture %ld", captureIds[i]);
+        SPIFFS.remove(getCaptureFilename(captureIds[i], false));
+    }
+}
+
+void triggerGetHandler(AsyncWebServerRequest *request)
+{
+    static const char *channelNames[] = {"current", "voltage"};
+    static const char *conditionNames[] = {"rising", "falling", "step"};
+    static const char *stateNames[] = {"disabled", "armed", "postTrigger", "frozen"};
+
+    portENTER_CRITICAL(&triggerConfigMux);
+    TriggerConfig config = triggerConfig;
+    portEXIT_CRITICAL(&triggerConfigMux);
+
+    StreamString json;
+    json.printf("{\"enabled\":%s,\"channel\":\"%s\",\"condition\":\"%s\",\"threshold\":%f,\"preMillis\":%u,\"postMillis\":%u,\"state\":\"%s\"}",
+                config.enabled ? "true" : "false", channelNames[(int)config.channel], conditionNames[(int)config.condition], config.threshold,
+                config.preTriggerMillis, config.postTriggerMillis, stateNames[(int)captureState]);
+    request->send(200, "application/json", json);
+}
+
+void triggerPostHandler(AsyncWebServerRequest *request)
+{
+    portENTER_CRITICAL(&triggerConfigMux);
+    TriggerConfig config = triggerConfig;
+    portEXIT_CRITICAL(&triggerConfigMux);
+
+    if (auto param = request->getParam("enabled", true))
+        config.enabled = param->value() == "1" || param->value() == "true";
+    if (auto param = request->getParam("channel", true))
+        config.channel = param->value() == "voltage" ? TriggerChannel::Voltage : TriggerChannel::Current;
+    if (auto param = request->getParam("condition", true))
+        config.condition = param->value() == "rising" ? TriggerCondition::Rising : param->value() == "falling" ? TriggerCondition::Falling : TriggerCondition::Step;
+    if (auto param = request->getParam("threshold", true))
+        config.threshold = param->value().toFloat();
+    if (auto param = request->getParam("preMillis", true))
+        config.preTriggerMillis = param->value().toInt();
+    if (auto param = request->getParam("postMillis", true))
+        config.postTriggerMillis = param->value().toInt();
+
+    // the pre and post trigger samples (plus the trigger sample itself) must fit into the ring
+    uint32_t ringMillis = (captureRingSize - 1) * samplePeriodMillis;
+    if (config.postTriggerMillis < (uint32_t)samplePeriodMillis || config.postTriggerMillis > ringMillis || config.preTriggerMillis > ringMillis - config.postTriggerMillis)
+    {
+        request->send(400, "text/plain", "preMillis + postMillis must not exceed " + String(ringMillis));
+        return;
+    }
+
+    portENTER_CRITICAL(&triggerConfigMux);
+    triggerConfig = config;
+    portEXIT_CRITICAL(&triggerConfigMux);
+
+    // a pending capture is saved first, the trigger is re-armed after that
+    requestRearm(RearmRequest::ConfigChanged);
+
+    triggerGetHandler(request);
+}
+
+void capturesResponseHandler(AsyncWebServerRequest *request)
+{
+    String json = "[";
+    for (auto captureId : listCaptureIds())
+    {
+        if (json.length() > 1)
+            json.concat(',');
+        json.concat(String(captureId));
+    }
+    json.concat(']');
+    request->send(200, "application/json", json);
+}
@@ -6,8 +6,41 @@
 #include <AsyncTCP.h>
 #include <SPIFFSEditor.h>
 
+#if __has_include("StaticAssets.h")
+#include "StaticAssets.h"
+#else
+// generated by the pre script tools/embed_assets.py in PlatformIO builds, without it (e.g. an IDE build) the web assets
+// are served from SPIFFS only
+struct StaticAsset
+{
+    const char *path;
+    const char *contentType;
+    const uint8_t *gzipped;
+    size_t length;
+    const char *etag;
+    bool versioned;
+};
+static const StaticAsset staticAssets[] = {};
+#endif
+
 AsyncWebServer asyncWebServer(80);
 
+namespace
+{
+    // started from the network task once WiFi is connected, loop() runs before that
+    std::atomic<bool> webServerStarted{false};
+
+    class StaticAssetHandler : public AsyncWebHandler
+    {
+    public:
+        bool canHandle(AsyncWebServerRequest *request) override;
+        void handleRequest(AsyncWebServerRequest *request) override;
+
+    private:
+        const StaticAsset *findAsset(const String &url) const;
+    };
+}
+
 void setupWebServer()
 {
     // //Send OTA events to the browser
@@ -37,6 +70,10 @@ void setupWebServer()
 
     asyncWebServer.addHandler(new SPIFFSEditor(SPIFFS, spiffsEditorUsername, spiffsEditorPassword));
 
+    // web assets compressed at build time and served from flash, other files (e.g. the database) from SPIFFS
+    asyncWebServer.addHandler(new StaticAssetHandler());
+    asyncWebServer.serveStatic("/", SPIFFS, "/").setDefaultFile("index.htm");
+
     asyncWebServer.on("/heap", HTTP_GET, [](AsyncWebServerRequest *request) {
         request->send(200, "text/plain", String(ESP.getFreeHeap()));
     });
@@ -97,9 +134,73 @@ void setupWebServer()
     });
 
     asyncWebServer.begin();
+    webServerStarted = true;
+}
+
+const StaticAsset *StaticAssetHandler::findAsset(const String &url) const
+{
+    for (const auto &asset : staticAssets)
+    {
+        if (url == asset.path || (url == "/" && !strcmp(asset.path, "/index.htm")))
+            return &asset;
+    }
+    return nullptr;
+}
+
+bool StaticAssetHandler::canHandle(AsyncWebServerRequest *request)
+{
+    if (request->method() != HTTP_GET || !findAsset(request->url()))
+        return false;
+    request->addInterestingHeader("If-None-Match");
+    request->addInterestingHeader("Accept-Encoding");
+    return true;
+}
+
+void StaticAssetHandler::handleRequest(AsyncWebServerRequest *request)
+{
+    const StaticAsset &asset = *findAsset(request->url());
+    // versioned assets change their url with their content, everything else is revalidated with the ETag
+    const char *cacheControl = asset.versioned ? "public, max-age=31536000, immutable" : "no-cache";
+    AsyncWebServerResponse *response;
+
+    // clients that don't take gzip get the uncompressed file from SPIFFS (data/ is uploaded there as well), the ETag
+    // is only for the gzipped asset
+    bool acceptsGzip = request->hasHeader("Accept-Encoding") && request->header("Accept-Encoding").indexOf("gzip") >= 0;
+    if (!acceptsGzip)
+    {
+        if (SPIFFS.exists(asset.path))
+        {
+            response = request->beginResponse(SPIFFS, asset.path, asset.contentType);
+            response->addHeader("Cache-Control", "no-cache");
+        }
+        else
+            response = request->beginResponse(406, "text/plain", "Only available gzip encoded");
+        response->addHeader("Vary", "Accept-Encoding");
+        request->send(response);
+        return;
+    }
+
+    if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == asset.etag)
+    {
+        response = request->beginResponse(304);
+        response->addHeader("Vary", "Accept-Encoding");
+        response->addHeader("ETag", asset.etag);
+        response->addHeader("Cache-Control", cacheControl);
+        request->send(response);
+        return;
+    }
+
+    response = request->beginResponse_P(200, asset.contentType, asset.gzipped, asset.length);
+    response->addHeader("Content-Encoding", "gzip");
+    response->addHeader("Vary", "Accept-Encoding");
+    response->addHeader("ETag", asset.etag);
+    response->addHeader("Cache-Control", cacheControl);
+    request->send(response);
 }
 
 void loopWebServer()
 {
+    if (!webServerStarted)
+        return;
     ArduinoOTA.handle();
 }
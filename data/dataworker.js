@@ -0,0 +1,102 @@
+// Fetches /data responses and turns the rows into columns off the main thread. The typed arrays are transferred
+// back to the page without copying, so even large ranges do not block the chart.
+
+// The body is parsed while it streams in, straight from the bytes into the columns, instead of response.json()
+// building an array per row first (1M rows are ~1M arrays and 3M numbers on the heap before the columns exist).
+class RowParser {
+  constructor(capacity = 4096) {
+    this.columns = [new Float64Array(capacity), new Float32Array(capacity), new Float32Array(capacity)];
+    this.length = 0;
+    this.depth = 0;
+    this.column = 0;
+    this.startValue();
+  }
+
+  // rows are [timestamp,current,voltage], further columns are ignored, null is NaN
+  push(bytes) {
+    for (let i = 0; i < bytes.length; i++) {
+      const c = bytes[i];
+      if (c >= 48 && c <= 57) { // 0-9
+        if (this.inExponent) { this.exponent = this.exponent * 10 + c - 48; }
+        else { this.mantissa = this.mantissa * 10 + c - 48; this.fractionDigits += this.inFraction; }
+      } else if (c === 44 || c === 93) { // , ]
+        if (this.depth === 2) { this.endValue(); }
+        if (c === 93 && --this.depth === 1) { this.length++; }
+        else if (this.depth < 0) { throw new Error("unbalanced ]"); }
+      } else if (c === 46) { this.inFraction = 1; } // .
+      else if (c === 45) { if (this.inExponent) { this.exponentSign = -1; } else { this.sign = -1; } } // -
+      else if (c === 101 || c === 69) { this.inExponent = true; } // e E
+      else if (c === 110) { this.isNull = true; } // n of null
+      else if (c === 91 && ++this.depth === 2) { // [
+        this.column = 0;
+        this.reserve(this.length + 1);
+      }
+    }
+  }
+
+  startValue() {
+    this.mantissa = 0;
+    this.sign = 1;
+    this.fractionDigits = 0;
+    this.inFraction = 0;
+    this.inExponent = false;
+    this.exponent = 0;
+    this.exponentSign = 1;
+    this.isNull = false;
+  }
+
+  endValue() {
+    if (this.column < this.columns.length) {
+      const exponent = this.exponentSign * this.exponent - this.fractionDigits;
+      const value = exponent < 0 ? this.mantissa / 10 ** -exponent : this.mantissa * 10 ** exponent;
+      this.columns[this.column][this.length] = this.isNull ? NaN : this.sign * value;
+    }
+    this.column++;
+    this.startValue();
+  }
+
+  reserve(length) {
+    if (length <= this.columns[0].length) { return; }
+    this.columns = this.columns.map(column => {
+      const grown = new column.constructor(column.length * 2);
+      grown.set(column);
+      return grown;
+    });
+  }
+
+  finish() {
+    if (this.depth !== 0) { throw new Error("truncated response"); }
+    return this.columns.map(column => column.slice(0, this.length));
+  }
+}
+
+self.onmessage = async (event) => {
+  const { id, url } = event.data;
+  try {
+    const started = performance.now();
+    const response = await fetch(url);
+    if (!response.ok) { throw new Error(`${url}: ${response.status}`); }
+
+    // parsing overlaps the download, fetchMillis covers both
+    const parser = new RowParser();
+    const reader = response.body.getReader();
+    let parseMillis = 0;
+    while (true) {
+      const { done, value } = await reader.read();
+      if (done) { break; }
+      const parseStarted = performance.now();
+      parser.push(value);
+      parseMillis += performance.now() - parseStarted;
+    }
+    const columns = parser.finish();
+
+    self.postMessage({
+      id,
+      columns,
+      fetchMillis: performance.now() - started,
+      parseMillis,
+    }, columns.map(column => column.buffer));
+  } catch (error) {
+    self.postMessage({ id, error: error.message });
+  }
+};
@@ -0,0 +1,350 @@
+/*
+Host tool to export Esp32DataLogger.db (or a capture) to CSV or a simple columnar binary file, reading the pages
+directly with the same Sqlite Micro Logger library and column decoding (DbColumns.hpp) as the firmware.
+
+    dbexport [--from <t>] [--until <t>] [--format csv|columns] <input.db> [<output>]
+
+* The file is read into memory once. If it was not finalized (logging stopped by a reset or power loss), a copy is
+  recovered in memory like recoverDb() does on the device, a torn last page is cut off first. The input file is
+  never written.
+* --from / --until (seconds since the epoch, inclusive) position with the same binary search as /data.
+* Output goes to stdout if no output file is given.
+* The columnar format is meant for numpy & co: a 32 byte header ("DLCOLS01", the column count as uint32, 4 reserved
+  bytes, the row count as uint64, 8 reserved bytes), then per column 8 bytes type ('q' int64 or 'd' double, zero
+  padded) and 16 bytes name (zero padded), then the values of each column in turn. Everything is little endian.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ulog_sqlite.h"
+
+#include "DbColumns.hpp"
+
+namespace
+{
+    enum class Format
+    {
+        Csv,
+        Columns
+    };
+
+    struct Column
+    {
+        char type; // 'q' or 'd'
+        std::string name;
+        std::vector<int64_t> integers;
+        std::vector<double> reals;
+    };
+
+    const constexpr char *recordColumnNames[] = {"timestamp", "current_mA", "voltage_mV"};
+    const constexpr int maxPageSize = 65536;
+
+    std::vector<uint8_t> image;
+}
+
+int32_t read_fn_image(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len);
+int32_t read_fn_wimage(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
+int32_t write_fn_image(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
+int flush_fn_image(struct dblog_write_context *ctx);
+bool loadImage(const char *filename);
+bool recoverImage(uint8_t *pageBuffer);
+bool positionCursor(struct dblog_read_context *ctx, bool hasFrom, int64_t from);
+void writeCsvRow(FILE *out, struct dblog_read_context *ctx);
+void addColumnsRow(std::vector<Column> &columns, struct dblog_read_context *ctx);
+bool writeColumns(FILE *out, const std::vector<Column> &columns);
+
+int main(int argc, char **argv)
+{
+    Format format = Format::Csv;
+    bool usage = false, hasFrom = false, hasUntil = false;
+    int64_t from = 0, until = 0;
+    const char *inputFilename = nullptr, *outputFilename = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--from") && i + 1 < argc)
+        {
+            hasFrom = true;
+            from = strtoll(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--until") && i + 1 < argc)
+        {
+            hasUntil = true;
+            until = strtoll(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc && (!strcmp(argv[i + 1], "csv") || !strcmp(argv[i + 1], "columns")))
+            format = !strcmp(argv[++i], "csv") ? Format::Csv : Format::Columns;
+        else if (argv[i][0] != '-' && !inputFilename)
+            inputFilename = argv[i];
+        else if (argv[i][0] != '-' && !outputFilename)
+            outputFilename = argv[i];
+        else
+            usage = true;
+    }
+    if (usage || !inputFilename)
+    {
+        fprintf(stderr, "usage: %s [--from <t>] [--until <t>] [--format csv|columns] <input.db> [<output>]\n", argv[0]);
+        return 2;
+    }
+
+    if (!loadImage(inputFilename))
+        return 1;
+
+    static uint8_t pageBuffer[maxPageSize];
+    struct dblog_read_context ctx;
+    ctx.buf = pageBuffer;
+    ctx.read_fn = read_fn_image;
+    int res = dblog_read_init(&ctx);
+    if (res)
+    {
+        fprintf(stderr, "dblog_read_init returned error %d, recovering a copy in memory\n", res);
+        if (!recoverImage(pageBuffer))
+            return 1;
+        ctx.buf = pageBuffer;
+        ctx.read_fn = read_fn_image;
+        res = dblog_read_init(&ctx);
+        if (res)
+        {
+            fprintf(stderr, "dblog_read_init returned error %d after recovery\n", res);
+            return 1;
+        }
+    }
+
+    FILE *out = outputFilename ? fopen(outputFilename, "wb") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Error opening output file '%s'\n", outputFilename);
+        return 1;
+    }
+    static char outBuffer[1 << 20];
+    setvbuf(out, outBuffer, _IOFBF, sizeof(outBuffer));
+
+    std::vector<Column> columns;
+    uint64_t rowCount = 0;
+    if (positionCursor(&ctx, hasFrom, from))
+    {
+        do
+        {
+            double timestamp;
+            uint32_t col_type;
+            const uint8_t *col_val = (const uint8_t *)dblog_read_col_val(&ctx, 0, &col_type);
+            if (!col_val || !readDbNumber(col_val, col_type, timestamp))
+            {
+                fprintf(stderr, "Error reading the timestamp of row %llu\n", (unsigned long long)rowCount);
+                break;
+            }
+            // the binary search ends up on the row before from if there is no exact match
+            if (hasFrom && timestamp < from)
+                continue;
+            if (hasUntil && timestamp > until)
+                break;
+
+            if (format == Format::Csv)
+                writeCsvRow(out, &ctx);
+            else
+                addColumnsRow(columns, &ctx);
+            rowCount++;
+        } while (!dblog_read_next_row(&ctx));
+    }
+
+    bool result = format == Format::Csv || writeColumns(out, columns);
+    if (fclose(out) || !result)
+    {
+        fprintf(stderr, "Error writing output\n");
+        return 1;
+    }
+    fprintf(stderr, "%llu rows exported\n", (unsigned long long)rowCount);
+    return 0;
+}
+
+int32_t read_fn_image(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (pos + len > image.size())
+        return DBLOG_RES_READ_ERR;
+    memcpy(buf, &image[pos], len);
+    return len;
+}
+
+int32_t read_fn_wimage(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (pos + len > image.size())
+        return DBLOG_RES_READ_ERR;
+    memcpy(buf, &image[pos], len);
+    return len;
+}
+
+int32_t write_fn_image(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (pos + len > image.size())
+        image.resize(pos + len);
+    memcpy(&image[pos], buf, len);
+    return len;
+}
+
+int flush_fn_image(struct dblog_write_context *ctx)
+{
+    return DBLOG_RES_OK;
+}
+
+bool loadImage(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening database file '%s'\n", filename);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    image.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    bool result = fread(image.data(), 1, image.size(), file) == image.size();
+    fclose(file);
+    if (!result)
+        fprintf(stderr, "Error reading database file '%s'\n", filename);
+    return result;
+}
+
+// same as recoverDb() on the device, but on the copy in memory
+bool recoverImage(uint8_t *pageBuffer)
+{
+    struct dblog_write_context ctx;
+    ctx.buf = pageBuffer;
+    ctx.read_fn = read_fn_wimage;
+    ctx.write_fn = write_fn_image;
+    ctx.flush_fn = flush_fn_image;
+
+    int32_t pageSize = dblog_read_page_size(&ctx);
+    if (pageSize < 512 || pageSize > maxPageSize)
+    {
+        fprintf(stderr, "Page size invalid: %d\n", pageSize);
+        return false;
+    }
+    // a page that was only written in part is lost anyway
+    if (image.size() % pageSize)
+    {
+        fprintf(stderr, "Cutting off %u bytes of an incomplete last page\n", (unsigned)(image.size() % pageSize));
+        image.resize(image.size() - image.size() % pageSize);
+    }
+
+    int res = dblog_recover(&ctx);
+    if (res)
+    {
+        fprintf(stderr, "dblog_recover returned error %d\n", res);
+        return false;
+    }
+    return true;
+}
+
+// on the first row, or on the row found for from (integer or real timestamps, as the first row has them)
+bool positionCursor(struct dblog_read_context *ctx, bool hasFrom, int64_t from)
+{
+    if (dblog_read_first_row(ctx))
+        return false;
+    if (!hasFrom)
+        return true;
+
+    uint32_t col_type;
+    if (!dblog_read_col_val(ctx, 0, &col_type))
+        return false;
+    if (col_type == 7)
+    {
+        double value = from;
+        return !dblog_bin_srch_row_by_val(ctx, 0, DBLOG_TYPE_REAL, &value, sizeof(value), 0);
+    }
+    // as on the device, where time_t has 32 bits
+    int32_t value = from;
+    return !dblog_bin_srch_row_by_val(ctx, 0, DBLOG_TYPE_INT, &value, sizeof(value), 0);
+}
+
+void writeCsvRow(FILE *out, struct dblog_read_context *ctx)
+{
+    uint32_t col_type;
+    const uint8_t *col_val;
+    for (int i = 0; (col_val = (const uint8_t *)dblog_read_col_val(ctx, i, &col_type)); i++)
+    {
+        int64_t integer;
+        double real;
+        if (i)
+            putc(',', out);
+        if (readDbInteger(col_val, col_type, integer))
+            fprintf(out, "%lld", (long long)integer);
+        else if (readDbNumber(col_val, col_type, real))
+            // REAL timestamps (of captures) carry fractional seconds, the values were floats
+            fprintf(out, i ? "%.7g" : "%.6f", real);
+    }
+    putc('\n', out);
+}
+
+// the types of the columns are taken from the first row
+void addColumnsRow(std::vector<Column> &columns, struct dblog_read_context *ctx)
+{
+    uint32_t col_type;
+    const uint8_t *col_val;
+    for (size_t i = 0; (col_val = (const uint8_t *)dblog_read_col_val(ctx, i, &col_type)); i++)
+    {
+        if (i == columns.size())
+        {
+            Column column;
+            column.type = col_type == 7 ? 'd' : 'q';
+            column.name = i < sizeof(recordColumnNames) / sizeof(recordColumnNames[0]) ? recordColumnNames[i] : "c" + std::to_string(i);
+            // columns that show up later are filled up for the rows before
+            size_t rowCount = columns.size() ? std::max(columns[0].integers.size(), columns[0].reals.size()) : 0;
+            column.integers.resize(column.type == 'q' ? rowCount : 0);
+            column.reals.resize(column.type == 'd' ? rowCount : 0);
+            columns.push_back(column);
+        }
+
+        Column &column = columns[i];
+        int64_t integer = 0;
+        double real = 0;
+        if (column.type == 'q')
+        {
+            if (!readDbInteger(col_val, col_type, integer) && readDbNumber(col_val, col_type, real))
+                integer = real;
+            column.integers.push_back(integer);
+        }
+        else
+        {
+            if (!readDbNumber(col_val, col_type, real))
+                real = NAN;
+            column.reals.push_back(real);
+        }
+    }
+}
+
+bool writeColumns(FILE *out, const std::vector<Column> &columns)
+{
+    uint64_t rowCount = columns.size() ? std::max(columns[0].integers.size(), columns[0].reals.size()) : 0;
+    uint32_t header[2] = {(uint32_t)columns.size(), 0};
+    bool result = fwrite("DLCOLS01", 1, 8, out) == 8 && fwrite(header, sizeof(header), 1, out) == 1 && fwrite(&rowCount, sizeof(rowCount), 1, out) == 1;
+    // plus 8 bytes to make the header 32 bytes
+    result = result && fwrite("\0\0\0\0\0\0\0\0", 1, 8, out) == 8;
+
+    for (const Column &column : columns)
+    {
+        char type[8] = {column.type};
+        char name[16] = {};
+        strncpy(name, column.name.c_str(), sizeof(name));
+        result = result && fwrite(type, sizeof(type), 1, out) == 1 && fwrite(name, sizeof(name), 1, out) == 1;
+    }
+    for (const Column &column : columns)
+    {
+        // rows without this column (shorter rows) are padded with 0 / NaN
+        const int64_t integerPadding = 0;
+        const double realPadding = NAN;
+        size_t count = column.type == 'q' ? column.integers.size() : column.reals.size();
+        const void *values = column.type == 'q' ? (const void *)column.integers.data() : (const void *)column.reals.data();
+        const void *padding = column.type == 'q' ? (const void *)&integerPadding : (const void *)&realPadding;
+        result = result && fwrite(values, 8, count, out) == count;
+        for (size_t i = count; i < rowCount; i++)
+            result = result && fwrite(padding, 8, 1, out) == 1;
+    }
+    return result;
+}
@@ -0,0 +1,144 @@
+# Decodes deferred log entries (firmware built with -D LOG_DEFERRED, see LogRing.hpp) into regular log lines.
+#
+# The entries only hold the addresses of format strings, tags, file and function names, so these are looked up in
+# the ELF file of the exact firmware that wrote them (.pio/build/<env>/firmware.elf). Input is either a capture of
+# the serial monitor (lines starting with "#L", everything else is passed through) or the response of /log:
+#
+#   python tools/decode_log.py .pio/build/Default/firmware.elf monitor.txt
+#   curl -s http://esp32datalogger/log | python tools/decode_log.py .pio/build/Default/firmware.elf
+
+import re
+import struct
+import sys
+
+# must match struct LogEntry in LogRing.hpp
+entry_struct = struct.Struct("<4IHBB4xq8I")
+max_words = 8
+level_letters = {1: "E", 2: "W", 3: "I", 4: "D", 5: "V"}
+
+printf_spec = re.compile(r"%([-+ #0]*)(\d+|\*)?(?:\.(\d+|\*))?(hh|h|ll|l|L|z|j|t)?([diouxXeEfFgGaAcsp%])")
+
+
+class Elf:
+    """Reads strings from the allocated sections of a 32 bit little endian ELF file."""
+
+    def __init__(self, path):
+        with open(path, "rb") as file:
+            self.data = file.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1:
+            raise ValueError(f"{path} is not a 32 bit ELF file")
+        shoff, = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2E)
+        self.sections = []
+        for index in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from("<6I", self.data, shoff + index * shentsize)
+            # no data in the file for SHT_NOBITS (.bss)
+            if addr and sh_type != 8:
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.index(b"\0", start, offset + size)
+                return self.data[start:end].decode("utf-8", "replace")
+        return None
+
+
+def format_message(elf, format, words):
+    args = iter(words)
+
+    def next_word():
+        return next(args, 0)
+
+    def next_int64(signed):
+        low, high = next_word(), next_word()
+        value = low | high << 32
+        return value - (1 << 64) if signed and value >= 1 << 63 else value
+
+    def replace(match):
+        flags, width, precision, length, conversion = match.groups()
+        if conversion == "%":
+            return "%"
+        if width == "*":
+            width = str(struct.unpack("<i", struct.pack("<I", next_word()))[0])
+        if precision == "*":
+            precision = str(struct.unpack("<i", struct.pack("<I", next_word()))[0])
+        spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "")
+
+        if conversion in "di":
+            value = next_int64(True) if length == "ll" else struct.unpack("<i", struct.pack("<I", next_word()))[0]
+            return (spec + "d") % value
+        if conversion in "ouxX":
+            value = next_int64(False) if length == "ll" else next_word()
+            return (spec + conversion.replace("u", "d")) % value
+        if conversion in "eEfFgGaA":
+            value, = struct.unpack("<d", struct.pack("<II", next_word(), next_word()))
+            return (spec + conversion.lower().replace("a", "e")) % value
+        if conversion == "c":
+            return (spec + "c") % chr(next_word() & 0xFF)
+        if conversion == "s":
+            address = next_word()
+            string = elf.string(address)
+            return (spec + "s") % (string if string is not None else f"<0x{address:08x}>")
+        # p
+        return f"0x{next_word():08x}"
+
+    return printf_spec.sub(replace, format)
+
+
+def decode_entry(elf, sequence, entry):
+    format, tag, file, function, line, level, word_count, micros, *words = entry_struct.unpack(entry)
+    truncated = word_count > max_words
+    format_string = elf.string(format)
+    if format_string is None:
+        message = f"<unknown format 0x{format:08x}>"
+    else:
+        message = format_message(elf, format_string, words[:min(word_count, max_words)])
+    if truncated:
+        message += " [arguments truncated]"
+    return "%s (%d.%03d) %s: [%s:%u] %s(): %s  #%u" % (
+        level_letters.get(level, "?"), micros // 1000000, micros // 1000 % 1000, elf.string(tag), elf.string(file),
+        line, elf.string(function), message.rstrip("\n"), sequence)
+
+
+def decode_text(elf, text):
+    for line in text.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[0] == "#L" and parts[1] == "lost":
+            print(f"*** {parts[2]} log entries lost ***")
+        elif len(parts) == 3 and parts[0] == "#L":
+            print(decode_entry(elf, int(parts[1]), bytes.fromhex(parts[2])))
+        else:
+            print(line)
+
+
+def decode_binary(elf, data):
+    record_size = 4 + entry_struct.size
+    expected = None
+    for offset in range(0, len(data) - record_size + 1, record_size):
+        sequence, = struct.unpack_from("<I", data, offset)
+        if expected is not None and sequence != expected:
+            print(f"*** {sequence - expected} log entries lost ***")
+        print(decode_entry(elf, sequence, data[offset + 4:offset + record_size]))
+        expected = sequence + 1
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(f"usage: {sys.argv[0]} firmware.elf [serial capture or /log response]")
+    elf = Elf(sys.argv[1])
+    if len(sys.argv) == 3:
+        with open(sys.argv[2], "rb") as file:
+            data = file.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    if data.startswith(b"#L") or b"\n#L " in data:
+        decode_text(elf, data.decode("utf-8", "replace"))
+    else:
+        decode_binary(elf, data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,91 @@
+# PlatformIO pre script: gzips the web assets from data/ into a header that is compiled into the firmware, so they
+# are served from flash with strong ETags instead of being read uncompressed from SPIFFS for every page load.
+#
+# References from index.htm to the other assets (src, href and worker scripts) get their content hash appended
+# (?v=...), so those can be cached by the browser for a long time while index.htm itself is always revalidated.
+
+import gzip
+import hashlib
+import os
+import re
+
+Import("env")
+
+content_types = {
+    ".htm": "text/html",
+    ".html": "text/html",
+    ".js": "application/javascript",
+    ".css": "text/css",
+}
+
+data_dir = os.path.join(env.subst("$PROJECT_DIR"), "data")
+generated_dir = os.path.join(env.subst("$BUILD_DIR"), "generated")
+header_path = os.path.join(generated_dir, "StaticAssets.h")
+
+
+def content_hash(content):
+    return hashlib.sha256(content).hexdigest()[:16]
+
+
+def embed_assets():
+    names = sorted(name for name in os.listdir(data_dir) if os.path.splitext(name)[1] in content_types)
+    contents = {}
+    for name in names:
+        with open(os.path.join(data_dir, name), "rb") as file:
+            contents[name] = file.read()
+
+    hashes = {name: content_hash(contents[name]) for name in names if not name.endswith((".htm", ".html"))}
+    for name in names:
+        if name in hashes:
+            continue
+        html = contents[name].decode("utf-8")
+        for asset, asset_hash in hashes.items():
+            html = re.sub(r'((?:src|href)="|new Worker\(")' + re.escape(asset) + '"', r"\g<1>" + asset + "?v=" + asset_hash + '"', html)
+        contents[name] = html.encode("utf-8")
+
+    lines = [
+        "#pragma once",
+        "",
+        "// generated by tools/embed_assets.py from data/, do not edit",
+        "",
+        "struct StaticAsset",
+        "{",
+        "    const char *path;",
+        "    const char *contentType;",
+        "    const uint8_t *gzipped;",
+        "    size_t length;",
+        "    const char *etag;",
+        "    bool versioned; // referenced with its hash in the url, so it can be cached for good",
+        "};",
+        "",
+    ]
+    for index, name in enumerate(names):
+        # mtime 0 keeps the output stable, so unchanged assets do not trigger a rebuild
+        gzipped = gzip.compress(contents[name], compresslevel=9, mtime=0)
+        lines.append("static const uint8_t staticAsset%d[] PROGMEM = {" % index)
+        for pos in range(0, len(gzipped), 32):
+            lines.append("    " + ",".join(str(byte) for byte in gzipped[pos:pos + 32]) + ",")
+        lines.append("};")
+        print("Embedding %s: %d -> %d bytes" % (name, len(contents[name]), len(gzipped)))
+
+    lines.append("")
+    lines.append("static const StaticAsset staticAssets[] = {")
+    for index, name in enumerate(names):
+        lines.append('    {"/%s", "%s", staticAsset%d, sizeof(staticAsset%d), "\\"%s\\"", %s},' % (
+            name, content_types[os.path.splitext(name)[1]], index, index, content_hash(contents[name]),
+            "true" if name in hashes else "false"))
+    lines.append("};")
+    lines.append("")
+    header = "\n".join(lines)
+
+    os.makedirs(generated_dir, exist_ok=True)
+    if os.path.exists(header_path):
+        with open(header_path) as file:
+            if file.read() == header:
+                return
+    with open(header_path, "w") as file:
+        file.write(header)
+
+
+embed_assets()
+env.Append(CPPPATH=[generated_dir])
@@ -0,0 +1,659 @@
+/*
+Host replay harness for the logging pipeline: feeds a recorded or synthetic current / voltage trace into the same
+record ring, flush scheduler, live cache and Sqlite Micro Logger database as the firmware (DataLogger.cpp), at a
+multiple of real time, while simulated /data clients and live stream subscribers read concurrently. Every report
+interval it prints queue depth, drops, flush latency and query latency, so capacity limits show up on the host.
+
+    replay [options]
+      --speed <x>             simulated seconds per real second (10)
+      --duration <s>          simulated seconds to run (600)
+      --trace <file.csv>      timestamp,current,voltage rows as written by tools/dbexport (synthetic if not given)
+      --queue <n>             record queue length (300, as in setup())
+      --policy <name>         overflow policy: drop-newest (default), drop-oldest or decimate
+      --burst <every>,<n>     every <every> seconds the sampler stalls for <n> seconds and then catches up at once
+      --jump <every>,<s>      every <every> seconds the clock jumps by <s> seconds (negative: backwards)
+      --data-clients <n>      simulated /data clients (2), each querying every --query-every seconds (5)
+      --max-points <n>        maxPoints of the /data queries (1000)
+      --stream-clients <n>    simulated live stream subscribers (4)
+      --page-write-ms <ms>    real time added to every page write to model the flash (0)
+      --report <s>            report interval in simulated seconds (10)
+      --db <file>             database file, deleted at start (replay.db)
+
+Enqueueing with the overflow policy, waking up the flush task, draining the queue into the database and reading the
+rows of a range are the firmware's own code (RecordPipeline.hpp). The database mutex and the /data reads follow
+DataLogger.cpp: writers have priority, readers hold the mutex for slices of at most 50 ms with their own file
+handle. Spilling to flash and the HTTP layer are not simulated. Failing appends are reported on stderr and counted
+as dropped.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "ulog_sqlite.h"
+
+#include "DbColumns.hpp"
+#include "Downsampler.hpp"
+#include "FlushScheduler.hpp"
+#include "LiveCache.hpp"
+#include "Metrics.hpp"
+#include "RecordPipeline.hpp"
+#include "RecordRing.hpp"
+
+namespace
+{
+    struct Options
+    {
+        double speed = 10;
+        uint32_t durationSeconds = 600;
+        const char *traceFilename = nullptr;
+        size_t queueLength = 300;
+        OverflowPolicy policy = OverflowPolicy::DropNewest;
+        uint32_t burstEverySeconds = 0;
+        uint32_t burstSeconds = 0;
+        uint32_t jumpEverySeconds = 0;
+        int32_t jumpSeconds = 0;
+        int dataClients = 2;
+        uint32_t queryEverySeconds = 5;
+        uint32_t maxPoints = 1000;
+        int streamClients = 4;
+        uint32_t pageWriteMillis = 0;
+        uint32_t reportEverySeconds = 10;
+        const char *dbFilename = "replay.db";
+    };
+
+    struct HostRecord
+    {
+        int32_t timestamp;
+        float currentMilliAmps;
+        float voltageMilliVolts;
+    };
+
+    // a /data response in progress, ctx must stay the first member (see read_fn_cursor)
+    struct Cursor
+    {
+        struct dblog_read_context ctx;
+        FILE *file;
+        uint8_t pageBuffer[1 << 12];
+    };
+
+    // latencies of one report interval
+    class LatencyLog
+    {
+    public:
+        void add(uint32_t micros)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            values.push_back(micros);
+        }
+
+        std::vector<uint32_t> take()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<uint32_t> result;
+            result.swap(values);
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<uint32_t> values;
+    };
+
+    const constexpr int dbPageSizeExp = 12;
+    const constexpr int64_t dbSliceMicros = 50 * 1000;
+    const constexpr uint32_t flushCheckMillis = 1000;
+
+    Options options;
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<bool> running{true};
+    int32_t startTimestamp;
+
+    RecordRing<HostRecord> recordRing;
+    uint32_t decimateCounter;
+    FlushWakeup flushWakeup;
+    FlushScheduler flushScheduler(1 << dbPageSizeExp, (1 << dbPageSizeExp) / 30);
+    std::mutex flushMutex;
+    std::condition_variable flushNotify;
+    bool flushRequested;
+
+    LiveCache liveCache;
+    std::mutex liveCacheMutex;
+    std::atomic<int32_t> newestTimestamp{0};
+
+    std::mutex dbMutex;
+    std::atomic<int> dbMutexWaiters{0};
+    FILE *dbFile;
+    uint32_t flushBytesWritten;
+    uint32_t flushLastPageWritten;
+
+    MetricCounter recordsAdded, recordsDropped, recordsDecimated, appendErrors, flushes, cacheQueries, dbQueries, rowsRead, streamSamples, streamMissed;
+    MetricMax queueHighWater, streamLagSeconds;
+    LatencyLog flushLatency, queryLatency;
+}
+
+bool parseOptions(int argc, char **argv);
+int64_t simMillis();
+void sleepSim(uint32_t millis);
+int64_t nowMicros();
+void producerTask();
+bool nextTraceValues(FILE *trace, uint32_t second, float &current, float &voltage);
+void addRecord(const HostRecord &record);
+void flushTask();
+void flushQueue(FlushTrigger trigger);
+void dataClientTask(int client);
+bool queryCache(int32_t from, int32_t until, MinMaxDownsampler &downsampler);
+void queryDb(int32_t from, int32_t until, MinMaxDownsampler &downsampler);
+void streamClientTask();
+void report(uint32_t second);
+int32_t read_fn_cursor(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len);
+int32_t read_fn_wctx(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
+int32_t write_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
+int flush_fn(struct dblog_write_context *ctx);
+
+int main(int argc, char **argv)
+{
+    if (!parseOptions(argc, argv))
+    {
+        fprintf(stderr, "usage: %s [--speed x] [--duration s] [--trace file.csv] [--queue n] [--policy name] [--burst every,n] [--jump every,s]\n"
+                        "       [--data-clients n] [--query-every s] [--max-points n] [--stream-clients n] [--page-write-ms ms] [--report s] [--db file]\n",
+                argv[0]);
+        return 2;
+    }
+
+    remove(options.dbFilename);
+    if (!recordRing.begin(options.queueLength) || !liveCache.begin(65 * 60, 6 * 120, 30, malloc))
+    {
+        fprintf(stderr, "Error allocating queue or live cache\n");
+        return 1;
+    }
+
+    startTimestamp = time(nullptr);
+    startTime = std::chrono::steady_clock::now();
+    printf("%8s %6s %6s %7s %7s %7s %8s %8s %7s %7s %8s %8s %8s %6s %6s\n", "time", "queue", "maxQ", "added", "dropped", "flushes", "flush50", "flushMax",
+           "qCache", "qDb", "query50", "query95", "queryMax", "lag", "missed");
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(flushTask);
+    for (int i = 0; i < options.dataClients; i++)
+        threads.emplace_back(dataClientTask, i);
+    for (int i = 0; i < options.streamClients; i++)
+        threads.emplace_back(streamClientTask);
+    producerTask();
+
+    running = false;
+    flushNotify.notify_all();
+    for (auto &thread : threads)
+        thread.join();
+    flushQueue(FlushTrigger::Manual);
+    report(options.durationSeconds);
+
+    FlushStats stats = flushScheduler.getStats();
+    printf("\nflushes: %u (pageFull %u, highWater %u, maxAge %u), records: %u, records per page: %u, write amplification: %.2f, max flush: %u ms\n",
+           stats.flushes, stats.flushesByTrigger[(int)FlushTrigger::PageFull], stats.flushesByTrigger[(int)FlushTrigger::HighWater],
+           stats.flushesByTrigger[(int)FlushTrigger::MaxAge], stats.recordsFlushed, stats.recordsPerPage, stats.writeAmplification, stats.maxDurationMillis);
+    printf("records added: %llu, dropped: %llu, decimated: %llu, append errors: %llu, queue high water: %u of %u\n", (unsigned long long)recordsAdded.get(),
+           (unsigned long long)recordsDropped.get(), (unsigned long long)recordsDecimated.get(), (unsigned long long)appendErrors.get(), queueHighWater.get(),
+           (unsigned)recordRing.capacity());
+    return appendErrors.get() ? 1 : 0;
+}
+
+bool parseOptions(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!value)
+            return false;
+        i++;
+
+        if (!strcmp(argv[i - 1], "--speed"))
+            options.speed = atof(value);
+        else if (!strcmp(argv[i - 1], "--duration"))
+            options.durationSeconds = atoi(value);
+        else if (!strcmp(argv[i - 1], "--trace"))
+            options.traceFilename = value;
+        else if (!strcmp(argv[i - 1], "--queue"))
+            options.queueLength = atoi(value);
+        else if (!strcmp(argv[i - 1], "--policy"))
+        {
+            // spilling to flash is not simulated
+            if (!strcmp(value, "drop-newest"))
+                options.policy = OverflowPolicy::DropNewest;
+            else if (!strcmp(value, "drop-oldest"))
+                options.policy = OverflowPolicy::DropOldest;
+            else if (!strcmp(value, "decimate"))
+                options.policy = OverflowPolicy::Decimate;
+            else
+                return false;
+        }
+        else if (!strcmp(argv[i - 1], "--burst"))
+            sscanf(value, "%u,%u", &options.burstEverySeconds, &options.burstSeconds);
+        else if (!strcmp(argv[i - 1], "--jump"))
+            sscanf(value, "%u,%d", &options.jumpEverySeconds, &options.jumpSeconds);
+        else if (!strcmp(argv[i - 1], "--data-clients"))
+            options.dataClients = atoi(value);
+        else if (!strcmp(argv[i - 1], "--query-every"))
+            options.queryEverySeconds = atoi(value);
+        else if (!strcmp(argv[i - 1], "--max-points"))
+            options.maxPoints = atoi(value);
+        else if (!strcmp(argv[i - 1], "--stream-clients"))
+            options.streamClients = atoi(value);
+        else if (!strcmp(argv[i - 1], "--page-write-ms"))
+            options.pageWriteMillis = atoi(value);
+        else if (!strcmp(argv[i - 1], "--report"))
+            options.reportEverySeconds = atoi(value);
+        else if (!strcmp(argv[i - 1], "--db"))
+            options.dbFilename = value;
+        else
+            return false;
+    }
+    return options.speed > 0 && options.reportEverySeconds && options.queryEverySeconds && options.burstSeconds < options.burstEverySeconds + !options.burstEverySeconds;
+}
+
+int64_t simMillis()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count() * options.speed / 1000;
+}
+
+void sleepSim(uint32_t millis)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(millis * 1000 / options.speed)));
+}
+
+int64_t nowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one record per simulated second like collectDataPointsTask, plus the stalls and clock jumps asked for
+void producerTask()
+{
+    FILE *trace = options.traceFilename ? fopen(options.traceFilename, "r") : nullptr;
+    if (options.traceFilename && !trace)
+        fprintf(stderr, "Error opening trace '%s', using a synthetic one\n", options.traceFilename);
+
+    int32_t clockOffset = 0;
+    std::vector<HostRecord> stalled;
+    for (uint32_t second = 0; second < options.durationSeconds; second++)
+    {
+        int64_t waitMillis = (int64_t)second * 1000 - simMillis();
+        if (waitMillis > 0)
+            sleepSim(waitMillis);
+
+        if (options.jumpEverySeconds && second && !(second % options.jumpEverySeconds))
+            clockOffset += options.jumpSeconds;
+
+        HostRecord record;
+        record.timestamp = startTimestamp + second + clockOffset;
+        nextTraceValues(trace, second, record.currentMilliAmps, record.voltageMilliVolts);
+
+        // records of a stalled sampler are all added at once at the end of the stall
+        stalled.push_back(record);
+        bool stalling = options.burstEverySeconds && second % options.burstEverySeconds >= options.burstEverySeconds - options.burstSeconds &&
+                        second % options.burstEverySeconds != options.burstEverySeconds - 1;
+        if (stalling)
+            continue;
+        for (const HostRecord &stalledRecord : stalled)
+            addRecord(stalledRecord);
+        stalled.clear();
+
+        if (!(second % options.reportEverySeconds) && second)
+            report(second);
+    }
+
+    if (trace)
+        fclose(trace);
+}
+
+// values from the trace (rewound at its end), or a slow sine with noise and occasional spikes
+bool nextTraceValues(FILE *trace, uint32_t second, float &current, float &voltage)
+{
+    static std::mt19937 random(42);
+    char line[128];
+    for (int attempt = 0; trace && attempt < 2; attempt++)
+    {
+        double timestamp;
+        while (fgets(line, sizeof(line), trace))
+            if (sscanf(line, "%lf,%f,%f", &timestamp, &current, &voltage) == 3)
+                return true;
+        rewind(trace);
+    }
+
+    std::normal_distribution<float> noise(0, 2);
+    current = 100 + 80 * sin(second * 2 * M_PI / 60) + noise(random) + (random() % 100 == 0 ? 400 : 0);
+    voltage = 5000 - current / 2 + noise(random);
+    return true;
+}
+
+// addRecord() in DataLogger.cpp: live cache first, then the queue, waking up the flush task at thresholds
+void addRecord(const HostRecord &record)
+{
+    LiveSample sample = {record.timestamp, {record.currentMilliAmps, record.voltageMilliVolts}};
+    {
+        std::lock_guard<std::mutex> lock(liveCacheMutex);
+        liveCache.add(sample);
+    }
+    newestTimestamp = record.timestamp;
+
+    recordsAdded.add();
+    switch (enqueueRecord(recordRing, options.policy, false, decimateCounter, record))
+    {
+    case EnqueueResult::Queued:
+        break;
+    case EnqueueResult::Decimated:
+        recordsDecimated.add();
+        break;
+    case EnqueueResult::QueuedDroppingOldest:
+    case EnqueueResult::Dropped:
+    case EnqueueResult::Spill:
+        recordsDropped.add();
+        break;
+    }
+
+    size_t pending = recordRing.size();
+    queueHighWater.update(pending);
+    std::lock_guard<std::mutex> lock(flushMutex);
+    if (flushWakeup.update(pending, flushScheduler.pageFullThreshold(), flushScheduler.highWaterThreshold(recordRing.capacity())))
+    {
+        flushRequested = true;
+        flushNotify.notify_one();
+    }
+}
+
+void flushTask()
+{
+    while (running)
+    {
+        FlushTrigger trigger;
+        {
+            std::unique_lock<std::mutex> lock(flushMutex);
+            flushNotify.wait_for(lock, std::chrono::microseconds((int64_t)(flushCheckMillis * 1000 / options.speed)), [] { return flushRequested || !running; });
+            flushRequested = false;
+            trigger = flushScheduler.evaluate(simMillis(), recordRing.size(), recordRing.capacity(), false, false);
+        }
+        if (trigger != FlushTrigger::None)
+            flushQueue(trigger);
+    }
+}
+
+// queueTaskFlush() without spilling
+void flushQueue(FlushTrigger trigger)
+{
+    int64_t startMicros = nowMicros();
+    dbMutexWaiters++;
+    std::unique_lock<std::mutex> dbLock(dbMutex);
+    dbMutexWaiters--;
+
+    int res;
+    bool fileExists = (dbFile = fopen(options.dbFilename, "r+b")) != nullptr;
+    struct dblog_write_context ctx;
+    static uint8_t dbBuffer[1 << dbPageSizeExp];
+    ctx.buf = dbBuffer;
+    ctx.col_count = 3;
+    ctx.page_size_exp = dbPageSizeExp;
+    ctx.read_fn = read_fn_wctx;
+    ctx.write_fn = write_fn;
+    ctx.flush_fn = flush_fn;
+    DrainResult drained;
+    uint32_t lastDataPage;
+    flushBytesWritten = 0;
+    flushLastPageWritten = 0;
+
+    if (!fileExists)
+        dbFile = fopen(options.dbFilename, "w+b");
+    if (!dbFile)
+    {
+        fprintf(stderr, "Error opening/creating database file '%s'\n", options.dbFilename);
+        return;
+    }
+    res = !fileExists ? dblog_write_init(&ctx) : dblog_init_for_append(&ctx);
+    if (res)
+    {
+        fprintf(stderr, "dblog_write_init or dblog_init_for_append returned error %d\n", res);
+        fclose(dbFile);
+        return;
+    }
+
+    drained = drainRecords(recordRing, options.policy == OverflowPolicy::DropOldest, [&ctx](const HostRecord &record) {
+        static uint8_t types[] = {DBLOG_TYPE_INT, DBLOG_TYPE_REAL, DBLOG_TYPE_REAL};
+        const void *values[] = {&record.timestamp, &record.currentMilliAmps, &record.voltageMilliVolts};
+        static uint16_t lengths[] = {sizeof(int32_t), sizeof(float), sizeof(float)};
+        return dblog_append_row_with_values(&ctx, types, values, lengths);
+    });
+
+    // like queueTaskFlush(), a failed append ends the flush without finalizing
+    lastDataPage = flushLastPageWritten;
+    if (drained.error)
+    {
+        fprintf(stderr, "dblog_append_row_with_values returned error %d, dropped %zu records\n", drained.error, drained.dropped);
+        appendErrors.add();
+        recordsDropped.add(drained.dropped);
+    }
+    else if ((res = dblog_finalize(&ctx)))
+    {
+        fprintf(stderr, "dblog_finalize returned error %d\n", res);
+        appendErrors.add();
+    }
+    fclose(dbFile);
+    dbLock.unlock();
+
+    uint32_t durationMicros = nowMicros() - startMicros;
+    flushLatency.add(durationMicros);
+    flushes.add();
+    std::lock_guard<std::mutex> lock(flushMutex);
+    if (drained.appended)
+        flushScheduler.recordFlush(trigger, drained.appended, flushBytesWritten, lastDataPage, durationMicros / 1000);
+}
+
+// mostly the last minutes (chart in live mode, served from the live cache), sometimes older ranges from the database
+void dataClientTask(int client)
+{
+    std::mt19937 random(client);
+    while (running)
+    {
+        sleepSim(options.queryEverySeconds * 1000);
+        int32_t newest = newestTimestamp;
+        if (!newest)
+            continue;
+
+        int32_t length = 60 * (1 + random() % 60);
+        int32_t until = random() % 10 < 7 ? newest : startTimestamp + random() % std::max(1, newest - startTimestamp);
+        int32_t from = until - length;
+
+        MinMaxDownsampler downsampler;
+        downsampler.begin(from, until, options.maxPoints);
+        int64_t startMicros = nowMicros();
+        if (queryCache(from, until, downsampler))
+            cacheQueries.add();
+        else
+        {
+            queryDb(from, until, downsampler);
+            dbQueries.add();
+        }
+        queryLatency.add(nowMicros() - startMicros);
+    }
+}
+
+bool queryCache(int32_t from, int32_t until, MinMaxDownsampler &downsampler)
+{
+    std::lock_guard<std::mutex> lock(liveCacheMutex);
+    if (!liveCache.coversFullRes(from))
+        return false;
+
+    LiveSample rows[2];
+    for (uint32_t seq = liveCache.fullRes.lowerBound(from); seq != liveCache.fullRes.endSeq() && liveCache.fullRes.at(seq).timestamp <= until; seq++)
+    {
+        downsampler.add(liveCache.fullRes.at(seq), rows);
+        rowsRead.add();
+    }
+    downsampler.finish(rows);
+    return true;
+}
+
+// like the /data chunk callback: a slice of at most dbSliceMicros per turn, giving way to waiting writers
+void queryDb(int32_t from, int32_t until, MinMaxDownsampler &downsampler)
+{
+    Cursor *cursor = new Cursor();
+    cursor->ctx.buf = cursor->pageBuffer;
+    cursor->ctx.read_fn = read_fn_cursor;
+    DataRange range = {from, until};
+    size_t rangeIndex = 0;
+    bool rowPending = false, done = false;
+    LiveSample rows[2];
+
+    {
+        dbMutexWaiters++;
+        std::lock_guard<std::mutex> lock(dbMutex);
+        dbMutexWaiters--;
+        cursor->file = fopen(options.dbFilename, "rb");
+        rowPending = cursor->file && !dblog_read_init(&cursor->ctx) &&
+                     !dblog_bin_srch_row_by_val(&cursor->ctx, 0, DBLOG_TYPE_INT, &from, sizeof(from), 0);
+    }
+    done = !rowPending;
+
+    while (!done)
+    {
+        // AsyncTCP would call again on its next poll
+        if (dbMutexWaiters || !dbMutex.try_lock())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        int64_t sliceStartMicros = nowMicros();
+        while (nowMicros() - sliceStartMicros < dbSliceMicros)
+        {
+            double timestamp;
+            if (!nextRangeRow(&cursor->ctx, &range, 1, rangeIndex, rowPending, timestamp))
+            {
+                done = true;
+                break;
+            }
+            rowPending = false;
+
+            LiveSample sample;
+            sample.timestamp = timestamp;
+            for (int i = 1; i < 3; i++)
+            {
+                double value;
+                uint32_t col_type;
+                const uint8_t *col_val = (const uint8_t *)dblog_read_col_val(&cursor->ctx, i, &col_type);
+                sample.values[i - 1] = col_val && readDbNumber(col_val, col_type, value) ? value : 0;
+            }
+            downsampler.add(sample, rows);
+            rowsRead.add();
+        }
+        dbMutex.unlock();
+    }
+    downsampler.finish(rows);
+
+    if (cursor->file)
+        fclose(cursor->file);
+    delete cursor;
+}
+
+// reads the live cache once per simulated second like the stream publisher, measuring how far behind it is
+void streamClientTask()
+{
+    uint32_t seq;
+    {
+        std::lock_guard<std::mutex> lock(liveCacheMutex);
+        seq = liveCache.fullRes.endSeq();
+    }
+
+    LiveSample samples[64];
+    while (running)
+    {
+        sleepSim(1000);
+        std::lock_guard<std::mutex> lock(liveCacheMutex);
+        if ((int32_t)(seq - liveCache.fullRes.beginSeq()) < 0)
+            streamMissed.add(liveCache.fullRes.beginSeq() - seq);
+        size_t count;
+        while ((count = liveCache.fullRes.read(seq, samples, 64, 0)))
+        {
+            streamSamples.add(count);
+            int32_t lag = newestTimestamp - samples[count - 1].timestamp;
+            streamLagSeconds.update(lag > 0 ? lag : 0);
+        }
+    }
+}
+
+void report(uint32_t second)
+{
+    static uint64_t lastAdded, lastDropped, lastFlushes, lastCacheQueries, lastDbQueries, lastMissed;
+    auto percentile = [](const std::vector<uint32_t> &values, int percent) {
+        return values.empty() ? 0.0 : values[std::min(values.size() - 1, values.size() * percent / 100)] / 1000.0;
+    };
+
+    std::vector<uint32_t> flushMicros = flushLatency.take();
+    std::vector<uint32_t> queryMicros = queryLatency.take();
+    printf("%8u %6u %6u %7llu %7llu %7llu %8.1f %8.1f %7llu %7llu %8.1f %8.1f %8.1f %6u %6llu\n", second, (unsigned)recordRing.size(), queueHighWater.get(),
+           (unsigned long long)(recordsAdded.get() - lastAdded), (unsigned long long)(recordsDropped.get() - lastDropped),
+           (unsigned long long)(flushes.get() - lastFlushes), percentile(flushMicros, 50), percentile(flushMicros, 100),
+           (unsigned long long)(cacheQueries.get() - lastCacheQueries), (unsigned long long)(dbQueries.get() - lastDbQueries),
+           percentile(queryMicros, 50), percentile(queryMicros, 95), percentile(queryMicros, 100), streamLagSeconds.get(),
+           (unsigned long long)(streamMissed.get() - lastMissed));
+    fflush(stdout);
+
+    lastAdded = recordsAdded.get();
+    lastDropped = recordsDropped.get();
+    lastFlushes = flushes.get();
+    lastCacheQueries = cacheQueries.get();
+    lastDbQueries = dbQueries.get();
+    lastMissed = streamMissed.get();
+}
+
+int32_t read_fn_cursor(struct dblog_read_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    FILE *file = ((Cursor *)ctx)->file;
+    if (fseek(file, pos, SEEK_SET))
+        return DBLOG_RES_SEEK_ERR;
+    size_t ret = fread(buf, 1, len, file);
+    if (ret != len)
+        return DBLOG_RES_READ_ERR;
+    return ret;
+}
+
+int32_t read_fn_wctx(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (fseek(dbFile, pos, SEEK_SET))
+        return DBLOG_RES_SEEK_ERR;
+    size_t ret = fread(buf, 1, len, dbFile);
+    if (ret != len)
+        return DBLOG_RES_READ_ERR;
+    return ret;
+}
+
+int32_t write_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (fseek(dbFile, pos, SEEK_SET))
+        return DBLOG_RES_SEEK_ERR;
+    size_t ret = fwrite(buf, 1, len, dbFile);
+    if (ret != len)
+        return DBLOG_RES_ERR;
+    flushBytesWritten += len;
+    if (pos >> dbPageSizeExp > flushLastPageWritten)
+        flushLastPageWritten = pos >> dbPageSizeExp;
+    if (fflush(dbFile))
+        return DBLOG_RES_FLUSH_ERR;
+    // the flash takes its time in real time, whatever the speed of the simulation
+    if (options.pageWriteMillis)
+        std::this_thread::sleep_for(std::chrono::milliseconds(options.pageWriteMillis * ((len + (1 << dbPageSizeExp) - 1) >> dbPageSizeExp)));
+    return ret;
+}
+
+int flush_fn(struct dblog_write_context *ctx)
+{
+    return DBLOG_RES_OK;
+}
@@ -0,0 +1,365 @@
+/*
+Host benchmark of the record queue (RecordRing.hpp) against a locked queue with one lock per item, which is what
+the FreeRTOS queue it replaced costs (a critical section per xQueueSend / xQueueReceive):
+
+* producer cost per record, alone and with a consumer draining concurrently
+* drain throughput of the consumer: peek + consume spans, pop() in batches (drop-oldest) and one item at a time
+* the flush path: draining a full ring straight into the Sqlite Micro Logger encoder, as queueTaskFlush() does,
+  with the pages written to memory so that only the CPU cost is measured
+
+    ringbench [--records <n>] [--queue <n>] [--flush-rounds <n>]
+      --records <n>        records per throughput run (10000000)
+      --queue <n>          ring capacity (4096)
+      --flush-rounds <n>   full rings encoded per flush run (200)
+
+Numbers are for the host CPU, on the ESP32 the ratios are what matters.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "RecordRing.hpp"
+
+#include "ulog_sqlite.h"
+
+namespace
+{
+    // same layout as Record in Main.h (time_t is 32 bit on the ESP32)
+    struct BenchRecord
+    {
+        int32_t timestamp;
+        float currentMilliAmps;
+        float voltageMilliVolts;
+    };
+
+    // one lock per item, like the FreeRTOS queue
+    class LockedQueue
+    {
+    public:
+        explicit LockedQueue(size_t queueCapacity) : capacity(queueCapacity)
+        {
+        }
+
+        bool push(const BenchRecord &item)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (items.size() >= capacity)
+                return false;
+            items.push_back(item);
+            return true;
+        }
+
+        bool pop(BenchRecord &item)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (items.empty())
+                return false;
+            item = items.front();
+            items.pop_front();
+            return true;
+        }
+
+    private:
+        std::mutex mutex;
+        std::deque<BenchRecord> items;
+        size_t capacity;
+    };
+
+    enum class Drain
+    {
+        Spans,
+        Batches,
+        Single
+    };
+
+    const constexpr int dbPageSizeExp = 12;
+
+    struct Options
+    {
+        uint64_t records = 10000000;
+        size_t queueLength = 4096;
+        int flushRounds = 200;
+    } options;
+
+    std::vector<uint8_t> dbImage;
+    // keeps the compiler from dropping the consumer loops
+    volatile float sink;
+}
+
+bool parseOptions(int argc, char **argv);
+double secondsSince(std::chrono::steady_clock::time_point start);
+BenchRecord makeRecord(uint64_t i);
+void printResult(const char *name, uint64_t records, double seconds);
+void benchProducerAlone();
+void benchConcurrent(Drain drain);
+void benchLockedConcurrent();
+void benchFlush(Drain drain);
+int32_t read_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
+int32_t write_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len);
+int flush_fn(struct dblog_write_context *ctx);
+
+int main(int argc, char **argv)
+{
+    if (!parseOptions(argc, argv))
+    {
+        fprintf(stderr, "usage: ringbench [--records <n>] [--queue <n>] [--flush-rounds <n>]\n");
+        return 1;
+    }
+
+    printf("%-44s %12s %14s\n", "benchmark", "ns/record", "records/s");
+    benchProducerAlone();
+    benchConcurrent(Drain::Spans);
+    benchConcurrent(Drain::Batches);
+    benchConcurrent(Drain::Single);
+    benchLockedConcurrent();
+    benchFlush(Drain::Spans);
+    benchFlush(Drain::Batches);
+    benchFlush(Drain::Single);
+    return 0;
+}
+
+bool parseOptions(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            return false;
+        if (!strcmp(argv[i], "--records"))
+            options.records = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--queue"))
+            options.queueLength = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--flush-rounds"))
+            options.flushRounds = atoi(argv[++i]);
+        else
+            return false;
+    }
+    return options.records && options.queueLength && options.flushRounds > 0;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+BenchRecord makeRecord(uint64_t i)
+{
+    return {(int32_t)(1600000000 + i), 1000.0f + (i % 100), 4000.0f - (i % 50)};
+}
+
+void printResult(const char *name, uint64_t records, double seconds)
+{
+    printf("%-44s %12.1f %14.0f\n", name, seconds * 1e9 / records, records / seconds);
+}
+
+// cost of addRecord() on the queue alone, the ring is emptied by the same thread whenever it is full
+void benchProducerAlone()
+{
+    RecordRing<BenchRecord> ring;
+    ring.begin(options.queueLength);
+    LockedQueue locked(ring.capacity());
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < options.records; i++)
+    {
+        if (!ring.tryPush(makeRecord(i)))
+        {
+            ring.clear();
+            ring.tryPush(makeRecord(i));
+        }
+    }
+    printResult("producer alone, ring tryPush", options.records, secondsSince(start));
+
+    BenchRecord record;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < options.records; i++)
+    {
+        if (!locked.push(makeRecord(i)))
+        {
+            while (locked.pop(record))
+                ;
+            locked.push(makeRecord(i));
+        }
+    }
+    printResult("producer alone, locked queue push", options.records, secondsSince(start));
+}
+
+// producer and consumer on their own threads, the producer retries while the ring is full
+void benchConcurrent(Drain drain)
+{
+    RecordRing<BenchRecord> ring;
+    ring.begin(options.queueLength);
+    std::atomic<bool> producerDone{false};
+    double producerSeconds = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&] {
+        auto producerStart = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < options.records; i++)
+        {
+            BenchRecord record = makeRecord(i);
+            // pop() is what the queue task uses with drop-oldest, so the producer drops as well
+            if (drain == Drain::Batches)
+                ring.pushDroppingOldest(record);
+            else
+                while (!ring.tryPush(record))
+                    std::this_thread::yield();
+        }
+        producerSeconds = secondsSince(producerStart);
+        producerDone = true;
+    });
+
+    uint64_t consumed = 0;
+    float sum = 0;
+    BenchRecord batch[32];
+    while (!producerDone || ring.size())
+    {
+        const BenchRecord *records = batch;
+        size_t count = drain == Drain::Spans ? ring.peek(records) : ring.pop(batch, drain == Drain::Batches ? 32 : 1);
+        for (size_t i = 0; i < count; i++)
+            sum += records[i].currentMilliAmps;
+        if (drain == Drain::Spans)
+            ring.consume(count);
+        consumed += count;
+        // like the queue task, give the producer the CPU when there is nothing to do (matters on a single core)
+        if (!count)
+            std::this_thread::yield();
+    }
+    double seconds = secondsSince(start);
+    producer.join();
+    sink = sum;
+
+    static const char *names[] = {"spans (peek + consume)", "pop 32 (drop oldest)", "pop 1"};
+    char name[64];
+    snprintf(name, sizeof(name), "concurrent producer, %s", names[(int)drain]);
+    printResult(name, options.records, producerSeconds);
+    snprintf(name, sizeof(name), "concurrent drain, %s", names[(int)drain]);
+    printResult(name, consumed, seconds);
+}
+
+void benchLockedConcurrent()
+{
+    LockedQueue locked(options.queueLength);
+    std::atomic<bool> producerDone{false};
+    double producerSeconds = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&] {
+        auto producerStart = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < options.records; i++)
+        {
+            BenchRecord record = makeRecord(i);
+            while (!locked.push(record))
+                std::this_thread::yield();
+        }
+        producerSeconds = secondsSince(producerStart);
+        producerDone = true;
+    });
+
+    uint64_t consumed = 0;
+    float sum = 0;
+    BenchRecord record;
+    while (true)
+    {
+        bool done = producerDone;
+        if (locked.pop(record))
+        {
+            sum += record.currentMilliAmps;
+            consumed++;
+        }
+        else if (done)
+            break;
+        else
+            std::this_thread::yield();
+    }
+    double seconds = secondsSince(start);
+    producer.join();
+    sink = sum;
+
+    printResult("concurrent producer, locked queue", options.records, producerSeconds);
+    printResult("concurrent drain, locked queue pop 1", consumed, seconds);
+}
+
+// full rings drained into the encoder like queueTaskFlush(), each round is one flush of a new database in memory
+void benchFlush(Drain drain)
+{
+    RecordRing<BenchRecord> ring;
+    ring.begin(options.queueLength);
+    static uint8_t dbBuffer[1 << dbPageSizeExp];
+    static uint8_t types[] = {DBLOG_TYPE_INT, DBLOG_TYPE_REAL, DBLOG_TYPE_REAL};
+    static uint16_t lengths[] = {sizeof(int32_t), sizeof(float), sizeof(float)};
+    uint64_t records = 0;
+    double seconds = 0;
+
+    for (int round = 0; round < options.flushRounds; round++)
+    {
+        while (ring.tryPush(makeRecord(records + ring.size())))
+            ;
+        dbImage.clear();
+
+        struct dblog_write_context ctx;
+        ctx.buf = dbBuffer;
+        ctx.col_count = 3;
+        ctx.page_size_exp = dbPageSizeExp;
+        ctx.read_fn = read_fn;
+        ctx.write_fn = write_fn;
+        ctx.flush_fn = flush_fn;
+
+        auto start = std::chrono::steady_clock::now();
+        int res = dblog_write_init(&ctx);
+        const BenchRecord *items = nullptr;
+        BenchRecord batch[32];
+        while (size_t count = drain == Drain::Spans ? ring.peek(items) : ring.pop(batch, drain == Drain::Batches ? 32 : 1))
+        {
+            if (drain != Drain::Spans)
+                items = batch;
+            for (size_t i = 0; i < count && !res; i++)
+            {
+                const void *values[] = {&items[i].timestamp, &items[i].currentMilliAmps, &items[i].voltageMilliVolts};
+                res = dblog_append_row_with_values(&ctx, types, values, lengths);
+            }
+            if (drain == Drain::Spans)
+                ring.consume(count);
+            records += count;
+        }
+        if (!res)
+            res = dblog_finalize(&ctx);
+        seconds += secondsSince(start);
+        if (res)
+        {
+            fprintf(stderr, "Encoding failed with error %d\n", res);
+            exit(1);
+        }
+    }
+
+    static const char *names[] = {"flush, spans into the encoder", "flush, pop 32 (drop oldest)", "flush, pop 1"};
+    printResult(names[(int)drain], records, seconds);
+}
+
+int32_t read_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (pos + len > dbImage.size())
+        return DBLOG_RES_READ_ERR;
+    memcpy(buf, &dbImage[pos], len);
+    return len;
+}
+
+int32_t write_fn(struct dblog_write_context *ctx, void *buf, uint32_t pos, size_t len)
+{
+    if (pos + len > dbImage.size())
+        dbImage.resize(pos + len);
+    memcpy(&dbImage[pos], buf, len);
+    return len;
+}
+
+int flush_fn(struct dblog_write_context *ctx)
+{
+    return DBLOG_RES_OK;
+}